@@ -0,0 +1,22 @@
+#!/bin/bash
+#性能测试脚本
+#用法：./run_bench.sh <解释器路径> [重复次数]
+#每个测试程序分别用栈式字节码、开启即时编译的栈式字节码和寄存器字节码运行若干次，
+#输出每次的耗时（秒）
+
+VM=${1:-../build/vm/main}
+ROUNDS=${2:-3}
+TIMEFORMAT=%U
+
+cd "$(dirname "$0")"
+for bench in *_bench.spr; do
+  for engine in stack jit register; do
+    flag=""
+    [ "$engine" = jit ] && flag="--jit"
+    [ "$engine" = register ] && flag="--register"
+    for ((i = 0; i < ROUNDS; ++i)); do
+      cost=$( { time "$VM" $flag "$bench" > /dev/null; } 2>&1 )
+      echo "$bench $engine $cost"
+    done
+  done
+done
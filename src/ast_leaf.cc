@@ -39,6 +39,24 @@ size_t ASTLeaf::getIndex() const {
   return index_;
 }
 
+void ASTLeaf::compileConstant(ObjectPtr value) {
+  auto codes = FuncObject::getCurrCompilingFunc()->getCodes();
+  switch (value->kind_) {
+    case ObjKind::INT:
+      codes->iconst(g_IntSymbols->getIndex(std::static_pointer_cast<IntObject>(value)->value_));
+      break;
+    case ObjKind::FLOAT:
+      codes->fconst(g_FloatSymbols->getIndex(
+            std::static_pointer_cast<FloatObject>(value)->value_));
+      break;
+    case ObjKind::STRING:
+      codes->sconst(g_StrSymbols->getIndex(std::static_pointer_cast<StrObject>(value)->str_));
+      break;
+    default:
+      throw ASTCompilingException("invalid constant for compiling");
+  }
+}
+
 /*********************IntToken对应的叶子节点***************************/
 
 IntTokenAST::IntTokenAST(TokenPtr token): ASTLeaf(ASTKind::LEAF_INT, token) {}
@@ -48,6 +66,8 @@ std::string IntTokenAST::info() {
 }
 
 ObjectPtr IntTokenAST::eval(__attribute__((unused)) EnvPtr env) {
+  if (index_ >= 0)
+    return g_IntSymbols->getObject(index_);
   return std::make_shared<IntObject>(getValue());
 }
 
@@ -64,6 +84,10 @@ void IntTokenAST::compile() {
   codes->iconst(index_);
 }
 
+ObjectPtr IntTokenAST::constantValue() {
+  return g_IntSymbols->getObject(index_);
+}
+
 /*********************FloatToken对应的叶子节点************************/
 
 FloatTokenAST::FloatTokenAST(TokenPtr token): ASTLeaf(ASTKind::LEAF_FLOAT, token) {}
@@ -73,6 +97,8 @@ std::string FloatTokenAST::info() {
 }
 
 ObjectPtr FloatTokenAST::eval(__attribute__((unused))EnvPtr env) {
+  if (index_ >= 0)
+    return g_FloatSymbols->getObject(index_);
   return std::make_shared<FloatObject>(getValue());
 }
 
@@ -89,6 +115,10 @@ void FloatTokenAST::compile() {
   codes->fconst(index_);
 }
 
+ObjectPtr FloatTokenAST::constantValue() {
+  return g_FloatSymbols->getObject(index_);
+}
+
 /*********************IdToken对应的叶子节点***************************/
 
 IdTokenAST::IdTokenAST(TokenPtr token): ASTLeaf(ASTKind::LEAF_Id, token) {}
@@ -102,16 +132,15 @@ ObjectPtr IdTokenAST::eval(EnvPtr env) {
     //MyDebugger::print("local: " + getId(), __FILE__, __LINE__);
     if (index_ < 0)
       throw ASTEvalException("invalid index for local variable: " + getId());
-    return env->get(index_);
+    Value local = env->get(index_);
+    if (isCellLocal())
+      return local.objectAs<Cell>()->value_.toObject();
+    return local.toObject();
   }
   else if (kind_ == IdKind::CLOSURE) {
-    //闭包变量的环境的上层环境是函数运行时局部环境，即使函数结束运行了
-    //还是存储着，直接引用即可
-    EnvPtr outerFuncEnv = env->getOuterEnv();
-    if (outerFuncEnv == nullptr)
-      throw ASTEvalException("null outer function env");
+    //闭包变量存放在闭包自己持有的单元中，即使外层函数结束运行了也还在
     //MyDebugger::print("closure: " + getId(), __FILE__, __LINE__);
-    return outerFuncEnv->get(index_);
+    return closureCell(env)->value_.toObject();
   }
   else {
     //MyDebugger::print("global: " + getId(), __FILE__, __LINE__);
@@ -121,13 +150,13 @@ ObjectPtr IdTokenAST::eval(EnvPtr env) {
 
 void IdTokenAST::assign(EnvPtr env, ObjectPtr value) {
   if (kind_ == IdKind::LOCAL) {
-    env->put(index_, value);
+    if (isCellLocal())
+      env->get(index_).objectAs<Cell>()->value_ = Value(value);
+    else
+      env->put(index_, value);
   }
   else if (kind_ == IdKind::CLOSURE) {
-    EnvPtr outerFuncEnv = env->getOuterEnv();
-    if (outerFuncEnv == nullptr)
-      throw ASTEvalException("null outer function env");
-    outerFuncEnv->put(index_, value);
+    closureCell(env)->value_ = Value(value);
   }
   else {
     env->put(getId(), value);
@@ -146,14 +175,20 @@ void IdTokenAST::preProcess(SymbolsPtr symbols) {
   else if (result >= 0) {
     kind_ = IdKind::LOCAL;
     index_ = result;
+    symbols_ = symbols;
   }
   else {
     kind_ = IdKind::CLOSURE;
-    index_ = result + 2;    //该变量在上层环境的位置
+    index_ = -2 - result;    //该变量在闭包单元表中的位置
   }
 }
 
 void IdTokenAST::compile() {
+  if (constant_ != nullptr) {
+    compileConstant(constant_);
+    return;
+  }
+
   auto func = FuncObject::getCurrCompilingFunc();
   auto codes = func->getCodes();
   if (kind_ == IdKind::GLOBAL) {
@@ -165,6 +200,9 @@ void IdTokenAST::compile() {
     codes->cload(index_);
     //MyDebugger::print(getId() + " " + std::to_string(index_), __FILE__, __LINE__);
   }
+  else if (isCellLocal()) {
+    codes->loadCell(index_);
+  }
   else {
     codes->load(index_);
     //MyDebugger::print(getId() + " " + std::to_string(index_), __FILE__, __LINE__);
@@ -181,16 +219,36 @@ void IdTokenAST::complieAssign() {
   else if (kind_ == IdKind::CLOSURE) {
     codes->cstore(index_);
   }
+  else if (isCellLocal()) {
+    codes->storeCell(index_);
+  }
   else {
     codes->store(index_);
   }
 }
 
-void IdTokenAST::compileAsRawString() {
-  auto func = FuncObject::getCurrCompilingFunc();
-  index_ = func->getRuntimeIndex(getId());
-  auto codes_ = func->getCodes();
-  codes_->rawString(index_);
+void IdTokenAST::setConstant(ObjectPtr value) {
+  constant_ = value;
+}
+
+ObjectPtr IdTokenAST::constantValue() {
+  return constant_;
+}
+
+bool IdTokenAST::isPlainLocal() const {
+  return kind_ == IdKind::LOCAL && !isCellLocal();
+}
+
+bool IdTokenAST::isCellLocal() const {
+  return symbols_ != nullptr && symbols_->isCapturedLocal(index_);
+}
+
+CellPtr IdTokenAST::closureCell(EnvPtr env) const {
+  auto funcEnv = std::dynamic_pointer_cast<ArrayEnv>(env);
+  FuncPtr func = funcEnv != nullptr ? funcEnv->function() : nullptr;
+  if (func == nullptr)
+    throw ASTEvalException("closure variable outside closure: " + getId());
+  return func->upvalue(index_);
 }
 
 /*********************StrToken对应的叶子节点*************************/
@@ -202,6 +260,9 @@ std::string StrTokenAST::info() {
 }
 
 ObjectPtr StrTokenAST::eval(__attribute__((unused)) EnvPtr env) {
+  //预处理之后直接使用常量池中的对象
+  if (index_ >= 0)
+    return g_StrSymbols->getObject(index_);
   return std::make_shared<StrObject>(getContent());
 }
 
@@ -217,3 +278,7 @@ void StrTokenAST::compile() {
   auto codes = FuncObject::getCurrCompilingFunc()->getCodes();
   codes->sconst(index_);
 }
+
+ObjectPtr StrTokenAST::constantValue() {
+  return g_StrSymbols->getObject(index_);
+}
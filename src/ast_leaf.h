@@ -30,6 +30,9 @@ public:
 
   size_t getIndex() const;
 
+  //把常量value填入对应的常量池，并生成压入该常量的指令
+  static void compileConstant(ObjectPtr value);
+
 protected:
   TokenPtr token_;
   
@@ -53,6 +56,8 @@ public:
   void preProcess(__attribute__((unused))SymbolsPtr symbols) override;
 
   void compile() override;
+
+  ObjectPtr constantValue() override;
 };
 
 /*********************FloatToken对应的叶子节点************************/
@@ -69,6 +74,8 @@ public:
   void preProcess(__attribute__((unused))SymbolsPtr symbols) override;
 
   void compile() override;
+
+  ObjectPtr constantValue() override;
 };
 
 /*********************IdToken对应的叶子节点***************************/
@@ -97,10 +104,29 @@ public:
 
   void complieAssign();
 
-  //仅当作一个字符处理，而不把它当作变量,
-  void compileAsRawString();
+  //常量传播：该变量此处的值总是常量value
+  void setConstant(ObjectPtr value);
+
+  ObjectPtr constantValue() override;
+
+  //是否是没有被lamb引用的局部变量
+  bool isPlainLocal() const;
 
   IdKind kind_ = IdKind::UNKNOWN;
+
+private:
+  //局部变量是否被lamb引用，被引用的局部变量中存放的是单元
+  //函数体预处理完之后才能确定，所以在求值和编译时查询符号表
+  bool isCellLocal() const;
+
+  //闭包变量所在的单元，env是闭包的运行时局部环境
+  CellPtr closureCell(EnvPtr env) const;
+
+  //局部变量所在函数的符号表
+  SymbolsPtr symbols_;
+
+  //常量传播得到的值，为空时按变量读取
+  ObjectPtr constant_;
 };
 
 /*********************StrToken对应的叶子节点*************************/
@@ -116,6 +142,8 @@ public:
   void preProcess(__attribute__((unused))SymbolsPtr symbols) override;
 
   void compile() override;
+
+  ObjectPtr constantValue() override;
 };
 
 #endif
@@ -2,8 +2,10 @@
 #include "ast_leaf.h"
 
 #include <cmath>
+#include <limits>
 #include "env.h"
 #include "pre_process/lamb_src.h"
+#include "vm/inliner.h"
 #include "debugger.h"
 
 
@@ -167,7 +169,18 @@ void PrimaryExprAST::compile() {
 }
 
 void PrimaryExprAST::compileSubExpr(size_t nest) {
-  if (hasPostfix(nest)) {
+  //可以内联的函数调用直接展开函数体
+  if (compileInlineCall(nest))
+    return;
+
+  if (isMethodCall(nest)) {
+    //方法调用合并成一条INVOKE指令，不单独把方法压入栈
+    compileSubExpr(nest + 2);
+    auto args = std::static_pointer_cast<ArgumentsAST>(postfix(nest));
+    args->compileParams();
+    std::static_pointer_cast<Dot>(postfix(nest + 1))->compileInvoke(args->size());
+  }
+  else if (hasPostfix(nest)) {
     compileSubExpr(nest + 1);
     postfix(nest)->compile();
   }
@@ -176,6 +189,34 @@ void PrimaryExprAST::compileSubExpr(size_t nest) {
   }
 }
 
+bool PrimaryExprAST::compileInlineCall(size_t nest) {
+  if (!hasPostfix(nest) || hasPostfix(nest + 1) || 
+      postfix(nest)->kind_ != ASTKind::LIST_ARGUMENTS)
+    return false;
+  auto id = std::dynamic_pointer_cast<IdTokenAST>(operand());
+  if (id == nullptr || id->kind_ != IdKind::GLOBAL)
+    return false;
+
+  auto args = std::static_pointer_cast<ArgumentsAST>(postfix(nest));
+  FuncPtr caller = FuncObject::getCurrCompilingFunc();
+  FuncPtr callee = Inliner::findCallee(*caller, id->getId(), args->size());
+  if (callee == nullptr)
+    return false;
+
+  args->compileParams();
+  Inliner(*caller, callee, id->getId()).emit();
+  return true;
+}
+
+bool PrimaryExprAST::isMethodCall(size_t nest) {
+  if (!hasPostfix(nest + 1))
+    return false;
+  if (postfix(nest)->kind_ != ASTKind::LIST_ARGUMENTS || 
+      postfix(nest + 1)->kind_ != ASTKind::LIST_DOT)
+    return false;
+  return !std::static_pointer_cast<Dot>(postfix(nest + 1))->isNew();
+}
+
 /**************************负值表达式*************************************/
 
 NegativeExprAST::NegativeExprAST(): ASTList(ASTKind::LIST_NEGETIVE_EXPR, false) {}
@@ -200,11 +241,34 @@ ObjectPtr NegativeExprAST::eval(EnvPtr env) {
 }
 
 void NegativeExprAST::compile() {
+  ObjectPtr value = constantValue();
+  if (value != nullptr) {
+    ASTLeaf::compileConstant(value);
+    return;
+  }
   children_[1]->compile();
   auto codes = FuncObject::getCurrCompilingFunc()->getCodes();
   codes->neg();
 }
 
+ObjectPtr NegativeExprAST::constantValue() {
+  ObjectPtr num = children_[1]->constantValue();
+  if (num == nullptr)
+    return nullptr;
+  if (num->kind_ == ObjKind::INT) {
+    //INT_MIN取负会溢出，保留运行时的行为
+    int positive = std::static_pointer_cast<IntObject>(num)->value_;
+    if (positive == std::numeric_limits<int>::min())
+      return nullptr;
+    return std::make_shared<IntObject>(-positive);
+  }
+  else if (num->kind_ == ObjKind::FLOAT) {
+    double positive = std::static_pointer_cast<FloatObject>(num)->value_;
+    return std::make_shared<FloatObject>(-positive);
+  }
+  return nullptr;
+}
+
 /***********************二元表达式******************************************/
 
 BinaryExprAST::BinaryExprAST(): ASTList(ASTKind::LIST_BINARY_EXPR, false) {}
@@ -239,10 +303,23 @@ ObjectPtr BinaryExprAST::eval(EnvPtr env) {
 }
 
 void BinaryExprAST::compile() {
+  std::string op = getOperator();
+  if (op == "=") {
+    //常量传播之后对该变量的读取都已替换为常量，不再需要赋值
+    if (leftFactor()->kind_ == ASTKind::LEAF_Id && leftFactor()->constantValue() != nullptr)
+      return;
+  }
+  else {
+    ObjectPtr value = constantValue();
+    if (value != nullptr) {
+      ASTLeaf::compileConstant(value);
+      return;
+    }
+  }
+
   //先编译右子树，再编译左子树，右子树的代码先执行，变量会置于栈底
   rightFactor()->compile();
   
-  std::string op = getOperator();
   if (op == "=") {
     auto leftTree = leftFactor();
     if (leftTree->kind_ == ASTKind::LEAF_Id) {
@@ -277,6 +354,19 @@ void BinaryExprAST::compile() {
   }
 }
 
+ObjectPtr BinaryExprAST::constantValue() {
+  std::string op = getOperator();
+  if (op == "=")
+    return nullptr;
+  ObjectPtr left = leftFactor()->constantValue();
+  if (left == nullptr)
+    return nullptr;
+  ObjectPtr right = rightFactor()->constantValue();
+  if (right == nullptr)
+    return nullptr;
+  return foldOp(left, op, right);
+}
+
 ObjectPtr BinaryExprAST::assignOp(EnvPtr env, ObjectPtr rightValue) {
   auto leftTree = leftFactor();
   if (leftTree->kind_ == ASTKind::LEAF_Id) {
@@ -484,6 +574,57 @@ void BinaryExprAST::compileOtherOp(const std::string &op) {
     throw ASTCompilingException("unknown operation for compiling: " + op);
 }
 
+ObjectPtr BinaryExprAST::foldOp(ObjectPtr left, const std::string &op, ObjectPtr right) {
+  if (left->kind_ == ObjKind::INT && right->kind_ == ObjKind::INT) {
+    long long a = std::static_pointer_cast<IntObject>(left)->value_;
+    long long b = std::static_pointer_cast<IntObject>(right)->value_;
+    long long result = 0;
+    if (op == "+")
+      result = a + b;
+    else if (op == "-")
+      result = a - b;
+    else if (op == "*")
+      result = a * b;
+    else if (op == "/" && b != 0)
+      result = a / b;
+    else
+      return nullptr;
+
+    //溢出（包括INT_MIN / -1）时保留运行时的行为
+    if (result < std::numeric_limits<int>::min() || result > std::numeric_limits<int>::max())
+      return nullptr;
+    return std::make_shared<IntObject>(static_cast<int>(result));
+  }
+
+  auto isNumber = [](ObjectPtr obj) {
+    return obj->kind_ == ObjKind::INT || obj->kind_ == ObjKind::FLOAT;
+  };
+  auto toFloat = [](ObjectPtr obj) {
+    if (obj->kind_ == ObjKind::INT)
+      return static_cast<double>(std::static_pointer_cast<IntObject>(obj)->value_);
+    return std::static_pointer_cast<FloatObject>(obj)->value_;
+  };
+  if (isNumber(left) && isNumber(right)) {
+    double a = toFloat(left);
+    double b = toFloat(right);
+    if (op == "+")
+      return std::make_shared<FloatObject>(a + b);
+    else if (op == "-")
+      return std::make_shared<FloatObject>(a - b);
+    else if (op == "*")
+      return std::make_shared<FloatObject>(a * b);
+    else if (op == "/")
+      return std::make_shared<FloatObject>(a / b);
+    return nullptr;
+  }
+
+  if (left->kind_ == ObjKind::STRING && right->kind_ == ObjKind::STRING && op == "+") {
+    return std::make_shared<StrObject>(std::static_pointer_cast<StrObject>(left)->str_ +
+        std::static_pointer_cast<StrObject>(right)->str_);
+  }
+  return nullptr;
+}
+
 /*****************************条件判断**********************************/
 
 ConditionStmntAST::ConditionStmntAST(): ASTList(ASTKind::LIST_CONDITION_STMNT, false) {}
@@ -505,6 +646,23 @@ void ConditionStmntAST::compile() {
     child->compile();
 }
 
+void ConditionStmntAST::compileBranch(bool jumpIf, std::vector<size_t> &fixups) {
+  if (children_.size() != 1)
+    throw ASTCompilingException("fatal error, error size for condition AST");
+  auto expr = children_[0];
+  if (expr->kind_ == ASTKind::LIST_AND_LOGIC) {
+    std::static_pointer_cast<AndLogicAST>(expr)->compileBranch(jumpIf, fixups);
+  }
+  else if (expr->kind_ == ASTKind::LIST_OR_LOGIC) {
+    std::static_pointer_cast<OrLogicAST>(expr)->compileBranch(jumpIf, fixups);
+  }
+  else {
+    expr->compile();
+    auto codes = FuncObject::getCurrCompilingFunc()->getCodes();
+    fixups.push_back(jumpIf ? codes->brt(0) : codes->brf(0));
+  }
+}
+
 /******************************与逻辑***********************************/
 
 AndLogicAST::AndLogicAST(): ASTList(ASTKind::LIST_AND_LOGIC, false) {}
@@ -554,6 +712,21 @@ void AndLogicAST::compile() {
   code->andLogic();
 }
 
+void AndLogicAST::compileBranch(bool jumpIf, std::vector<size_t> &fixups) {
+  auto codes = FuncObject::getCurrCompilingFunc()->getCodes();
+  if (jumpIf) {
+    //左侧为假时整体为假，跳过右侧顺序执行
+    std::vector<size_t> leftFalse;
+    leftExpr()->compileBranch(false, leftFalse);
+    rightExpr()->compileBranch(true, fixups);
+    codes->set(leftFalse, codes->nextPosition());
+  }
+  else {
+    leftExpr()->compileBranch(false, fixups);
+    rightExpr()->compileBranch(false, fixups);
+  }
+}
+
 /*****************************或逻辑************************************/
 
 OrLogicAST::OrLogicAST(): ASTList(ASTKind::LIST_OR_LOGIC, false) {}
@@ -603,6 +776,21 @@ void OrLogicAST::compile() {
   code->orLogic();
 }
 
+void OrLogicAST::compileBranch(bool jumpIf, std::vector<size_t> &fixups) {
+  auto codes = FuncObject::getCurrCompilingFunc()->getCodes();
+  if (jumpIf) {
+    leftExpr()->compileBranch(true, fixups);
+    rightExpr()->compileBranch(true, fixups);
+  }
+  else {
+    //左侧为真时整体为真，跳过右侧顺序执行
+    std::vector<size_t> leftTrue;
+    leftExpr()->compileBranch(true, leftTrue);
+    rightExpr()->compileBranch(false, fixups);
+    codes->set(leftTrue, codes->nextPosition());
+  }
+}
+
 /********************************块**************************************/
 
 BlockStmntAST::BlockStmntAST(): ASTList(ASTKind::LIST_BLOCK_STMNT, false) {}
@@ -616,8 +804,94 @@ ObjectPtr BlockStmntAST::eval(EnvPtr env) {
 }
 
 void BlockStmntAST::compile() {
-  for(auto subTree: children_)
+  auto codes = FuncObject::getCurrCompilingFunc()->getCodes();
+  for(auto subTree: children_) {
     subTree->compile();
+    //表达式语句的值不会被使用，需要从栈中弹出
+    if (isExprStmnt(subTree))
+      codes->pop();
+  }
+}
+
+void BlockStmntAST::propagateConstants() {
+  std::map<size_t, unsigned> assigns;
+  for (auto subTree: children_)
+    countAssigns(subTree, assigns);
+
+  //按语句顺序处理，之前传播的常量可以参与之后赋值右侧的折叠
+  for (size_t i = 0; i < children_.size(); ++i) {
+    auto id = assignedLocal(children_[i]);
+    if (id == nullptr || assigns[id->getIndex()] != 1)
+      continue;
+    auto assign = std::static_pointer_cast<BinaryExprAST>(children_[i]);
+    ObjectPtr value = assign->rightFactor()->constantValue();
+    if (value == nullptr)
+      continue;
+    id->setConstant(value);
+    for (size_t j = i + 1; j < children_.size(); ++j)
+      markConstant(children_[j], id->getIndex(), value);
+  }
+}
+
+void BlockStmntAST::countAssigns(ASTreePtr tree, std::map<size_t, unsigned> &assigns) {
+  if (tree == nullptr || isOtherScope(tree))
+    return;
+  auto id = assignedLocal(tree);
+  if (id != nullptr)
+    ++assigns[id->getIndex()];
+  for (int i = 0; i < tree->numChildren(); ++i)
+    countAssigns(tree->child(i), assigns);
+}
+
+void BlockStmntAST::markConstant(ASTreePtr tree, size_t index, ObjectPtr value) {
+  if (tree == nullptr || isOtherScope(tree))
+    return;
+  if (tree->kind_ == ASTKind::LEAF_Id) {
+    auto id = std::static_pointer_cast<IdTokenAST>(tree);
+    if (id->isPlainLocal() && id->getIndex() == index)
+      id->setConstant(value);
+    return;
+  }
+  for (int i = 0; i < tree->numChildren(); ++i)
+    markConstant(tree->child(i), index, value);
+}
+
+std::shared_ptr<IdTokenAST> BlockStmntAST::assignedLocal(ASTreePtr stmnt) {
+  if (stmnt->kind_ != ASTKind::LIST_BINARY_EXPR)
+    return nullptr;
+  auto binary = std::static_pointer_cast<BinaryExprAST>(stmnt);
+  if (binary->getOperator() != "=" || binary->leftFactor()->kind_ != ASTKind::LEAF_Id)
+    return nullptr;
+  auto id = std::static_pointer_cast<IdTokenAST>(binary->leftFactor());
+  return id->isPlainLocal() ? id : nullptr;
+}
+
+bool BlockStmntAST::isOtherScope(ASTreePtr tree) {
+  switch (tree->kind_) {
+    case ASTKind::LIST_DEF_STMNT:
+    case ASTKind::LIST_LAMB:
+    case ASTKind::LIST_CLASS_STMNT:
+      return true;
+    case ASTKind::LIST_DOT:
+      return tree->numChildren() > 0 && tree->child(0)->kind_ == ASTKind::LEAF_Id;
+    default:
+      return false;
+  }
+}
+
+bool BlockStmntAST::isExprStmnt(ASTreePtr subTree) {
+  switch (subTree->kind_) {
+    case ASTKind::LIST_IF_STMNT:
+    case ASTKind::LIST_WHILE_STMNT:
+    case ASTKind::LIST_RETURN:
+    case ASTKind::LIST_NULL_STMNT:
+      return false;
+    case ASTKind::LIST_BINARY_EXPR:
+      //赋值不往栈中压入结果
+      return std::dynamic_pointer_cast<BinaryExprAST>(subTree)->getOperator() != "=";
+    default:
+      return true;
+  }
 }
 
 /******************************if块*************************************/
@@ -697,8 +971,8 @@ ObjectPtr IfStmntAST::eval(EnvPtr env) {
 
 void IfStmntAST::compile() {
   CodePtr codes = FuncObject::getCurrCompilingFunc()->getCodes();
-  condition()->compile();
-  ifBrfPosition = codes->brf(0);   //0只是个占位符，需要代码全部编译完才能确定位置
+  ifBrfPositions.clear();
+  condition()->compileBranch(false, ifBrfPositions);  //跳转地址需要代码全部编译完才能确定
   thenBlock()->compile();
   blockBrPosition = codes->br(0);
   
@@ -719,16 +993,16 @@ void IfStmntAST::compile() {
   }
 
   /***把占位符修正过来***/
-  //1. ifBrfPosition跳转到elif（如果有），否则else（如果有），否则跳转到结束位置
+  //1. ifBrfPositions跳转到elif（如果有），否则else（如果有），否则跳转到结束位置
   if (elifBlockNum) {
     ElifStmntPtr elif = std::dynamic_pointer_cast<ElifStmntAST>(children_[2]);
-    codes->set(ifBrfPosition, elif->conditionPosition);
+    codes->set(ifBrfPositions, elif->conditionPosition);
   }
   else if (elseblockPosition != 0) {
-    codes->set(ifBrfPosition, elseblockPosition); 
+    codes->set(ifBrfPositions, elseblockPosition); 
   }
   else {
-    codes->set(ifBrfPosition, endPosition);
+    codes->set(ifBrfPositions, endPosition);
   }
   //2. blockBrPosition跳转到结束位置
   codes->set(blockBrPosition, endPosition);
@@ -738,13 +1012,13 @@ void IfStmntAST::compile() {
     if (elifBlockNum - count > 1) {
       //有下一个elif块
       ElifStmntPtr nextElif = std::dynamic_pointer_cast<ElifStmntAST>(children_[index+1]);
-      codes->set(elif->elifBrfPosition, nextElif->conditionPosition);
+      codes->set(elif->elifBrfPositions, nextElif->conditionPosition);
     }
     else if (elseblockPosition != 0) {
-      codes->set(elif->elifBrfPosition, elseblockPosition);
+      codes->set(elif->elifBrfPositions, elseblockPosition);
     }
     else {
-      codes->set(elif->elifBrfPosition, endPosition);
+      codes->set(elif->elifBrfPositions, endPosition);
     }
 
     codes->set(elif->blockBrPosition, endPosition);
@@ -807,8 +1081,8 @@ ObjectPtr ElifStmntAST::eval(EnvPtr env) {
 void ElifStmntAST::compile() {
   CodePtr codes = FuncObject::getCurrCompilingFunc()->getCodes();
   conditionPosition = codes->nextPosition();
-  condition()->compile();
-  elifBrfPosition = codes->brf(0);  //0是占位符
+  elifBrfPositions.clear();
+  condition()->compileBranch(false, elifBrfPositions);
   thenBlock()->compile();
   blockBrPosition = codes->br(0);
 }
@@ -859,12 +1133,12 @@ ObjectPtr WhileStmntAST::eval(EnvPtr env) {
 void WhileStmntAST::compile() {
   CodePtr codes = FuncObject::getCurrCompilingFunc()->getCodes();
   unsigned conditionPosition = codes->nextPosition();
-  condition()->compile();
-  unsigned whileBrfPosition = codes->brf(0);  //0是占位符
+  std::vector<size_t> whileBrfPositions;
+  condition()->compileBranch(false, whileBrfPositions);
   body()->compile();
   codes->br(conditionPosition);
   unsigned endPosition = codes->nextPosition();
-  codes->set(whileBrfPosition, endPosition);
+  codes->set(whileBrfPositions, endPosition);
 }
 
 /****************************Null块************************************/
@@ -930,30 +1204,38 @@ void DefStmntAST::compile() {
 void DefStmntAST::preProcess(SymbolsPtr symbols) {
   //将函数名注册到外部的符号表中
   symbols->getRuntimeIndex(funcName());
-  localVarSize_ = getLocalVarSize(symbols, parameterList(), block());
+  SymbolsPtr funcSymbols = preProcessFunction(symbols, parameterList(), block());
+  localVarSize_ = funcSymbols->getSymbolSize();
+  cellLocals_ = cellLocals(funcSymbols);
 }
 
 ObjectPtr DefStmntAST::eval(EnvPtr env) {
   FuncPtr funcObj = std::make_shared<FuncObject>(funcName(), localVarSize_,
                                 parameterList(), block(), env);
+  funcObj->setCellLocals(cellLocals_);
   env->put(funcName(), funcObj);
 
   //编译当前函数，只有函数才会编译
-  FuncObject::setCurrCompilingFunc(funcObj);
-  compile();
-  funcObj->setCompiled();
+  funcObj->compile();
 
   return nullptr;
 }
 
-size_t DefStmntAST::getLocalVarSize(SymbolsPtr outer, 
+SymbolsPtr DefStmntAST::preProcessFunction(SymbolsPtr outer, 
     ParameterListPtr params, BlockStmntPtr block) {
   //运行时符号表
   SymbolsPtr runTimeSymbols = std::make_shared<Symbols>(outer, SymbolsKind::FUNCTION);
   //参数总是局部变量中的头几个，这在字节码中，实参赋值时用到了这个潜规则
   params->preProcess(runTimeSymbols);
   block->preProcess(runTimeSymbols);
-  return runTimeSymbols->getSymbolSize();
+  return runTimeSymbols;
+}
+
+std::shared_ptr<const std::vector<size_t>> DefStmntAST::cellLocals(SymbolsPtr symbols) {
+  //函数体中的lamb预处理完之后，才能知道哪些局部变量被闭包引用
+  if (symbols->capturedLocals().empty())
+    return nullptr;
+  return std::make_shared<const std::vector<size_t>>(symbols->capturedLocals());
 }
 
 /***************************实参***********************************/
@@ -982,6 +1264,11 @@ ObjectPtr ArgumentsAST::eval(EnvPtr env, ObjectPtr caller) {
   //每次调用函数，都有创建一个新的环境，数组环境
   EnvPtr funcEnv = func->runtimeEnv();
   params->eval(funcEnv, env, children_);
+  //被lamb引用的局部变量装入单元
+  if (func->hasCellLocals()) {
+    for (size_t index: func->cellLocals())
+      funcEnv->put(index, Value(std::make_shared<Cell>(funcEnv->get(index))));
+  }
   try {
     func->block()->eval(funcEnv);
   }
@@ -995,20 +1282,31 @@ ObjectPtr ArgumentsAST::invokeNative(EnvPtr env, NativeFuncPtr func) {
   if (size() != func->paramNum())
     throw ASTEvalException("error function call, not match the number of parameters");
 
-  std::vector<ObjectPtr> params;
+  std::vector<Value> params;
+  params.reserve(children_.size());
   for (auto t: children_)
     params.push_back(t->eval(env));
 
-  return func->invoke(params);
+  return func->invoke(NativeArgs(params.data(), params.size())).toObject();
 }
 
 void ArgumentsAST::compile() {
-  for (auto iter = children_.begin(); iter != children_.end(); ++iter)
-    (*iter)->compile();
+  compileParams();
   auto codes = FuncObject::getCurrCompilingFunc()->getCodes();
   codes->call(size());
 }
 
+void ArgumentsAST::compileTailCall() {
+  compileParams();
+  auto codes = FuncObject::getCurrCompilingFunc()->getCodes();
+  codes->tailcall(size());
+}
+
+void ArgumentsAST::compileParams() {
+  for (auto iter = children_.begin(); iter != children_.end(); ++iter)
+    (*iter)->compile();
+}
+
 /**************************闭包**********************************/
 
 LambAST::LambAST(): ASTList(ASTKind::LIST_LAMB, false) {}
@@ -1026,17 +1324,32 @@ std::string LambAST::info() {
 }
 
 void LambAST::preProcess(SymbolsPtr symbols) {
-  localVarSize_ = DefStmntAST::getLocalVarSize(symbols, parameterList(), 
+  //闭包引用外层变量的分析在预处理函数体时完成，结果记录在闭包的符号表中
+  SymbolsPtr lambSymbols = DefStmntAST::preProcessFunction(symbols, parameterList(), 
       block());
+  localVarSize_ = lambSymbols->getSymbolSize();
+  cellLocals_ = DefStmntAST::cellLocals(lambSymbols);
+  upvalueSources_ = lambSymbols->upvalues();
 
   //在闭包源码表中申请一个位置并记录下来
   srcIndex_ = g_LambSrcTable->put(shared_from_this());
 }
 
-ObjectPtr LambAST::eval(EnvPtr __attribute__((unused))env) {
-  //lambda创建的闭包都用CLOSURE来表示它的函数名
-  return std::make_shared<FuncObject>("CLOSURE", localVarSize_,
-      parameterList(), block(), env);
+ObjectPtr LambAST::eval(EnvPtr env) {
+  //env是正在执行的函数的局部环境，在全局或类中创建闭包时则是全局或对象环境
+  auto funcEnv = std::dynamic_pointer_cast<ArrayEnv>(env);
+  if (funcEnv == nullptr)
+    return makeClosure(env, {});
+
+  FuncPtr func = funcEnv->function();
+  std::vector<CellPtr> upvalues;
+  for (auto &source: upvalueSources_) {
+    if (source.fromLocal)
+      upvalues.push_back(std::static_pointer_cast<Cell>(env->get(source.index).object()));
+    else
+      upvalues.push_back(func->upvalue(source.index));
+  }
+  return makeClosure(env->getOuterEnv(), std::move(upvalues));
 }
 
 void LambAST::compile() {
@@ -1044,12 +1357,19 @@ void LambAST::compile() {
   codes->lamb(srcIndex_);
 }
 
-FuncPtr LambAST::runtimeCompile(EnvPtr env) {
-  FuncPtr lambFunc = std::make_shared<FuncObject>("CLOSURE", localVarSize_, 
-      parameterList(), block(), env);
-  FuncObject::setCurrCompilingFunc(lambFunc);
-  block()->compile();
-  lambFunc->setCompiled();
+FuncPtr LambAST::makeClosure(EnvPtr env, std::vector<CellPtr> upvalues) {
+  if (compiled_ == nullptr) {
+    //原型不持有外部环境，避免第一次创建闭包时的环境一直存活
+    //lambda创建的闭包都用CLOSURE来表示它的函数名
+    compiled_ = std::make_shared<FuncObject>("CLOSURE", localVarSize_, 
+        parameterList(), block(), nullptr);
+    compiled_->setCellLocals(cellLocals_);
+    compiled_->compile();
+  }
+  //每次执行LAMB只创建一个指向共享字节码的函数对象，并设置它的外部环境和单元
+  FuncPtr lambFunc = std::static_pointer_cast<FuncObject>(compiled_->copy());
+  lambFunc->setOuterEnv(env);
+  lambFunc->setUpvalues(std::move(upvalues));
   return lambFunc;
 }
 
@@ -1179,19 +1499,27 @@ void Dot::compile() {
     children_[0]->compile();
     return;
   }
-  auto target = std::dynamic_pointer_cast<IdTokenAST>(children_[0]);
   //这里的后缀在词法处理时当作ID看待，但是实际上并不是一个存在于当前环境的变量，
-  //交给虚拟机处理时，应该当作一个字符串，通过字符串在相应的另一个环境中找到相应的变量
-  target->compileAsRawString();
-  auto codes = FuncObject::getCurrCompilingFunc()->getCodes();
-  codes->dotAccess();
+  //虚拟机通过它的名字在相应的另一个环境中找到相应的变量，并把位置记录在内联缓存中
+  auto func = FuncObject::getCurrCompilingFunc();
+  unsigned cacheIndex = func->addDotCache(func->getRuntimeIndex(name()));
+  func->getCodes()->dotAccess(cacheIndex);
 }
 
 void Dot::compileAssign() {
-  auto target = std::dynamic_pointer_cast<IdTokenAST>(children_[0]);
-  target->compileAsRawString();
-  auto codes = FuncObject::getCurrCompilingFunc()->getCodes();
-  codes->dotAssign();
+  auto func = FuncObject::getCurrCompilingFunc();
+  unsigned cacheIndex = func->addDotCache(func->getRuntimeIndex(name()));
+  func->getCodes()->dotAssign(cacheIndex);
+}
+
+void Dot::compileInvoke(unsigned paramNum) {
+  auto func = FuncObject::getCurrCompilingFunc();
+  unsigned cacheIndex = func->addDotCache(func->getRuntimeIndex(name()));
+  func->getCodes()->invoke(cacheIndex, paramNum);
+}
+
+bool Dot::isNew() {
+  return !children_.empty() && children_[0]->kind_ == ASTKind::LIST_NEW;
 }
 
 /**********************类new创建实例***************************/
@@ -1212,6 +1540,8 @@ void NewAST::compile() {
   codes->newInstance();
   ArgumentsPtr arguments = getArguments();
   arguments->compile();
+  //弹出初始化函数的返回值，栈顶留下新创建的对象
+  codes->pop();
 }
 
 ArgumentsPtr NewAST::getArguments() const {
@@ -1278,6 +1608,25 @@ void ReturnAST::compile() {
   if (children_.empty())
     throw ASTCompilingException("invalid return statement for compiling");
 
+  //可以内联的调用直接展开，不再生成尾调用
+  auto primary = std::dynamic_pointer_cast<PrimaryExprAST>(children_[0]);
+  if (primary != nullptr && primary->compileInlineCall(0)) {
+    codes->ret();
+    return;
+  }
+
+  //返回值是函数调用时生成尾调用，被调用函数复用当前栈帧
+  //调用原生函数时尾调用和普通调用相同，由之后的RET返回
+  if (primary != nullptr && primary->hasPostfix(0)) {
+    auto args = std::dynamic_pointer_cast<ArgumentsAST>(primary->postfix(0));
+    if (args != nullptr) {
+      primary->compileSubExpr(1);
+      args->compileTailCall();
+      codes->ret();
+      return;
+    }
+  }
+
   children_[0]->compile();
   codes->ret();
 }
@@ -1328,7 +1677,7 @@ ObjectPtr ArrayRefAST::eval(EnvPtr env, ObjectPtr caller) {
     }
     else {
       IntObjectPtr index = std::dynamic_pointer_cast<IntObject>(i);
-      return array->get(index->value_);
+      return array->get(index->value_).toObject();
     }
   }
   else {
@@ -2,8 +2,11 @@
 #define SPARROW_AST_LIST_H_
 
 #include "ast_tree.h"
+#include <map>
 #include <vector>
 
+class IdTokenAST;
+
 /**************************AST内部（非叶子）节点******************************/
 
 class ASTList: public ASTree {
@@ -110,6 +113,14 @@ public:
   void compile() override;
 
   void compileSubExpr(size_t nest);
+
+  //第nest层后缀是直接对全局函数名的调用f(args)，并且可以内联时，
+  //把函数体展开到调用处，返回是否展开
+  bool compileInlineCall(size_t nest);
+
+private:
+  //第nest层后缀是实参且它的下一层是域访问（不是.new），即obj.method(args)
+  bool isMethodCall(size_t nest);
 };
 using PrimaryExprPtr = std::shared_ptr<PrimaryExprAST>;
 
@@ -121,6 +132,7 @@ public:
   std::string info() override;
   ObjectPtr eval(EnvPtr env) override;
   void compile() override;
+  ObjectPtr constantValue() override;
 };
 
 /*****************************二元表达式***********************************/
@@ -133,6 +145,9 @@ public:
   std::string getOperator();
   ObjectPtr eval(EnvPtr env) override;
   void compile() override;
+
+  //两侧都是常量时在编译期求值，运算结果是布尔值或者运行时会出错时不折叠
+  ObjectPtr constantValue() override;
 private:
   //赋值操作，仅当操作符为等号时
   ObjectPtr assignOp(EnvPtr env, ObjectPtr rightValue);
@@ -151,6 +166,9 @@ private:
 
   //除了赋值操作符以外的运算符编译成字节码
   void compileOtherOp(const std::string &op);
+
+  //常量折叠，规则与虚拟机中的运算一致，不能折叠时返回空指针
+  static ObjectPtr foldOp(ObjectPtr left, const std::string &op, ObjectPtr right);
   
 private:
   void checkValid();
@@ -163,6 +181,30 @@ public:
   BlockStmntAST();
   ObjectPtr eval(EnvPtr env) override;
   void compile() override;
+
+  /**常量传播，在函数体编译前调用
+   *  局部变量在整个函数中只被赋值一次，并且这次赋值是函数体的一条语句、右侧是
+   *常量时，之后语句中对它的读取都直接使用这个常量，赋值本身不再生成指令。函数体
+   *的语句按顺序各执行一次，所以这些读取执行时变量的值一定是这个常量
+   */
+  void propagateConstants();
+
+private:
+  //是否为表达式语句，即执行后会在栈中留下一个值的语句
+  bool isExprStmnt(ASTreePtr subTree);
+
+  //tree中（不含嵌套的函数、lamb和类）每个局部变量被赋值的次数
+  static void countAssigns(ASTreePtr tree, std::map<size_t, unsigned> &assigns);
+
+  //把tree中（不含嵌套的函数、lamb和类）局部变量index的读取标记为常量value
+  static void markConstant(ASTreePtr tree, size_t index, ObjectPtr value);
+
+  //语句是否是对局部变量的赋值，是则返回被赋值的变量
+  static std::shared_ptr<IdTokenAST> assignedLocal(ASTreePtr stmnt);
+
+  //tree中的名字是否不是当前函数的局部变量：嵌套定义的函数、lamb、类属于另一个
+  //函数，.之后的名字是另一个环境中的域
+  static bool isOtherScope(ASTreePtr tree);
 };
 using BlockStmntPtr = std::shared_ptr<BlockStmntAST>;
 
@@ -175,6 +217,13 @@ public:
   std::string info() override;
   ObjectPtr eval(EnvPtr env) override;
   void compile() override;
+
+  /**把条件编译成跳转：条件的值等于jumpIf时跳转，否则顺序执行
+   *  跳转目标还未确定，跳转地址所在的位置追加到fixups中，由调用者修正。
+   *条件是and、or时逐个编译两侧的条件，结果已经确定时直接跳转，不再计算右侧，
+   *也不生成中间的布尔值
+   */
+  void compileBranch(bool jumpIf, std::vector<size_t> &fixups);
 };
 using ConditionStmntPtr =  std::shared_ptr<ConditionStmntAST>;
 
@@ -188,6 +237,9 @@ public:
   std::string info() override;
   ObjectPtr eval(EnvPtr env) override;
   void compile() override;
+
+  //短路求值，左侧为假时不再计算右侧
+  void compileBranch(bool jumpIf, std::vector<size_t> &fixups);
 };
 using AndLogicPtr = std::shared_ptr<AndLogicAST>;
 
@@ -201,6 +253,9 @@ public:
   std::string info() override;
   ObjectPtr eval(EnvPtr env) override;
   void compile() override;
+
+  //短路求值，左侧为真时不再计算右侧
+  void compileBranch(bool jumpIf, std::vector<size_t> &fixups);
 };
 using OrLogicPtr = std::shared_ptr<OrLogicAST>;
 
@@ -216,8 +271,8 @@ public:
   ObjectPtr eval(EnvPtr env) override;
   void compile() override;
 
-  //if的条件跳转在字节码中的位置
-  size_t ifBrfPosition;
+  //if条件不成立时各条跳转的跳转地址在字节码中的位置
+  std::vector<size_t> ifBrfPositions;
   
   //thenblock结束后无条件跳转在字节码中的位置
   size_t blockBrPosition;
@@ -247,8 +302,8 @@ public:
   //condition的起始地址
   size_t conditionPosition;
 
-  //elif跳转位置在字节码中的地址
-  size_t elifBrfPosition;
+  //elif条件不成立时各条跳转的跳转地址在字节码中的位置
+  std::vector<size_t> elifBrfPositions;
 
   //thenblock结束后无条件跳转在字节码中的位置
   size_t blockBrPosition;
@@ -320,13 +375,20 @@ public:
   //返回空指针
   ObjectPtr eval(EnvPtr env) override;
 
-  //获取函数运行时环境的局部变量所占空间大小
-  static size_t getLocalVarSize(SymbolsPtr outer, ParameterListPtr params, 
+  //预处理形参和函数体，返回函数的运行时符号表
+  //符号表中记录了局部变量的个数、被lamb引用的局部变量以及lamb引用的外层变量
+  static SymbolsPtr preProcessFunction(SymbolsPtr outer, ParameterListPtr params, 
       BlockStmntPtr block);
 
+  //被lamb引用的局部变量的下标，由函数对象共享，没有则返回空指针
+  static std::shared_ptr<const std::vector<size_t>> cellLocals(SymbolsPtr symbols);
+
 private:
   //函数局部变量所需大小
   size_t localVarSize_;
+
+  //被函数体中的lamb引用的局部变量
+  std::shared_ptr<const std::vector<size_t>> cellLocals_;
 };
 
 /************************后缀表达式接口*****************************/
@@ -358,6 +420,12 @@ public:
   //逆序把实参压入栈，并压入调用指令
   void compile() override;
 
+  //同compile，但压入尾调用指令，用于return f(...)
+  void compileTailCall();
+
+  //把实参依次压入栈
+  void compileParams();
+
 private:
   //调用原生函数
   ObjectPtr invokeNative(EnvPtr env, NativeFuncPtr func);
@@ -381,13 +449,28 @@ public:
 
   void compile() override;
 
-  //运行时编译，并返回一个函数对象
-  FuncPtr runtimeCompile(EnvPtr env);
+  //创建闭包，env是外层函数的外部环境，upvalues是按upvalueSources()取得的单元
+  //闭包体只在第一次执行时编译，之后创建的闭包共享编译结果
+  FuncPtr makeClosure(EnvPtr env, std::vector<CellPtr> upvalues);
+
+  //闭包引用的外层变量的来源
+  const std::vector<UpvalueSource> &upvalueSources() const {
+    return upvalueSources_;
+  }
 
 private:
   //函数运行时环境的局部变量大小
   size_t localVarSize_;
 
+  //编译好的闭包原型，不带外部环境，字节码和非局部变量名称表由它的副本共享
+  FuncPtr compiled_ = nullptr;
+
+  //被内层的lamb引用的局部变量
+  std::shared_ptr<const std::vector<size_t>> cellLocals_;
+
+  //引用的外层变量的来源
+  std::vector<UpvalueSource> upvalueSources_;
+
   //闭包在源码表中的位置
   unsigned srcIndex_;
 };
@@ -443,6 +526,12 @@ public:
   void compile() override;
 
   void compileAssign();
+
+  //方法调用obj.method(args)，接收者和实参已经依次压入栈，生成INVOKE指令
+  void compileInvoke(unsigned paramNum);
+
+  //是否为.new创建实例
+  bool isNew();
 };
 using DotPtr = std::shared_ptr<Dot>;
 
@@ -480,6 +569,7 @@ public:
 
   std::string info() override;
 
+  //返回值是函数调用（return f(...)）时生成尾调用
   void compile() override;
 };
 using ReturnASTPtr = std::shared_ptr<ReturnAST>;
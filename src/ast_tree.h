@@ -128,6 +128,11 @@ public:
     //默认情况下不需要进行任何处理
   }
 
+  //表达式在编译期就能确定的值（整数、浮点数或字符串），不是常量时返回空指针
+  virtual ObjectPtr constantValue() {
+    return nullptr;
+  }
+
 public:
   //AST类型
   ASTKind kind_;
@@ -1,11 +1,16 @@
 #include "env.h"
 #include "ast_list.h"
+#include "vm/reg_code.h"
+#include "vm/peephole.h"
+#include "vm/ir_pass.h"
 
 #include "debugger.h"
 
 /*****************************函数 类型******************************/
 FuncPtr FuncObject::complingFunc = nullptr;
 
+CompileTarget FuncObject::compileTarget = CompileTarget::STACK;
+
 FuncPtr FuncObject::getCurrCompilingFunc() {
   return complingFunc;
 }
@@ -21,6 +26,8 @@ FuncObject::FuncObject(const std::string &functionName, size_t size,
   env_(env), params_(params), block_(block){
   codes_ = std::make_shared<Code>();
   outerNames_ = std::make_shared<std::vector<std::string>>();
+  dotCaches_ = std::make_shared<std::vector<DotCache>>();
+  inlineGuards_ = std::make_shared<std::vector<InlineGuard>>();
 }
 
 std::shared_ptr<ParameterListAST> FuncObject::params() const {
@@ -33,18 +40,32 @@ std::shared_ptr<BlockStmntAST> FuncObject::block() const {
 
 void FuncObject::setOuterEnv(EnvPtr env) {
   env_ = env;
+  nonLocalEnv_ = nullptr;
+  globalRefs_.clear();
 }
 
 EnvPtr FuncObject::runtimeEnv() {
   return std::make_shared<ArrayEnv>(env_, shared_from_this(), localVarSize_);
 }
 
+EnvPtr FuncObject::nonLocalEnv() {
+  if (nonLocalEnv_ == nullptr)
+    nonLocalEnv_ = std::make_shared<ArrayEnv>(env_, shared_from_this(), 0);
+  return nonLocalEnv_;
+}
+
 ObjectPtr FuncObject::copy() {
   FuncPtr copyFunc = std::make_shared<FuncObject>(funcName_, localVarSize_, 
       params_, block_, env_);
   copyFunc->codes_ = codes_;
+  copyFunc->regCodes_ = regCodes_;
   copyFunc->outerNames_ = outerNames_;
+  copyFunc->dotCaches_ = dotCaches_;
+  copyFunc->inlineGuards_ = inlineGuards_;
+  copyFunc->tempLocalSize_ = tempLocalSize_;
   copyFunc->isCompile_ = isCompile_;
+  copyFunc->cellLocals_ = cellLocals_;
+  copyFunc->upvalues_ = upvalues_;
   return copyFunc;
 }
 
@@ -57,6 +78,57 @@ unsigned FuncObject::getRuntimeIndex(const std::string &name) {
   return outerNames_->size() - 1;
 }
 
+const GlobalRef &FuncObject::resolveGlobal(unsigned index) {
+  if (index >= globalRefs_.size())
+    globalRefs_.resize(outerNames_->size());
+  GlobalRef &ref = globalRefs_[index];
+  unsigned long version = CommonEnv::layoutVersion();
+  if (ref.kind != GlobalRef::Kind::UNRESOLVED && ref.version == version)
+    return ref;
+
+  //和ArrayEnv::get的查找顺序一致
+  const std::string &name = (*outerNames_)[index];
+  ref = GlobalRef();
+  if (name == "self")
+    ref.kind = GlobalRef::Kind::OUTER_ENV;
+  else if (name == funcName_)
+    ref.kind = GlobalRef::Kind::FUNCTION;
+  else if (env_ != nullptr && env_->locateSlot(name, ref.env, ref.slot))
+    ref.kind = GlobalRef::Kind::SLOT;
+  //查找过程中可能有环境首次被访问，但不会改变环境结构
+  ref.version = version;
+  return ref;
+}
+
+unsigned FuncObject::addDotCache(unsigned nameIndex) {
+  DotCache cache;
+  cache.nameIndex = nameIndex;
+  dotCaches_->push_back(cache);
+  return dotCaches_->size() - 1;
+}
+
+unsigned FuncObject::addInlineGuard(unsigned nameIndex, FuncPtr callee) {
+  InlineGuard guard;
+  guard.nameIndex = nameIndex;
+  guard.callee = callee;
+  inlineGuards_->push_back(guard);
+  return inlineGuards_->size() - 1;
+}
+
+bool FuncObject::inlineGuardHolds(unsigned index) {
+  const InlineGuard &guard = (*inlineGuards_)[index];
+  const GlobalRef &ref = resolveGlobal(guard.nameIndex);
+  return ref.kind == GlobalRef::Kind::SLOT && 
+    ref.env->getSlot(ref.slot).get() == guard.callee.get();
+}
+
+size_t FuncObject::addTempLocals(size_t size) {
+  size_t first = localVarSize_;
+  localVarSize_ += size;
+  tempLocalSize_ += size;
+  return first;
+}
+
 std::shared_ptr<std::vector<std::string>> FuncObject::getOuterNames() {
   return outerNames_;
 }
@@ -67,7 +139,38 @@ bool FuncObject::isCompile() {
 
 void FuncObject::compile() {
   FuncObject::setCurrCompilingFunc(shared_from_this()); 
+  block_->propagateConstants();
   block_->compile();
+  //函数末尾总是补上返回空对象的RET指令，虚拟机执行时不再需要检查指令计数器是否越界
+  codes_->nconst();
+  codes_->ret();
+
+  //在中间表示上做复制传播、公共子表达式删除等优化，优化遍新增的临时变量加到局部变量中
+  static const std::vector<size_t> noCellLocals;
+  size_t localSize = localVarSize_;
+  PassManager passes = PassManager::standard();
+  passes.run(*codes_, localSize, hasCellLocals() ? cellLocals() : noCellLocals);
+  passes.report(funcName());
+  addTempLocals(localSize - localVarSize_);
+
+  //之后再经过窥孔优化，两种编译目标都使用优化后的字节码
+  Peephole peephole(*codes_);
+  peephole.run();
+  peephole.report(funcName());
+
+  if (compileTarget == CompileTarget::REGISTER) {
+    //寄存器字节码按栈深度分配临时寄存器，由未合并超级指令的字节码翻译而来
+    codes_->calcMaxStackDepth();
+    regCodes_ = RegCode::translate(*codes_, localVarSize_);
+    setCompiled();
+    return;
+  }
+#ifndef SPARROW_OPCODE_PROFILE
+  //超级指令直接读写栈帧窗口中的局部变量
+  //统计指令序列时不做合并，以便得到原始指令的执行情况
+  codes_->fuseSuperInstructions();
+#endif
+  codes_->calcMaxStackDepth();
   setCompiled();
 }
 
@@ -75,6 +178,69 @@ void FuncObject::setCompiled() {
   isCompile_ = true;
 }
 
+/***************************域访问缓存*******************************/
+
+MapEnv *DotCache::lookup(MapEnv *receiver, size_t &result) const {
+  for (size_t i = 0; i < size; ++i) {
+    const DotCacheEntry &entry = entries[i];
+    MapEnv *env = receiver;
+    size_t depth = 0;
+    //每层环境的形状都相同，说明成员仍然位于同一层环境的同一个槽位
+    while (env != nullptr && env->shape() == entry.shapes[depth]) {
+      if (depth == entry.depth) {
+        result = entry.slot;
+        return env;
+      }
+      env = env->outerMapEnv();
+      ++depth;
+    }
+  }
+  return nullptr;
+}
+
+void DotCache::update(MapEnv *receiver, const std::string &name) {
+  //self和$变量在查找时有特殊的语义，不进行缓存
+  if (size == maxEntries || name.empty() || name == "self" || name[0] == '$')
+    return;
+
+  DotCacheEntry entry;
+  MapEnv *env = receiver;
+  for (size_t depth = 0; env != nullptr && depth < DotCacheEntry::maxDepth; ++depth) {
+    entry.shapes[depth] = env->shape();
+    if (env->findSlot(name, entry.slot)) {
+      entry.depth = depth;
+      entries[size++] = entry;
+      return;
+    }
+    env = env->outerMapEnv();
+  }
+}
+
+/*****************************形状*********************************/
+
+bool Shape::findSlot(const std::string &name, size_t &slot) const {
+  auto iter = slotIndex_.find(name);
+  if (iter == slotIndex_.end())
+    return false;
+  slot = iter->second;
+  return true;
+}
+
+ShapePtr Shape::transition(const ShapePtr &shape, const std::string &name) {
+  auto iter = shape->transitions_.find(name);
+  if (iter != shape->transitions_.end()) {
+    ShapePtr next = iter->second.lock();
+    if (next != nullptr)
+      return next;
+  }
+
+  ShapePtr next = std::make_shared<Shape>();
+  next->slotIndex_ = shape->slotIndex_;
+  next->slotIndex_[name] = shape->size();
+  shape->transitions_[name] = next;
+  return next;
+}
+
 /***************************类元信息*********************************/
 ClassInfo::ClassInfo(std::shared_ptr<ClassStmntAST> stmnt, EnvPtr env):
   Object(ObjKind::CLASS_INFO), definition_(stmnt), outerEnv_(env) {
@@ -128,6 +294,15 @@ void ClassInfo::compile() {
     compiledEnv_->put("super", superClass_->getComliedEnv());
     compiledEnv_->setOuterEnv(superClass_->getComliedEnv());
   }
+
+  //类体中定义的函数都是方法，由该类的所有对象共享
+  MapEnv *classEnv = compiledEnv_->asMapEnv();
+  const SlotIndex &slotIndex = classEnv->getSlotIndex();
+  for (auto pair = slotIndex.begin(); pair != slotIndex.end(); ++pair) {
+    const ObjectPtr &obj = classEnv->getSlot(pair->second);
+    if (obj != nullptr && obj->kind_ == ObjKind::FUNCTION)
+      std::static_pointer_cast<FuncObject>(obj)->setMethod(true);
+  }
 }
 
 EnvPtr ClassInfo::getComliedEnv() {
@@ -169,17 +344,17 @@ std::string ClassInstance::info() {
 /*************************定长数组***********************************/
 
 Array::Array(size_t i): Object(ObjKind::Array) {
-  array_ = std::vector<ObjectPtr>(i, nullptr);
+  array_ = std::vector<Value>(i);
 }
 
-void Array::set(size_t i, ObjectPtr obj) {
+void Array::set(size_t i, Value value) {
   if (i >= array_.size())
     throw OutOfIndexException();
   else
-    array_[i] = obj;
+    array_[i] = std::move(value);
 }
 
-ObjectPtr Array::get(size_t i) {
+const Value &Array::get(size_t i) {
   if (i >= array_.size())
     throw OutOfIndexException();
   else
@@ -194,12 +369,30 @@ std::string Array::info() {
 
 //-----------------------环境接口
 
+unsigned long CommonEnv::layoutVersion_ = 0;
+
 CommonEnv::CommonEnv(): CommonEnv(nullptr) {}
 
 CommonEnv::CommonEnv(EnvPtr outer):Object(ObjKind::ENV), outerEnv_(outer) {}
 
 void CommonEnv::setOuterEnv(EnvPtr outer) {
   outerEnv_ = outer;
+  layoutChanged();
+}
+
+void CommonEnv::layoutChanged() {
+  //未被查找过的环境（如刚复制出来的对象环境）不在任何已解析的查找路径上
+  if (observed_)
+    ++layoutVersion_;
+}
+
+bool CommonEnv::locateSlot(const std::string &name, MapEnv *&env, size_t &slot) {
+  EnvPtr located = locateEnv(name);
+  MapEnv *mapEnv = dynamic_cast<MapEnv *>(located.get());
+  if (mapEnv == nullptr || !mapEnv->findSlot(name, slot))
+    return false;
+  env = mapEnv;
+  return true;
 }
 
 EnvPtr CommonEnv::getOuterEnv() const {
@@ -209,6 +402,7 @@ EnvPtr CommonEnv::getOuterEnv() const {
 EnvPtr CommonEnv::locateEnv(const std::string &name) {
   if (name.empty())
     return nullptr;
+  observed_ = true;
 
   //去最外层环境寻找$变量
   if (name[0] == '$') {
@@ -240,9 +434,10 @@ EnvPtr CommonEnv::getOutestEnv() {
 
 //----------------------全局环境、对象环境
 
-MapEnv::MapEnv(): CommonEnv(nullptr) {}
+MapEnv::MapEnv(): MapEnv(nullptr) {}
 
-MapEnv::MapEnv(EnvPtr outer): CommonEnv(outer) {}
+MapEnv::MapEnv(EnvPtr outer): CommonEnv(outer), 
+  shape_(std::make_shared<Shape>()) {}
 
 ObjectPtr MapEnv::get(const std::string &name) {
   //用于对象环境的self语义
@@ -256,7 +451,7 @@ ObjectPtr MapEnv::get(const std::string &name) {
     return env->getCurr(name);
 }
 
-ObjectPtr MapEnv::get(size_t __attribute__((unused))index) {
+Value MapEnv::get(size_t __attribute__((unused))index) {
   throw ASTEvalException("can not get object by index in map envrionment");
 }
 
@@ -268,20 +463,32 @@ void MapEnv::put(const std::string &name, ObjectPtr obj) {
 }
 
 void MapEnv::put(size_t __attribute__((unused))index, 
-    ObjectPtr __attribute__((unused))obj) {
+    Value __attribute__((unused))value) {
   throw ASTEvalException("can not put object by index in map environment");
 }
 
 bool MapEnv::isExistInCurrentEnv(const std::string &name) {
-  return values_.find(name) != values_.end();
+  size_t slot;
+  return shape_->findSlot(name, slot);
 }
 
 ObjectPtr MapEnv::getCurr(const std::string &name) {
-  return values_[name];
+  size_t slot;
+  if (!shape_->findSlot(name, slot))
+    return nullptr;
+  return getSlot(slot);
 }
 
 void MapEnv::putCurr(const std::string &name, ObjectPtr obj) {
-  values_[name] = obj;
+  size_t slot;
+  if (shape_->findSlot(name, slot)) {
+    slots_[slot] = obj;
+    return;
+  }
+  //新的变量分配新的槽位，它可能遮蔽了外层环境的同名变量
+  shape_ = Shape::transition(shape_, name);
+  slots_.push_back(obj);
+  layoutChanged();
 }
 
 std::string MapEnv::info() {
@@ -293,9 +500,22 @@ ObjectPtr MapEnv::copy() {
   MapEnvPtr copyEnv = std::make_shared<MapEnv>(outerEnv_);
   copyEnv->setUnitSymbols(getUnitSymbols());
 
-  //对环境内的对象进行深复制
-  for (auto pair = values_.begin(); pair != values_.end(); ++pair) {
-    ObjectPtr obj = pair->second->copy();
+  //复制出的环境和原环境形状相同
+  copyEnv->shape_ = shape_;
+  copyEnv->slots_.resize(slots_.size());
+
+  //对环境内的对象进行深复制，类的方法直接共享
+  const SlotIndex &slotIndex = shape_->slotIndex();
+  for (auto pair = slotIndex.begin(); pair != slotIndex.end(); ++pair) {
+    const ObjectPtr &origin = slots_[pair->second];
+    if (origin->kind_ == ObjKind::FUNCTION && 
+        std::static_pointer_cast<FuncObject>(origin)->isMethod()) {
+      copyEnv->slots_[pair->second] = origin;
+      copyEnv->sharesMethods_ = true;
+      continue;
+    }
+
+    ObjectPtr obj = origin->copy();
     if (obj->kind_ == ObjKind::FUNCTION) {
       FuncPtr func = std::dynamic_pointer_cast<FuncObject>(obj);
       func->setOuterEnv(copyEnv);
@@ -312,8 +532,22 @@ ObjectPtr MapEnv::copy() {
   return copyEnv;
 }
 
-const std::map<std::string, ObjectPtr> &MapEnv::getElements() {
-  return values_;
+const SlotIndex &MapEnv::getSlotIndex() {
+  return shape_->slotIndex();
+}
+
+bool MapEnv::findSlot(const std::string &name, size_t &slot) {
+  return shape_->findSlot(name, slot);
+}
+
+void MapEnv::bindMethod(size_t slot) {
+  auto method = std::static_pointer_cast<FuncObject>(slots_[slot]);
+  if (!method->isMethod())
+    return;
+  //绑定后的函数留在槽位中，之后的读取和调用不再需要绑定
+  FuncPtr bound = std::static_pointer_cast<FuncObject>(method->copy());
+  bound->setOuterEnv(shared_from_this());
+  slots_[slot] = bound;
 }
 
 //---------------------函数运行时局部环境
@@ -326,9 +560,7 @@ ArrayEnv::ArrayEnv(EnvPtr outer, FuncPtr function, size_t size):
   function_ = function;
   funcName_ = function->funcName();
 
-  values_.clear();
-  for (size_t i = 0; i < size; ++i)
-    values_.push_back(nullptr);
+  values_.resize(size);
 }
 
 ObjectPtr ArrayEnv::get(const std::string &name) {
@@ -351,7 +583,7 @@ ObjectPtr ArrayEnv::get(const std::string &name) {
     return env->getCurr(name);
 }
 
-ObjectPtr ArrayEnv::get(size_t index) {
+Value ArrayEnv::get(size_t index) {
   if (index >= values_.size())
     throw ASTEvalException("invalid index while getting obj");
   return values_[index];
@@ -363,10 +595,10 @@ void ArrayEnv::put(const std::string &name, ObjectPtr obj) {
   outerEnv_->put(name, obj);
 }
 
-void ArrayEnv::put(size_t index, ObjectPtr obj) {
+void ArrayEnv::put(size_t index, Value value) {
   if (index >= values_.size())
     throw ASTEvalException("invalid index while putting obj: " + std::to_string(index));
-  values_[index] = obj;
+  values_[index] = std::move(value);
 }
 
 bool ArrayEnv::isExistInCurrentEnv(const std::string 
@@ -3,6 +3,7 @@
 
 #include <iostream>
 
+#include <cstddef>
 #include <memory>
 #include <string>
 #include <map>
@@ -32,7 +33,8 @@ enum class ObjKind {
   NATIVE_FUNC = 7,
   CLASS_INFO = 8,
   CLASS_INSTANCE = 9,
-  Array = 10
+  Array = 10,
+  CELL = 11
 };
 
 class Object {
@@ -78,7 +80,7 @@ public:
   }
 
 public:
-  int value_;
+  const int value_;
 };
 using IntObjectPtr = std::shared_ptr<IntObject>;
 
@@ -95,11 +97,13 @@ public:
     return std::make_shared<FloatObject>(value_);
   }
 public:
-  double value_;
+  const double value_;
 };
 using FloatObjectPtr = std::shared_ptr<FloatObject>;
 
 /******************************Str 类型********************************/
+//字符串对象是不可变的，字符串常量对象在常量池中创建后被所有引用共享，
+//字符串运算总是产生新的对象
 class StrObject: public Object {
 public:
   StrObject(const std::string &str): Object(ObjKind::STRING), str_(str) {}
@@ -112,7 +116,7 @@ public:
     return std::make_shared<StrObject>(str_);
   }
 public:
-  std::string str_;
+  const std::string str_;
 };
 using StrObjectPtr = std::shared_ptr<StrObject>;
 
@@ -134,17 +138,402 @@ public:
 };
 using BoolObjectPtr = std::shared_ptr<BoolObject>;
 
+/*****************************运行时的值*******************************/
+
+enum class ValueKind: unsigned char {
+  NIL,      //空值，相当于空指针，如未赋值的局部变量、数组元素
+  NONE,
+  INT,
+  FLOAT,
+  BOOL,
+  OBJECT    //其它需要在堆上分配的对象
+};
+
+//虚拟机的操作数栈、函数局部环境以及数组中存放的值
+//Int、Float、Bool和None作为立即数直接存放在值中，不需要在堆上分配对象；
+//字符串、函数、类、对象、数组等仍然以对象指针的方式存放
+//和使用ObjectPtr的代码（全局环境、对象环境、原生函数、树遍历解释）交互时，
+//通过Value(ObjectPtr)和toObject()相互转换
+class Value {
+public:
+  Value(): kind_(ValueKind::NIL) {}
+
+  Value(std::nullptr_t): Value() {}
+
+  //从对象构造，Int、Float、Bool和None对象会被拆箱为立即数
+  template <typename T>
+  Value(const std::shared_ptr<T> &obj): Value() {
+    if (obj == nullptr)
+      return;
+    Object *raw = obj.get();
+    switch (raw->kind_) {
+      case ObjKind::NONE:
+        kind_ = ValueKind::NONE;
+        break;
+      case ObjKind::INT:
+        kind_ = ValueKind::INT;
+        int_ = static_cast<IntObject *>(raw)->value_;
+        break;
+      case ObjKind::FLOAT:
+        kind_ = ValueKind::FLOAT;
+        float_ = static_cast<FloatObject *>(raw)->value_;
+        break;
+      case ObjKind::BOOL:
+        kind_ = ValueKind::BOOL;
+        bool_ = static_cast<BoolObject *>(raw)->b_;
+        break;
+      default:
+        kind_ = ValueKind::OBJECT;
+        new (&obj_) ObjectPtr(obj);
+        break;
+    }
+  }
+
+  Value(const Value &other): kind_(other.kind_) {
+    copyFrom(other);
+  }
+
+  Value(Value &&other) noexcept: kind_(other.kind_) {
+    moveFrom(other);
+  }
+
+  Value &operator=(const Value &other) {
+    if (this != &other) {
+      reset();
+      kind_ = other.kind_;
+      copyFrom(other);
+    }
+    return *this;
+  }
+
+  Value &operator=(Value &&other) noexcept {
+    if (this != &other) {
+      reset();
+      kind_ = other.kind_;
+      moveFrom(other);
+    }
+    return *this;
+  }
+
+  ~Value() {
+    reset();
+  }
+
+  static Value makeNone() {
+    Value v;
+    v.kind_ = ValueKind::NONE;
+    return v;
+  }
+
+  static Value makeInt(int i) {
+    Value v;
+    v.kind_ = ValueKind::INT;
+    v.int_ = i;
+    return v;
+  }
+
+  static Value makeFloat(double f) {
+    Value v;
+    v.kind_ = ValueKind::FLOAT;
+    v.float_ = f;
+    return v;
+  }
+
+  static Value makeBool(bool b) {
+    Value v;
+    v.kind_ = ValueKind::BOOL;
+    v.bool_ = b;
+    return v;
+  }
+
+  ValueKind kind() const {
+    return kind_;
+  }
+
+  bool isNil() const {
+    return kind_ == ValueKind::NIL;
+  }
+
+  bool isNone() const {
+    return kind_ == ValueKind::NONE;
+  }
+
+  bool isInt() const {
+    return kind_ == ValueKind::INT;
+  }
+
+  bool isFloat() const {
+    return kind_ == ValueKind::FLOAT;
+  }
+
+  bool isBool() const {
+    return kind_ == ValueKind::BOOL;
+  }
+
+  bool isObject() const {
+    return kind_ == ValueKind::OBJECT;
+  }
+
+  //是否为某种类型，立即数按照它装箱后的对象类型判断
+  bool is(ObjKind kind) const {
+    switch (kind_) {
+      case ValueKind::NONE:
+        return kind == ObjKind::NONE;
+      case ValueKind::INT:
+        return kind == ObjKind::INT;
+      case ValueKind::FLOAT:
+        return kind == ObjKind::FLOAT;
+      case ValueKind::BOOL:
+        return kind == ObjKind::BOOL;
+      case ValueKind::OBJECT:
+        return obj_->kind_ == kind;
+      default:
+        return false;
+    }
+  }
+
+  int asInt() const {
+    return int_;
+  }
+
+  double asFloat() const {
+    return float_;
+  }
+
+  bool asBool() const {
+    return bool_;
+  }
+
+  //获取对象指针，只有isObject()为真时才能调用
+  const ObjectPtr &object() const {
+    return obj_;
+  }
+
+  //对象的裸指针，只有isObject()为真时才能调用
+  template <typename T>
+  T *objectAs() const {
+    return static_cast<T *>(obj_.get());
+  }
+
+  //转换为对象，立即数会被装箱
+  ObjectPtr toObject() const {
+    switch (kind_) {
+      case ValueKind::NONE:
+        return std::make_shared<NoneObject>();
+      case ValueKind::INT:
+        return std::make_shared<IntObject>(int_);
+      case ValueKind::FLOAT:
+        return std::make_shared<FloatObject>(float_);
+      case ValueKind::BOOL:
+        return std::make_shared<BoolObject>(bool_);
+      case ValueKind::OBJECT:
+        return obj_;
+      default:
+        return nullptr;
+    }
+  }
+
+  //类型和立即数在值中的偏移，即时编译生成的机器码直接读写它们，见vm/jit.h
+  static size_t kindOffset() {
+    return offsetof(Value, kind_);
+  }
+
+  static size_t payloadOffset() {
+    return offsetof(Value, int_);
+  }
+
+  //置为空值并释放持有的对象
+  void reset() {
+    if (kind_ == ValueKind::OBJECT)
+      obj_.~ObjectPtr();
+    kind_ = ValueKind::NIL;
+  }
+
+private:
+  void copyFrom(const Value &other) {
+    switch (kind_) {
+      case ValueKind::INT:
+        int_ = other.int_;
+        break;
+      case ValueKind::FLOAT:
+        float_ = other.float_;
+        break;
+      case ValueKind::BOOL:
+        bool_ = other.bool_;
+        break;
+      case ValueKind::OBJECT:
+        new (&obj_) ObjectPtr(other.obj_);
+        break;
+      default:
+        break;
+    }
+  }
+
+  //移动之后other为空值
+  void moveFrom(Value &other) {
+    if (kind_ == ValueKind::OBJECT) {
+      new (&obj_) ObjectPtr(std::move(other.obj_));
+      other.reset();
+    }
+    else {
+      copyFrom(other);
+    }
+  }
+
+private:
+  ValueKind kind_;
+
+  union {
+    int int_;
+    double float_;
+    bool bool_;
+    ObjectPtr obj_;
+  };
+};
+
+/*****************************闭包变量单元******************************/
+
+//被lamb引用的局部变量存放在单元中，函数的局部变量槽位里放的是单元本身，
+//函数和它创建的闭包通过同一个单元读写该变量
+//闭包只持有它引用的变量的单元，不再持有外层函数的整个运行时环境
+class Cell: public Object {
+public:
+  Cell(Value value): Object(ObjKind::CELL), value_(std::move(value)) {}
+
+  std::string info() override {
+    return "Cell";
+  }
+
+  //复制出一个值相同的新单元
+  ObjectPtr copy() override {
+    return std::make_shared<Cell>(value_);
+  }
+
+  Value value_;
+};
+using CellPtr = std::shared_ptr<Cell>;
+
 /*****************************函数 类型******************************/
 
 class FuncObject;
 using FuncPtr = std::shared_ptr<FuncObject>;
 
+class MapEnv;
+
+//函数中非局部变量的解析结果，由函数对象缓存，GLOAD、GSTORE据此直接访问变量
+//解析结果依赖函数外部环境链的结构，环境结构版本变化后需要重新解析
+struct GlobalRef {
+  enum class Kind {
+    UNRESOLVED,   //未解析或找不到该变量，只能按名字查找
+    SLOT,         //变量位于某个map环境的槽位中
+    FUNCTION,     //函数自身的名字，即递归调用
+    OUTER_ENV     //self，即函数的外部环境
+  };
+
+  Kind kind = Kind::UNRESOLVED;
+
+  //变量所在的环境及其槽位
+  MapEnv *env = nullptr;
+  size_t slot = 0;
+
+  //解析时的环境结构版本
+  unsigned long version = 0;
+};
+
+//变量名到槽位的索引
+using SlotIndex = std::map<std::string, size_t>;
+
+//map环境的形状（隐藏类），描述环境中有哪些变量以及它们的槽位
+//形状创建之后不再修改，环境新增变量时沿转移迁移到新的形状。同一个形状新增
+//同名变量总是得到同一个目标形状，所以由同一个类创建、以相同顺序新增成员的对象
+//形状相同，形状对象本身就可以作为环境结构的标识
+//对象环境由类编译后的环境复制而来，初始形状就是该环境的形状
+class Shape;
+using ShapePtr = std::shared_ptr<Shape>;
+
+class Shape {
+public:
+  //查找变量的槽位
+  bool findSlot(const std::string &name, size_t &slot) const;
+
+  //变量的个数，也是下一个新增变量的槽位
+  size_t size() const {
+    return slotIndex_.size();
+  }
+
+  const SlotIndex &slotIndex() const {
+    return slotIndex_;
+  }
+
+  //新增变量name之后的形状，已有的转移直接复用
+  static ShapePtr transition(const ShapePtr &shape, const std::string &name);
+
+private:
+  SlotIndex slotIndex_;
+
+  //新增变量到目标形状的转移
+  //目标形状由使用它的环境和内联缓存持有，这里只保存弱引用
+  std::map<std::string, std::weak_ptr<Shape>> transitions_;
+};
+
+//域访问、域赋值（DOT_ACCESS、DOT_ASSIGN）的内联缓存，每个访问点一个
+//以接收者环境的形状为键，记录成员位于接收者向外第几层环境以及它的槽位，
+//最多缓存maxEntries种形状，超出后不再缓存新的形状
+struct DotCacheEntry {
+  //成员所在环境的最大深度，接收者本身的深度为0
+  static const size_t maxDepth = 3;
+
+  size_t depth = 0;
+  size_t slot = 0;
+
+  //从接收者到成员所在环境，各层环境的形状
+  //持有形状的引用，保证形状在缓存存活期间不会被释放后地址被复用
+  ShapePtr shapes[maxDepth];
+};
+
+struct DotCache {
+  static const size_t maxEntries = 4;
+
+  //成员名称在函数非局部变量名称表中的下标
+  unsigned nameIndex = 0;
+
+  size_t size = 0;
+  DotCacheEntry entries[maxEntries];
+
+  //查找缓存，命中时返回成员所在的环境并设置槽位，否则返回空指针
+  MapEnv *lookup(MapEnv *receiver, size_t &slot) const;
+
+  //按名字查找成功之后，把接收者的形状加入缓存
+  void update(MapEnv *receiver, const std::string &name);
+};
+
+//内联守卫，被内联的函数展开到调用处之后，运行时检查全局名字是否仍然绑定到它
+struct InlineGuard {
+  //函数名在调用者非局部变量名称表中的下标
+  unsigned nameIndex = 0;
+
+  //被内联的函数，由调用者持有
+  FuncPtr callee;
+};
+
+//函数的编译目标，由命令行参数选择
+//寄存器字节码由栈式字节码翻译而来，见vm/reg_code.h
+enum class CompileTarget {
+  STACK, REGISTER
+};
+
+class RegCode;
+using RegCodePtr = std::shared_ptr<RegCode>;
+
 class FuncObject: public Object, public std::enable_shared_from_this<FuncObject>{
 
 public:
   //指向当前正在编译的函数的指针
   static FuncPtr complingFunc;
 
+  //所有函数的编译目标
+  static CompileTarget compileTarget;
+
   //获取当前正在编译的函数
   static FuncPtr getCurrCompilingFunc();
 
@@ -167,6 +556,48 @@ public:
 
   //获取运行时环境
   EnvPtr runtimeEnv();
+
+  //获取只用于查找非局部变量的运行时环境
+  //虚拟机执行时局部变量存放在操作数栈上，该环境不含局部变量，同一函数的所有调用共享一个
+  EnvPtr nonLocalEnv();
+
+  //局部变量（包括形参）的个数
+  size_t localVarSize() const {
+    return localVarSize_;
+  }
+
+  //是否有局部变量被函数体中的lamb引用
+  bool hasCellLocals() const {
+    return cellLocals_ != nullptr;
+  }
+
+  //被函数体中的lamb引用的局部变量的下标，调用函数时这些变量先装入单元
+  const std::vector<size_t> &cellLocals() const {
+    return *cellLocals_;
+  }
+
+  void setCellLocals(std::shared_ptr<const std::vector<size_t>> cellLocals) {
+    cellLocals_ = cellLocals;
+  }
+
+  //闭包引用的外层变量的单元，下标即CLOAD、CSTORE的操作数
+  const CellPtr &upvalue(size_t index) const {
+    return upvalues_[index];
+  }
+
+  void setUpvalues(std::vector<CellPtr> upvalues) {
+    upvalues_ = std::move(upvalues);
+  }
+
+  //是否是类中定义的方法
+  //方法由类的所有对象共享，从对象环境中读取时才复制出绑定到该对象的函数
+  bool isMethod() const {
+    return method_;
+  }
+
+  void setMethod(bool method) {
+    method_ = method;
+  }
   
   std::string info() override {
     return "Func: " + funcName_;
@@ -183,9 +614,47 @@ public:
     return codes_;
   }
 
+  //编译目标为寄存器字节码时，翻译得到的寄存器字节码
+  const RegCodePtr &getRegCodes() const {
+    return regCodes_;
+  }
+
   //对于函数运行时所需的非局部变量，记录下它的名字并分配一个下标
   unsigned getRuntimeIndex(const std::string &name);
 
+  //获取第index个非局部变量的解析结果，结果失效时重新解析
+  const GlobalRef &resolveGlobal(unsigned index);
+
+  //为一个域访问点分配内联缓存，返回缓存的下标
+  unsigned addDotCache(unsigned nameIndex);
+
+  DotCache &getDotCache(unsigned index) {
+    return (*dotCaches_)[index];
+  }
+
+  //为一个内联展开点分配守卫，返回守卫的下标
+  unsigned addInlineGuard(unsigned nameIndex, FuncPtr callee);
+
+  const InlineGuard &getInlineGuard(unsigned index) const {
+    return (*inlineGuards_)[index];
+  }
+
+  //第index个守卫的全局名字是否仍然绑定到被内联的函数
+  bool inlineGuardHolds(unsigned index);
+
+  //为内联展开的函数体或中间表示优化的临时变量分配局部变量，返回第一个新局部变量的下标
+  size_t addTempLocals(size_t size);
+
+  //编译时新增的局部变量个数，其余是源码中的形参和局部变量
+  size_t tempLocalSize() const {
+    return tempLocalSize_;
+  }
+
+  //外部环境
+  EnvPtr outerEnv() const {
+    return env_;
+  }
+
   std::shared_ptr<std::vector<std::string>> getOuterNames();
 
   //函数是否已经已经编译
@@ -215,9 +684,22 @@ private:
   //函数编译后的字节码
   CodePtr codes_;
 
+  //由字节码翻译成的寄存器字节码，和字节码一样在函数对象的副本间共享
+  RegCodePtr regCodes_;
+
   //非局部变量名称
   std::shared_ptr<std::vector<std::string>> outerNames_;
 
+  //域访问点的内联缓存，和字节码一样在函数对象的副本间共享
+  std::shared_ptr<std::vector<DotCache>> dotCaches_;
+
+  //内联守卫，和字节码一样在函数对象的副本间共享
+  std::shared_ptr<std::vector<InlineGuard>> inlineGuards_;
+
+  //编译时新增的局部变量（内联展开、中间表示优化的临时变量）个数，
+  //它们总是先赋值后读取
+  size_t tempLocalSize_ = 0;
+
   //是否已经编译（在虚拟机运行时）
   //1.def的函数都是已编译的
   //2.在全局被引用的lamb函数（即全局环境中使用lamb定义或使用产生lamb的普通函数），
@@ -225,10 +707,45 @@ private:
   //3.未在全局引用过的lamb函数，初次在虚拟机运行时，
   //是未编译的（运行时主动编译，虚拟机找到Lamb源码并编译）
   bool isCompile_ = false;
+
+  //被lamb引用的局部变量的下标，预处理时确定，没有则为空
+  std::shared_ptr<const std::vector<size_t>> cellLocals_;
+
+  //闭包引用的外层变量的单元，创建闭包时填入
+  std::vector<CellPtr> upvalues_;
+
+  //是否是类的共享方法，复制出的函数不再是共享方法
+  bool method_ = false;
+
+  //共享的只用于查找非局部变量的运行时环境，第一次使用时创建
+  EnvPtr nonLocalEnv_;
+
+  //非局部变量的解析结果，下标与outerNames_一致
+  //字节码在函数对象的副本间共享，但外部环境各不相同，所以解析结果放在函数对象中
+  std::vector<GlobalRef> globalRefs_;
 };
 
 /****************************原生函数********************************/
 
+//原生函数的实参，指向按源码顺序排列的一段值，不持有也不复制它们
+//虚拟机中直接指向操作数栈上函数对象之上的实参
+class NativeArgs {
+public:
+  NativeArgs(const Value *values, size_t size): values_(values), size_(size) {}
+
+  const Value &operator[](size_t index) const {
+    return values_[index];
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+private:
+  const Value *values_;
+  size_t size_;
+};
+
 class NativeFunction: public Object, public std::enable_shared_from_this<NativeFunction> {
 public:
   NativeFunction(const std::string &name, size_t paramNum): 
@@ -252,7 +769,9 @@ public:
   }
 
   //所有的原生函数子类通过实现该接口实现其功能
-  virtual ObjectPtr invoke(const std::vector<ObjectPtr> &params) = 0;
+  //调用者已经检查过实参个数等于paramNum()，原生函数不必再检查
+  //返回空值（Value()）表示没有返回值，Int、Float、Bool和None作为立即数返回，不在堆上分配
+  virtual Value invoke(NativeArgs args) = 0;
 
 protected:
   std::string funcName_;
@@ -288,7 +807,7 @@ public:
   }
 
   //编译类中的每个函数
-  //生成一个包含已编译的函数对象、变量的环境
+  //生成一个包含已编译的函数对象、变量的环境，其中的函数即类的方法表
   void compile();
 
   //获取该类编译后的环境
@@ -300,7 +819,7 @@ private:
   ClassInfoPtr superClass_ = nullptr;
 
   //变量、函数编译后所放在的环境
-  //当类实例化时，把该环境拷贝给对象
+  //当类实例化时，把其中的变量拷贝给对象，函数则由所有对象共享
   EnvPtr compiledEnv_ = nullptr;
 };
 
@@ -325,6 +844,11 @@ public:
     return env_;
   }
 
+  //不增加引用计数地获取对象环境，供虚拟机的域访问使用
+  CommonEnv *rawEnvironment() const {
+    return env_.get();
+  }
+
 private:
   bool checkAccessValid(const std::string &member);
 private:
@@ -338,9 +862,9 @@ class Array: public Object, public std::enable_shared_from_this<Array> {
 public:
   Array(size_t i);
 
-  void set(size_t i, ObjectPtr obj);
+  void set(size_t i, Value value);
 
-  ObjectPtr get(size_t i);
+  const Value &get(size_t i);
 
   std::string info() override;
 
@@ -349,7 +873,7 @@ public:
     return shared_from_this();
   }
 private:
-  std::vector<ObjectPtr> array_;
+  std::vector<Value> array_;
 };
 using ArrayPtr = std::shared_ptr<Array>;
 
@@ -374,7 +898,7 @@ public:
   virtual ObjectPtr get(const std::string &name) = 0;
 
   //获取指定位置的变量
-  virtual ObjectPtr get(size_t index) = 0;
+  virtual Value get(size_t index) = 0;
 
   //把变量放入环境中
   //如果是新的变量，或在当前环境中可以找到该环境，那么就放入该环境
@@ -383,7 +907,7 @@ public:
 
   //向环境中指定位置放入变量
   //只用于函数运行时环境的局部变量，需要事先确定局部变量的位置
-  virtual void put(size_t index, ObjectPtr obj) = 0;
+  virtual void put(size_t index, Value value) = 0;
 
   //检查变量是否在当前的环境
   virtual bool isExistInCurrentEnv(const std::string &name) = 0;
@@ -394,6 +918,20 @@ public:
   //向当前环境插入新的变量
   virtual void putCurr(const std::string &name, ObjectPtr obj) = 0;
 
+  //定位变量所在的map环境及其槽位，找不到时返回false
+  bool locateSlot(const std::string &name, MapEnv *&env, size_t &slot);
+
+  //如果是map环境则返回自身，否则返回空指针
+  virtual MapEnv *asMapEnv() {
+    return nullptr;
+  }
+
+  //环境结构的版本
+  //被查找过的环境新增变量或更换外部环境时递增，已解析的变量位置随之失效
+  static unsigned long layoutVersion() {
+    return layoutVersion_;
+  }
+
   SymbolsPtr getUnitSymbols() const {
     return unitSymbols_;
   }
@@ -410,8 +948,16 @@ protected:
   //获取最外层的环境
   EnvPtr getOutestEnv();
 
+  //环境结构发生变化，只有被查找过的环境才可能影响已解析的变量位置
+  void layoutChanged();
+
 protected:
   EnvPtr outerEnv_ = nullptr;
+
+  //是否在查找变量时被访问过
+  bool observed_ = false;
+
+  static unsigned long layoutVersion_;
   
   //当前环境的符号表
   SymbolsPtr unitSymbols_;
@@ -427,11 +973,11 @@ public:
 
   ObjectPtr get(const std::string &name) override;
 
-  ObjectPtr get(size_t index) override;
+  Value get(size_t index) override;
 
   void put(const std::string &name, ObjectPtr obj) override;
 
-  void put(size_t index, ObjectPtr obj) override;
+  void put(size_t index, Value value) override;
 
   bool isExistInCurrentEnv(const std::string &name) override;
 
@@ -442,14 +988,55 @@ public:
   std::string info() override;
 
   //该复制只用在类元实例化出对象
-  //需要对环境内的各各对象进行深度赋值，且函数的外部环境更改为结果环境
+  //需要对环境内的各个变量进行深度复制，类的方法不复制，和类共享，
+  //在第一次读取时才绑定到结果环境
   ObjectPtr copy() override;
 
-  //获取环境的元素
-  const std::map<std::string, ObjectPtr> &getElements();
+  MapEnv *asMapEnv() override {
+    return this;
+  }
+
+  //获取环境中所有变量的名字及其槽位
+  const SlotIndex &getSlotIndex();
+
+  //当前的形状
+  const ShapePtr &shape() const {
+    return shape_;
+  }
+
+  //外部环境是map环境时返回它，否则返回空指针
+  MapEnv *outerMapEnv() const {
+    return outerEnv_ == nullptr ? nullptr : outerEnv_->asMapEnv();
+  }
+
+  //查找变量在当前环境中的槽位
+  bool findSlot(const std::string &name, size_t &slot);
+
+  //按槽位读写变量，槽位一经分配就不会改变
+  const ObjectPtr &getSlot(size_t slot) {
+    if (sharesMethods_ && slots_[slot] != nullptr && 
+        slots_[slot]->kind_ == ObjKind::FUNCTION)
+      bindMethod(slot);
+    return slots_[slot];
+  }
+
+  void putSlot(size_t slot, ObjectPtr obj) {
+    slots_[slot] = std::move(obj);
+  }
 
 private:
-  std::map<std::string, ObjectPtr> values_;
+  //槽位中是类的共享方法时，复制出绑定到该环境的函数并替换槽位中的方法
+  void bindMethod(size_t slot);
+
+private:
+  //环境的形状，可能和其它环境共享
+  ShapePtr shape_;
+
+  //变量的值，按形状中的槽位存放
+  std::vector<ObjectPtr> slots_;
+
+  //是否有槽位存放着类的共享方法，只有对象环境才会有
+  bool sharesMethods_ = false;
 };
 using MapEnvPtr = std::shared_ptr<MapEnv>;
 
@@ -461,11 +1048,11 @@ public:
 
   ObjectPtr get(const std::string &name) override;
 
-  ObjectPtr get(size_t index) override;
+  Value get(size_t index) override;
 
   void put(const std::string &name, ObjectPtr obj) override;
 
-  void put(size_t index, ObjectPtr obj) override;
+  void put(size_t index, Value value) override;
 
   bool isExistInCurrentEnv(const std::string &name) override;
 
@@ -478,12 +1065,17 @@ public:
   //该环境没有复制的意义，抛出异常
   ObjectPtr copy() override;
 
+  //正在执行的函数，树遍历解释时闭包变量从它的单元中读写
+  FuncPtr function() const {
+    return function_.lock();
+  }
+
 private:
   std::weak_ptr<FuncObject> function_;
 
   std::string funcName_;
 
-  std::vector<ObjectPtr> values_;
+  std::vector<Value> values_;
 };
 using ArrayEnvPtr = std::shared_ptr<ArrayEnv>;
 
@@ -9,8 +9,8 @@ LexerImp::LexerImp(): is_(nullptr) {
   "("
   "(require [[:alnum:]_]+(\\.[[:alnum:]_]+)* as [[:alnum:]_]+)"
   "|(//.*)"
-  "|([0-9]+)"
   "|([0-9]+\\.[0-9]+)"
+  "|([0-9]+)"
   "|(\"(\\\\\"|\\\\\\\\|\\\\n|[^\"])*\")"
   "|\\$?[A-Z_a-z][A-Z_a-z0-9]*|!=|==|<=|>=|&&|\\|\\||[[:punct:]]"
   ")?";
@@ -112,16 +112,16 @@ void LexerImp::parseNextLine() {
     if (results[4].matched)   //注释
       continue;
 
-    if (results[5].matched) { //匹配整数
-      IntTokenPtr tp = std::make_shared<IntToken>(lineNumber_, 
+    if (results[5].matched) {  //匹配浮点数，需要先于整数匹配
+      FloatTokenPtr tp = std::make_shared<FloatToken>(lineNumber_,
           fileName_, results[5].str());
       tokenQueue_.push_back(tp);
-    } 
-    else if (results[6].matched) {  //匹配浮点数
-      FloatTokenPtr tp = std::make_shared<FloatToken>(lineNumber_,
+    }
+    else if (results[6].matched) { //匹配整数
+      IntTokenPtr tp = std::make_shared<IntToken>(lineNumber_, 
           fileName_, results[6].str());
       tokenQueue_.push_back(tp);
-    }
+    } 
     else if (results[7].matched) { // 匹配字符串
       //去掉头尾的双引号
       std::string str(results[7].str(), 1, results[7].str().size() - 2);
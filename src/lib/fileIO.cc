@@ -12,15 +12,15 @@
 
 __OpenROFile::__OpenROFile(): NativeFunction("__OpenROFile", 1) {}
 
-ObjectPtr __OpenROFile::invoke(const std::vector<ObjectPtr> &params) {
-  if (params.empty() || params[0]->kind_ != ObjKind::STRING) {
+Value __OpenROFile::invoke(NativeArgs args) {
+  if (!args[0].is(ObjKind::STRING)) {
     std::cerr << "Invalid params for __OpenROFile" << std::endl;
-    return std::make_shared<IntObject>(-1);
+    return Value::makeInt(-1);
   }
   
-  StrObjectPtr fileName = std::dynamic_pointer_cast<StrObject>(params[0]);
+  StrObject *fileName = args[0].objectAs<StrObject>();
   int fd = open(fileName->str_.c_str(), O_RDONLY);
-  return std::make_shared<IntObject>(fd);
+  return Value::makeInt(fd);
 }
 
 
@@ -28,36 +28,33 @@ ObjectPtr __OpenROFile::invoke(const std::vector<ObjectPtr> &params) {
 
 __OpenWOFile::__OpenWOFile(): NativeFunction("__OpenWOFile", 2) {}
 
-ObjectPtr __OpenWOFile::invoke(const std::vector<ObjectPtr> &params) {
-  if (params.empty() || params[0]->kind_ != ObjKind::STRING || 
-      params[1]->kind_ != ObjKind::INT) {
+Value __OpenWOFile::invoke(NativeArgs args) {
+  if (!args[0].is(ObjKind::STRING) || !args[1].isInt()) {
     std::cerr << "Invalid params for __OpenWOFile" << std::endl;
-    return std::make_shared<IntObject>(-1);
+    return Value::makeInt(-1);
   }
   
-  StrObjectPtr fileName = std::dynamic_pointer_cast<StrObject>(params[0]);
-  IntObjectPtr openFlag = std::dynamic_pointer_cast<IntObject>(params[1]);
+  StrObject *fileName = args[0].objectAs<StrObject>();
   int fd;
-  if (openFlag->value_ == 0)
+  if (args[1].asInt() == 0)
     fd = open(fileName->str_.c_str(), O_WRONLY|O_TRUNC);
   else
     fd = open(fileName->str_.c_str(), O_WRONLY|O_APPEND);
 
-  return std::make_shared<IntObject>(fd);
+  return Value::makeInt(fd);
 }
 
 /*************************关闭文件****************************/
 
 __CloseFile::__CloseFile(): NativeFunction("__CloseFile", 1) {}
 
-ObjectPtr __CloseFile::invoke(const std::vector<ObjectPtr> &params) {
-  if (params.empty() || params[0]->kind_ != ObjKind::INT) {
+Value __CloseFile::invoke(NativeArgs args) {
+  if (!args[0].isInt()) {
     std::cerr << "Invalid params for __CloseFile" << std::endl;
-    return std::make_shared<IntObject>(-1);
+    return Value::makeInt(-1);
   }
 
-  IntObjectPtr fd = std::dynamic_pointer_cast<IntObject>(params[0]);
-  return std::make_shared<IntObject>(close(fd->value_));
+  return Value::makeInt(close(args[0].asInt()));
 }
 
 
@@ -65,34 +62,32 @@ ObjectPtr __CloseFile::invoke(const std::vector<ObjectPtr> &params) {
 
 __ReadChar::__ReadChar(): NativeFunction("__ReadChar", 1) {}
 
-ObjectPtr __ReadChar::invoke(const std::vector<ObjectPtr> &params) {
-  if (params.empty() || params[0]->kind_ != ObjKind::INT) {
+Value __ReadChar::invoke(NativeArgs args) {
+  if (!args[0].isInt()) {
     std::cerr << "Invalid params for __ReadChar" << std::endl;
-    return std::make_shared<IntObject>(-1);
+    return Value::makeInt(-1);
   }
-  IntObjectPtr fd = std::dynamic_pointer_cast<IntObject>(params[0]);
 
   char buffer[2];
-  ssize_t result = read(fd->value_, buffer, MAX_READ);
-  buffer[result] = '\0';
+  ssize_t result = read(args[0].asInt(), buffer, MAX_READ);
 
   if (result == -1 || result == 0)
-    return std::make_shared<NoneObject>();
-  else
-    return std::make_shared<StrObject>(buffer);
+    return Value::makeNone();
+  buffer[result] = '\0';
+  return Value(std::make_shared<StrObject>(buffer));
 }
 
 /*******************从文件中读取一个单词********************/
 
 __ReadWord::__ReadWord(): NativeFunction("__ReadWord", 1) {}
 
-ObjectPtr __ReadWord::invoke(const std::vector<ObjectPtr> &params) {
-  if (params.empty() || params[0]->kind_ != ObjKind::INT) {
+Value __ReadWord::invoke(NativeArgs args) {
+  if (!args[0].isInt()) {
     std::cerr << "Invalid params for __ReadWord" << std::endl;
-    return std::make_shared<IntObject>(-1);
+    return Value::makeInt(-1);
   }
 
-  IntObjectPtr fd = std::dynamic_pointer_cast<IntObject>(params[0]);
+  int fd = args[0].asInt();
 
   std::string word;
   char buffer[1];
@@ -100,43 +95,43 @@ ObjectPtr __ReadWord::invoke(const std::vector<ObjectPtr> &params) {
   ssize_t result = 0;
 
   while (buffer[0] == ' ') {
-    result = read(fd->value_, buffer, 1);
+    result = read(fd, buffer, 1);
     if (result == -1 || result == 0)
-      return std::make_shared<NoneObject>();
+      return Value::makeNone();
   }
 
   while (buffer[0] != ' ' && buffer[0] != '\n') {
     word.push_back(buffer[0]);
-    result = read(fd->value_, buffer, 1);
+    result = read(fd, buffer, 1);
 
   if (result == -1 || result == 0)
       break;
   }
 
-  return std::make_shared<StrObject>(word);
+  return Value(std::make_shared<StrObject>(word));
 }
 
 /*****************从文件中读取一行字符*********************/
 
 __ReadLine::__ReadLine(): NativeFunction("__ReadLine", 1) {}
 
-ObjectPtr __ReadLine::invoke(const std::vector<ObjectPtr> &params) {
-  if (params.empty() || params[0]->kind_ != ObjKind::INT) {
+Value __ReadLine::invoke(NativeArgs args) {
+  if (!args[0].isInt()) {
     std::cerr << "Invalid params for __ReadLine" << std::endl;
-    return std::make_shared<IntObject>(-1);
+    return Value::makeInt(-1);
   }
 
-  IntObjectPtr fd = std::dynamic_pointer_cast<IntObject>(params[0]);
+  int fd = args[0].asInt();
   std::string line;
   char buffer[1];
 
-  ssize_t result = read(fd->value_, buffer, 1);
+  ssize_t result = read(fd, buffer, 1);
   if (result == -1 || result == 0)
-    return std::make_shared<NoneObject>();
+    return Value::makeNone();
 
   while (buffer[0] != '\n') {
     line.push_back(buffer[0]);
-    result = read(fd->value_, buffer, 1);
+    result = read(fd, buffer, 1);
 
     if (result == -1 || result == 0)
       break;
@@ -144,27 +139,25 @@ ObjectPtr __ReadLine::invoke(const std::vector<ObjectPtr> &params) {
 
   //MyDebugger::print(line, __FILE__, __LINE__);
 
-  return std::make_shared<StrObject>(line);
+  return Value(std::make_shared<StrObject>(line));
 }
 
 /************************向文件写入**********************/
 
 __WriteFile::__WriteFile(): NativeFunction("__WriteFile", 2) {}
 
-ObjectPtr __WriteFile::invoke(const std::vector<ObjectPtr> &params) {
-  if (params.size() < 2 || params[0]->kind_ != ObjKind::INT || 
-      params[1]->kind_ != ObjKind::STRING) {
-    MyDebugger::print(static_cast<int>(params[0]->kind_), __FILE__, __LINE__);
-    MyDebugger::print(static_cast<int>(params[1]->kind_), __FILE__, __LINE__);
+Value __WriteFile::invoke(NativeArgs args) {
+  if (!args[0].isInt() || !args[1].is(ObjKind::STRING)) {
+    MyDebugger::print(static_cast<int>(args[0].toObject()->kind_), __FILE__, __LINE__);
+    MyDebugger::print(static_cast<int>(args[1].toObject()->kind_), __FILE__, __LINE__);
     std::cerr << "Invalid params for __WriteFile" << std::endl;
-    return std::make_shared<IntObject>(-1);   
+    return Value::makeInt(-1);   
   }
 
-  IntObjectPtr fd = std::dynamic_pointer_cast<IntObject>(params[0]);
-  StrObjectPtr str = std::dynamic_pointer_cast<StrObject>(params[1]);
-  ssize_t result = write(fd->value_, str->str_.c_str(), str->str_.size());
+  const std::string &str = args[1].objectAs<StrObject>()->str_;
+  ssize_t result = write(args[0].asInt(), str.c_str(), str.size());
   if (result == -1)
-    return std::make_shared<IntObject>(-1);
+    return Value::makeInt(-1);
   else
-    return std::make_shared<IntObject>(0);
+    return Value::makeInt(0);
 }
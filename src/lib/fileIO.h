@@ -19,7 +19,7 @@ public:
   //入参：1个，文件名字
   //如果成功返回一个非负数int类型，代表文件描述符
   //否则返回-1 int类型
-  ObjectPtr invoke(const std::vector<ObjectPtr> &params) override;
+  Value invoke(NativeArgs args) override;
 };
 
 /***********************打开只写文件**************************/
@@ -31,7 +31,7 @@ public:
   //入参：1个，文件名字
   //如果成功返回一个非负数int类型，代表文件描述符
   //否则返回-1 int类型
-  ObjectPtr invoke(const std::vector<ObjectPtr> &params) override;
+  Value invoke(NativeArgs args) override;
 };
 
 /************************关闭文件****************************/
@@ -42,7 +42,7 @@ public:
 
   //入参：1个，文件描述符
   //返回0表示成功，-1表示失败
-  ObjectPtr invoke(const std::vector<ObjectPtr> &params) override;
+  Value invoke(NativeArgs args) override;
 };
 
 /********************从文件中读取一个字符********************/
@@ -53,7 +53,7 @@ public:
 
   //入参：1个，文件描述符
   //返回空表示已经读取到文件结尾，否则返回一个字符串类型
-  ObjectPtr invoke(const std::vector<ObjectPtr> &params) override;
+  Value invoke(NativeArgs args) override;
 
 private:
   const size_t MAX_READ = 1;
@@ -67,7 +67,7 @@ public:
 
   //入参：1个，文件描述符
   //返回空表示已经读取到文件结尾，否则返回一个字符串类型
-  ObjectPtr invoke(const std::vector<ObjectPtr> &params) override;
+  Value invoke(NativeArgs args) override;
 };
 
 /*****************从文件中读取一行字符*********************/
@@ -78,7 +78,7 @@ public:
 
   //入参：1个，文件描述符、
   //返回空表示已经读取到文件结尾，否则返回一个字符串类型
-  ObjectPtr invoke(const std::vector<ObjectPtr> &params) override;
+  Value invoke(NativeArgs args) override;
 };
 
 /************************向文件写入**********************/
@@ -89,7 +89,7 @@ public:
 
   //入参：2个，文件描述符，写入内容
   //返回0表示写入成功，否则返回-1
-  ObjectPtr invoke(const std::vector<ObjectPtr> &params) override;
+  Value invoke(NativeArgs args) override;
 };
 
 #endif
@@ -18,87 +18,72 @@ void NativeFuncInitializer::addToInitList(NativeFuncPtr func) {
 
 /***************************普通打印函数*******************************/
 
-NativePrint::NativePrint(): NativeFunction("print", 1) {}
-
-ObjectPtr NativePrint::invoke(const std::vector<ObjectPtr> &params) {
-  ObjectPtr param = params[0];
-  if (param == nullptr)
+//打印一个值，newLine为真时换行；字符串和数字以外的值打印其信息并总是换行
+static void printValue(const Value &param, bool newLine) {
+  if (param.isNil())
     throw NativeFuncException("ERROR! Invalid for null variable for print");
-  switch (param->kind_) {
-    case ObjKind::INT:
-      std::cout << std::dynamic_pointer_cast<IntObject>(param)->value_;
-      break;
-    case ObjKind::FLOAT:
-      std::cout << std::dynamic_pointer_cast<FloatObject>(param)->value_;
-      break;
-    case ObjKind::STRING:
-      std::cout << std::dynamic_pointer_cast<StrObject>(param)->str_;
-      break;
-    case ObjKind::BOOL:
-      std::cout << std::dynamic_pointer_cast<BoolObject>(param)->b_;
-      break;
-    default:
-      std::cout << param->info() << std::endl;
-      break;
+  if (param.isInt()) {
+    std::cout << param.asInt();
+  }
+  else if (param.isFloat()) {
+    std::cout << param.asFloat();
+  }
+  else if (param.isBool()) {
+    std::cout << param.asBool();
   }
-  return nullptr;
+  else if (param.is(ObjKind::STRING)) {
+    std::cout << param.objectAs<StrObject>()->str_;
+  }
+  else {
+    std::cout << param.toObject()->info() << std::endl;
+    return;
+  }
+  if (newLine)
+    std::cout << std::endl;
+}
+
+NativePrint::NativePrint(): NativeFunction("print", 1) {}
+
+Value NativePrint::invoke(NativeArgs args) {
+  printValue(args[0], false);
+  return Value();
 }
 
 /***************************换行打印函数******************************/
 
 NativePrintLine::NativePrintLine(): NativeFunction("printLine", 1) {}
 
-ObjectPtr NativePrintLine::invoke(const std::vector<ObjectPtr> &params) {
-  ObjectPtr param = params[0];
-  if (param == nullptr)
-    throw NativeFuncException("ERROR! Invalid for null variable for print");
-  switch (param->kind_) {
-    case ObjKind::INT:
-      std::cout << std::dynamic_pointer_cast<IntObject>(param)->value_ << std::endl;
-      break;
-    case ObjKind::FLOAT:
-      std::cout << std::dynamic_pointer_cast<FloatObject>(param)->value_ << std::endl;
-      break;
-    case ObjKind::STRING:
-      std::cout << std::dynamic_pointer_cast<StrObject>(param)->str_ << std::endl;
-      break;
-    case ObjKind::BOOL:
-      std::cout << std::dynamic_pointer_cast<BoolObject>(param)->b_ << std::endl;
-      break;
-    default:
-      std::cout << param->info() << std::endl;
-      break;
-  }
-  return nullptr;
+Value NativePrintLine::invoke(NativeArgs args) {
+  printValue(args[0], true);
+  return Value();
 }
 
 /************************从标准输入读取一个整型**********************/
 
 NativeReadInt::NativeReadInt(): NativeFunction("readInt", 0) {}
 
-ObjectPtr NativeReadInt::invoke(const std::vector<ObjectPtr> &__attribute__((unused))params) {
+Value NativeReadInt::invoke(NativeArgs __attribute__((unused))args) {
   int num;
   std::cin >> num;
-  return std::make_shared<IntObject>(num);
+  return Value::makeInt(num);
 }
 
 /**********************从标准输入读取一个浮点型*********************/
 
 NativeReadFloat::NativeReadFloat(): NativeFunction("readFloat", 0) {}
 
-ObjectPtr NativeReadFloat::invoke(const std::vector<ObjectPtr> &__attribute__((unused))params) {
+Value NativeReadFloat::invoke(NativeArgs __attribute__((unused))args) {
   double num;
   std::cin >> num;
-  return std::make_shared<FloatObject>(num);
+  return Value::makeFloat(num);
 }
 
 /**********************从标准输入读取一个字符串********************/
 
 NativeReadString::NativeReadString(): NativeFunction("readStr", 0) {}
 
-ObjectPtr NativeReadString::invoke(const std::vector<ObjectPtr> &__attribute__((unused))params) {
+Value NativeReadString::invoke(NativeArgs __attribute__((unused))args) {
   std::string str;
   std::cin >> str;
-  return std::make_shared<StrObject>(str);
+  return Value(std::make_shared<StrObject>(str));
 }
-
@@ -38,49 +38,49 @@ private:
 class NativePrint: public NativeFunction {
 public:
   NativePrint();
-  ObjectPtr invoke(const std::vector<ObjectPtr> &params) override;
+  Value invoke(NativeArgs args) override;
 };
 
 /***************************换行打印函数******************************/
 class NativePrintLine: public NativeFunction {
 public:
   NativePrintLine();
-  ObjectPtr invoke(const std::vector<ObjectPtr> &params) override;
+  Value invoke(NativeArgs args) override;
 };
 
 /************************从标准输入读取一个整型**********************/
 class NativeReadInt: public NativeFunction {
 public:
   NativeReadInt();
-  ObjectPtr invoke(const std::vector<ObjectPtr> &params) override;
+  Value invoke(NativeArgs args) override;
 };
 
 /**********************从标准输入读取一个浮点型*********************/
 class NativeReadFloat: public NativeFunction {
 public:  
   NativeReadFloat();
-  ObjectPtr invoke(const std::vector<ObjectPtr> &params) override;
+  Value invoke(NativeArgs args) override;
 };
 
 /**********************从标准输入读取一个字符串********************/
 class NativeReadString: public NativeFunction {
 public:
   NativeReadString();
-  ObjectPtr invoke(const std::vector<ObjectPtr> &params) override;
+  Value invoke(NativeArgs args) override;
 };
 
 /************************返回一个只读文件*************************/
 class NativeOpenROFile: public NativeFunction {
 public:
   NativeOpenROFile();
-  ObjectPtr invoke(const std::vector<ObjectPtr> &params) override;
+  Value invoke(NativeArgs args) override;
 };
 
 /************************返回一个只写文件***********************/
 class NativeOpenWOFile: public NativeFunction {
 public:
   NativeOpenWOFile();
-  ObjectPtr invoke(const std::vector<ObjectPtr> &params) override;
+  Value invoke(NativeArgs args) override;
 };
 
 #endif
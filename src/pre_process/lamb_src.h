@@ -8,6 +8,7 @@
 #include <memory>
 #include <vector>
 #include <exception>
+#include <string>
 
 class LambAST;
 
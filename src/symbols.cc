@@ -1,11 +1,14 @@
 #include "symbols.h"
 
+#include <algorithm>
+#include "env.h"
+
 /**********************三种类型的全局符号表************************/
-IntSymbolsPtr g_IntSymbols = std::make_shared<ConstantSymbols<int>>();
+IntSymbolsPtr g_IntSymbols = std::make_shared<ConstantSymbols<int, IntObject>>();
 
-FloatSymbolsPtr g_FloatSymbols = std::make_shared<ConstantSymbols<double>>();
+FloatSymbolsPtr g_FloatSymbols = std::make_shared<ConstantSymbols<double, FloatObject>>();
 
-StrSymbolsPtr g_StrSymbols = std::make_shared<ConstantSymbols<std::string>>();
+StrSymbolsPtr g_StrSymbols = std::make_shared<ConstantSymbols<std::string, StrObject>>();
 
 /**************************通用符号表******************************/
 Symbols::Symbols(SymbolsPtr outer, SymbolsKind kind):
@@ -15,8 +18,9 @@ int Symbols::getRuntimeIndex(const std::string &name) {
   //a.变量名是$开头的，返回-1
   //b.如果该符号表不是函数的，那么把变量插入，返回-1
   //c.如果该符号表是函数的，且在当前环境找到，返回相应下标
-  //d.如果该符号表是函数的，在当前环境找不到，尝试向上寻找，如果找到：
-  //  上层环境是全局返回-1，上层环境是函数环境返回（-2 - 下标）
+  //d.如果该符号表是函数的，在当前环境找不到，尝试在外层函数中寻找，
+  //  找到则返回（-2 - 闭包变量下标）
+  //e.否则尝试向上寻找，在全局或类中找到返回-1，
   //  否则在当前符号表插入并返回相应下标  
   
   if (name[0] == '$')
@@ -27,22 +31,19 @@ int Symbols::getRuntimeIndex(const std::string &name) {
     return -1;
   }
   
-  if (symbolsIndex_.find(name) != symbolsIndex_.end()) {
+  if (symbolsIndex_.find(name) != symbolsIndex_.end())
     return symbolsIndex_[name];
-  } else {
-    SymbolsPtr varLocation = locateSymbol(outer_, name);
-    if (varLocation == nullptr) {
-      size_t index = symbolsIndex_.size();
-      symbolsIndex_.insert({name, index});
-      return index;
-    }
-    else {
-      if (varLocation->kind_ == SymbolsKind::FUNCTION)
-        return (-2 - varLocation->getRuntimeIndex(name));
-      else
-        return -1;
-    }
-  }
+
+  int upvalue = resolveUpvalue(name);
+  if (upvalue >= 0)
+    return -2 - upvalue;
+
+  if (locateSymbol(outer_, name) != nullptr)
+    return -1;
+
+  size_t index = symbolsIndex_.size();
+  symbolsIndex_.insert({name, index});
+  return index;
 }
 
 int Symbols::forceGetLocalIndex(const std::string &name) {
@@ -60,6 +61,19 @@ size_t Symbols::getSymbolSize() const {
   return symbolsIndex_.size();
 }
 
+bool Symbols::isCapturedLocal(size_t index) const {
+  return std::find(capturedLocals_.begin(), capturedLocals_.end(), index) != 
+    capturedLocals_.end();
+}
+
+const std::vector<size_t> &Symbols::capturedLocals() const {
+  return capturedLocals_;
+}
+
+const std::vector<UpvalueSource> &Symbols::upvalues() const {
+  return upvalues_;
+}
+
 void Symbols::putClassSymbols(const std::string &className, 
     SymbolsPtr symbols) {
   if (kind_ != SymbolsKind::UNIT)
@@ -85,3 +99,31 @@ SymbolsPtr Symbols::locateSymbol(SymbolsPtr symbol, const std::string &name) {
   else
     return locateSymbol(symbol->outer_, name);
 }
+
+int Symbols::resolveUpvalue(const std::string &name) {
+  auto iter = upvalueIndex_.find(name);
+  if (iter != upvalueIndex_.end())
+    return iter->second;
+
+  if (outer_ == nullptr || outer_->kind_ != SymbolsKind::FUNCTION)
+    return -1;
+
+  //变量是外层函数的局部变量时直接引用它的单元，
+  //否则外层函数先引用更外层的变量，再把单元传递下来
+  UpvalueSource source;
+  auto local = outer_->symbolsIndex_.find(name);
+  if (local != outer_->symbolsIndex_.end()) {
+    if (!outer_->isCapturedLocal(local->second))
+      outer_->capturedLocals_.push_back(local->second);
+    source = {true, local->second};
+  }
+  else {
+    int outerUpvalue = outer_->resolveUpvalue(name);
+    if (outerUpvalue < 0)
+      return -1;
+    source = {false, static_cast<size_t>(outerUpvalue)};
+  }
+  upvalues_.push_back(source);
+  upvalueIndex_.insert({name, upvalues_.size() - 1});
+  return upvalues_.size() - 1;
+}
@@ -24,7 +24,9 @@ private:
 };
 
 /**************************常量符号表******************************/
-template <typename T>
+//ObjType是常量在运行时对应的对象类型，常量第一次放入常量池时即创建好相应的
+//不可变对象，运行时直接共享该对象，不需要每次都重新创建
+template <typename T, typename ObjType>
 class ConstantSymbols {
 public:
   ConstantSymbols() = default;
@@ -36,6 +38,7 @@ public:
     }
     else {
       constPool_.push_back(constant);
+      objectPool_.push_back(std::make_shared<ObjType>(constant));
       size_t result = constPool_.size() - 1;
       symbolsIndex_[constant] = result;
       return result;
@@ -43,11 +46,21 @@ public:
   }
 
   //获取常量池中的变量
-  T get(size_t index) {
+  const T &get(size_t index) const {
     if (index >= constPool_.size())
       throw SymbolsException("const value access out of range");
     return constPool_[index];
   }
+
+  //获取常量对应的对象，对象是不可变的，可以被多处共享
+  //下标由编译器生成，Release版本不做越界检查
+  const std::shared_ptr<ObjType> &getObject(size_t index) const {
+#ifndef NDEBUG
+    if (index >= objectPool_.size())
+      throw SymbolsException("const object access out of range");
+#endif
+    return objectPool_[index];
+  }
   
   //获取常量池
   std::vector<T> &getConstantPool() const {
@@ -60,14 +73,22 @@ private:
 
   //常量池
   std::vector<T> constPool_;
+
+  //常量对应的对象，与常量池一一对应
+  std::vector<std::shared_ptr<ObjType>> objectPool_;
 };
-using IntSymbolsPtr = std::shared_ptr<ConstantSymbols<int>>;
+
+class IntObject;
+class FloatObject;
+class StrObject;
+
+using IntSymbolsPtr = std::shared_ptr<ConstantSymbols<int, IntObject>>;
 extern IntSymbolsPtr g_IntSymbols;
 
-using FloatSymbolsPtr = std::shared_ptr<ConstantSymbols<double>>;
+using FloatSymbolsPtr = std::shared_ptr<ConstantSymbols<double, FloatObject>>;
 extern FloatSymbolsPtr g_FloatSymbols;
 
-using StrSymbolsPtr = std::shared_ptr<ConstantSymbols<std::string>>;
+using StrSymbolsPtr = std::shared_ptr<ConstantSymbols<std::string, StrObject>>;
 extern StrSymbolsPtr g_StrSymbols;
 
 
@@ -79,13 +100,23 @@ enum class SymbolsKind {
 class Symbols;
 using SymbolsPtr = std::shared_ptr<Symbols>;
 
+//闭包引用的外层变量的来源，创建闭包时据此从外层函数中取得单元
+struct UpvalueSource {
+  //为真时是外层函数的局部变量，否则是外层函数（也是lamb）自己引用的闭包变量
+  bool fromLocal;
+
+  //局部变量下标或外层函数的闭包变量下标
+  size_t index;
+};
+
 class Symbols {
 public:
   Symbols(SymbolsPtr outer, SymbolsKind kind);
 
   //获取局部变量在函数运行时环境的位置
   //如果该变量为全局变量或类变量，则返回-1
-  //如果该变量为闭包上层函数的临时变量，返回（-2 - 下标），结果值 + 2可反向逆推
+  //如果该变量为外层函数的临时变量，返回（-2 - 闭包变量下标），-2 - 结果值可反向逆推
+  //外层函数可以隔着多层lamb，中间的每一层lamb都会引用该变量并逐层传递单元
   int getRuntimeIndex(const std::string &name);
 
   //当前传入变量被强制当作临时变量处理
@@ -96,6 +127,15 @@ public:
   //获取符号表大小
   size_t getSymbolSize() const;
 
+  //局部变量是否被内层的lamb引用，被引用的局部变量存放在单元中
+  bool isCapturedLocal(size_t index) const;
+
+  //被内层的lamb引用的局部变量下标
+  const std::vector<size_t> &capturedLocals() const;
+
+  //该函数（lamb）引用的外层变量的来源，下标即闭包变量下标
+  const std::vector<UpvalueSource> &upvalues() const;
+
   //添加某个类的符号表
   //只有当当前符号表时unit的符号表时才有效
   void putClassSymbols(const std::string &className, SymbolsPtr symbols);
@@ -107,6 +147,9 @@ public:
 private:
   //定位符号所在的符号表，如果找不到返回空指针
   SymbolsPtr locateSymbol(SymbolsPtr symbol, const std::string &name);
+
+  //在外层函数中查找变量，找到则为当前函数分配闭包变量并返回其下标，否则返回-1
+  int resolveUpvalue(const std::string &name);
   
 private:
   //符号表类型
@@ -121,6 +164,13 @@ private:
   //类符号表<类名，符号表>
   //只有当当前符号表是unit的符号表时才会使用该项
   std::map<std::string, SymbolsPtr> classSymbols_;
+
+  //被内层的lamb引用的局部变量下标
+  std::vector<size_t> capturedLocals_;
+
+  //引用的外层变量的来源，以及变量名到闭包变量下标的索引
+  std::vector<UpvalueSource> upvalues_;
+  std::map<std::string, size_t> upvalueIndex_;
 };
 
 #endif
@@ -1,5 +1,8 @@
 #include "code.h"
 
+#include <algorithm>
+#include "../symbols.h"
+
 unsigned Code::add() {
   return push(ADD);
 }
@@ -59,11 +62,26 @@ unsigned Code::fconst(unsigned index) {
   return push(index);
 }
 
+unsigned Code::nconst() {
+  return push(NCONST);
+}
+
 unsigned Code::call(unsigned paramNum) {
   push(CALL);
   return push(paramNum);
 }
 
+unsigned Code::tailcall(unsigned paramNum) {
+  push(TAILCALL);
+  return push(paramNum);
+}
+
+unsigned Code::invoke(unsigned cacheIndex, unsigned paramNum) {
+  push(INVOKE);
+  push(cacheIndex);
+  return push(paramNum);
+}
+
 unsigned Code::ret() {
   return push(RET);
 }
@@ -83,6 +101,12 @@ unsigned Code::brf(unsigned index) {
   return push(index);
 }
 
+unsigned Code::guard(unsigned guardIndex, unsigned index) {
+  push(GUARD);
+  push(guardIndex);
+  return push(index);
+}
+
 unsigned Code::andLogic() {
   return push(AND);
 }
@@ -121,6 +145,16 @@ unsigned Code::store(unsigned index) {
   return push(index);
 }
 
+unsigned Code::loadCell(unsigned index) {
+  push(LOAD_CELL);
+  return push(index);
+}
+
+unsigned Code::storeCell(unsigned index) {
+  push(STORE_CELL);
+  return push(index);
+}
+
 unsigned Code::arrayGenerate(unsigned size) {
   push(ARRAY_GENERATE);
   return push(size);
@@ -140,17 +174,14 @@ unsigned Code::lamb(unsigned lambSrcIndex) {
   return push(lambSrcIndex);
 }
 
-unsigned Code::dotAccess() {
-  return push(DOT_ACCESS);
+unsigned Code::dotAccess(unsigned cacheIndex) {
+  push(DOT_ACCESS);
+  return push(cacheIndex);
 }
 
-unsigned Code::dotAssign() {
-  return push(DOT_ASSIGN);
-}
-
-unsigned Code::rawString(unsigned index) {
-  push(RAW_STRING);
-  return push(index);
+unsigned Code::dotAssign(unsigned cacheIndex) {
+  push(DOT_ASSIGN);
+  return push(cacheIndex);
 }
 
 unsigned Code::newInstance() {
@@ -161,6 +192,10 @@ unsigned Code::neg() {
   return push(NEG);
 }
 
+unsigned Code::pop() {
+  return push(POP);
+}
+
 unsigned Code::halt() {
   return push(HALT);
 }
@@ -182,10 +217,310 @@ void Code::set(size_t index, unsigned code) {
   codes_[index] = code;
 }
 
+void Code::set(const std::vector<size_t> &positions, unsigned code) {
+  for (size_t index: positions)
+    codes_[index] = code;
+}
+
 unsigned Code::get(size_t index) const {
   return codes_[index];
 }
 
-unsigned Code::getCodeSize() {
+unsigned Code::getCodeSize() const {
   return codes_.size();
 }
+
+void Code::calcMaxStackDepth() {
+  //窥孔优化之后，BR之前可能留有由跳转目标使用的值，跳转前后的栈深度不再一样，
+  //所以沿控制流计算每条指令执行前的深度
+  std::vector<int> depths = stackDepths();
+  int maxDepth = 0;
+  for (size_t i = 0; i < codes_.size(); i += 1 + operandNum(codes_[i])) {
+    int depth = depths[i];
+    if (depth < 0)
+      continue;
+    switch (codes_[i]) {
+      case INC_LOCAL: case LOCAL_LT_BRF: case LOCAL_ARRAY_ACCESS:
+        //和合并前的序列一样最多占用两个栈位，
+        //操作数不是整数时解释器借用栈顶进行通用运算
+        maxDepth = std::max(maxDepth, depth + 2);
+        break;
+      default:
+        break;
+    }
+    maxDepth = std::max(maxDepth, depth + std::max(stackEffect(i), 0));
+  }
+  maxStackDepth_ = maxDepth;
+}
+
+std::vector<int> Code::stackDepths() const {
+  std::vector<int> depths(codes_.size() + 1, -1);
+  std::vector<size_t> worklist{0};
+  depths[0] = 0;
+  while (!worklist.empty()) {
+    size_t i = worklist.back();
+    worklist.pop_back();
+    if (i >= codes_.size())
+      continue;
+    unsigned instruction = codes_[i];
+    int depth = depths[i] + stackEffect(i);
+    auto flowTo = [&](size_t next) {
+      if (depths[next] < 0) {
+        depths[next] = depth;
+        worklist.push_back(next);
+      }
+    };
+    if (instruction != BR && instruction != RET && instruction != HALT)
+      flowTo(i + 1 + operandNum(instruction));
+    unsigned offset = branchOperand(instruction);
+    if (offset != 0)
+      flowTo(codes_[i + offset]);
+  }
+  return depths;
+}
+
+int Code::stackEffect(size_t position) const {
+  switch (codes_[position]) {
+    case SCONST: case ICONST: case FCONST: case NCONST:
+    case GLOAD: case CLOAD: case LOAD: case LOAD_CELL:
+    case LAMB: case NEW_INSTANCE:
+    case LOCAL_ARRAY_ACCESS:
+      return 1;
+    case ADD: case SUB: case MUL: case DIV: case MOD:
+    case EQ: case LT: case BT: case LE: case BE: case NEQ:
+    case AND: case OR:
+    case RET: case BRT: case BRF:
+    case GSTORE: case CSTORE: case STORE: case STORE_CELL:
+    case ARRAY_ACCCESS: case POP:
+    case ADD_INT_INT: case SUB_INT_INT: case MUL_INT_INT: case DIV_INT_INT:
+    case EQ_INT_INT: case LT_INT_INT: case BT_INT_INT: case LE_INT_INT:
+    case BE_INT_INT: case NEQ_INT_INT: case ADD_STR_STR:
+    case ADD_I: case SUB_I: case MUL_I: case DIV_I:
+    case EQ_I: case LT_I: case BT_I: case LE_I: case BE_I: case NEQ_I:
+    case ARRAY_ACCESS_I:
+      return -1;
+    case ARRAY_ASSIGN:
+      return -3;
+    case DOT_ASSIGN:
+      return -2;
+    case CALL: case TAILCALL:
+      //弹出函数对象和实参，压入返回值
+      return -static_cast<int>(codes_[position + 1]);
+    case INVOKE:
+      //弹出接收者和实参，压入返回值
+      return -static_cast<int>(codes_[position + 2]);
+    case ARRAY_GENERATE:
+      return 1 - static_cast<int>(codes_[position + 1]);
+    default:
+      return 0;
+  }
+}
+
+unsigned Code::getMaxStackDepth() const {
+  return maxStackDepth_;
+}
+
+void Code::fuseSuperInstructions() {
+  //标记所有的跳转目标，被合并的序列中间不能有跳转目标
+  std::vector<bool> targets(codes_.size() + 1, false);
+  for (size_t i = 0; i < codes_.size(); i += 1 + operandNum(codes_[i])) {
+    unsigned offset = branchOperand(codes_[i]);
+    if (offset != 0)
+      targets[codes_[i + offset]] = true;
+  }
+
+  //合并后的字节码，以及每条原指令在合并后的位置
+  std::vector<unsigned> fused;
+  fused.reserve(codes_.size());
+  std::vector<unsigned> newPosition(codes_.size() + 1, 0);
+  for (size_t i = 0; i < codes_.size(); ) {
+    newPosition[i] = fused.size();
+    size_t length = fuseAt(i, targets, fused);
+    if (length == 0) {
+      length = 1 + operandNum(codes_[i]);
+      fused.insert(fused.end(), codes_.begin() + i, codes_.begin() + i + length);
+    }
+    i += length;
+  }
+  newPosition[codes_.size()] = fused.size();
+
+  //修正跳转地址
+  for (size_t i = 0; i < fused.size(); i += 1 + operandNum(fused[i])) {
+    unsigned offset = branchOperand(fused[i]);
+    if (offset != 0)
+      fused[i + offset] = newPosition[fused[i + offset]];
+  }
+  codes_.swap(fused);
+}
+
+size_t Code::fuseAt(size_t pos, const std::vector<bool> &targets,
+    std::vector<unsigned> &fused) const {
+  //切分出从pos开始的最多4条指令，遇到跳转目标则停止
+  const size_t maxCount = 4;
+  size_t starts[maxCount];
+  size_t count = 0;
+  for (size_t i = pos; i < codes_.size() && count < maxCount; 
+      i += 1 + operandNum(codes_[i])) {
+    if (i != pos && targets[i])
+      break;
+    starts[count++] = i;
+  }
+  auto op = [&](size_t k) { return codes_[starts[k]]; };
+  auto arg = [&](size_t k) { return codes_[starts[k] + 1]; };
+
+  //有类型指令和通用指令合并成同一条超级指令，超级指令自己检查类型
+  //ICONST k; LOAD a; ADD; STORE a
+  if (count >= 4 && op(0) == ICONST && op(1) == LOAD && genericForm(op(2)) == ADD && 
+      op(3) == STORE && arg(1) == arg(3)) {
+    fused.push_back(INC_LOCAL);
+    fused.push_back(arg(1));
+    fused.push_back(static_cast<unsigned>(g_IntSymbols->get(arg(0))));
+    return starts[3] + 2 - pos;
+  }
+
+  //LOAD b; LOAD a; LT; BRF t
+  if (count >= 4 && op(0) == LOAD && op(1) == LOAD && genericForm(op(2)) == LT &&
+      op(3) == BRF) {
+    fused.push_back(LOCAL_LT_BRF);
+    fused.push_back(arg(1));
+    fused.push_back(arg(0));
+    fused.push_back(arg(3));
+    return starts[3] + 2 - pos;
+  }
+
+  //LOAD arr; LOAD i; ARRAY_ACCCESS
+  if (count >= 3 && op(0) == LOAD && op(1) == LOAD &&
+      genericForm(op(2)) == ARRAY_ACCCESS) {
+    fused.push_back(LOCAL_ARRAY_ACCESS);
+    fused.push_back(arg(0));
+    fused.push_back(arg(1));
+    return starts[2] + 1 - pos;
+  }
+
+  return 0;
+}
+
+unsigned Code::operandNum(unsigned instruction) {
+  switch (instruction) {
+    case SCONST: case ICONST: case FCONST:
+    case CALL: case TAILCALL:
+    case BR: case BRT: case BRF:
+    case GLOAD: case GSTORE: case CLOAD: case CSTORE: case LOAD: case STORE:
+    case LOAD_CELL: case STORE_CELL:
+    case ARRAY_GENERATE: case LAMB:
+    case DOT_ACCESS: case DOT_ASSIGN:
+      return 1;
+    case INVOKE: case GUARD: case INC_LOCAL: case LOCAL_ARRAY_ACCESS:
+      return 2;
+    case LOCAL_LT_BRF:
+      return 3;
+    default:
+      return 0;
+  }
+}
+
+unsigned Code::intSpecialized(unsigned instruction) {
+  switch (instruction) {
+    case ADD: return ADD_INT_INT;
+    case SUB: return SUB_INT_INT;
+    case MUL: return MUL_INT_INT;
+    case DIV: return DIV_INT_INT;
+    case EQ: return EQ_INT_INT;
+    case LT: return LT_INT_INT;
+    case BT: return BT_INT_INT;
+    case LE: return LE_INT_INT;
+    case BE: return BE_INT_INT;
+    case NEQ: return NEQ_INT_INT;
+    default: return instruction;
+  }
+}
+
+unsigned Code::intTyped(unsigned instruction) {
+  switch (instruction) {
+    case ADD: return ADD_I;
+    case SUB: return SUB_I;
+    case MUL: return MUL_I;
+    case DIV: return DIV_I;
+    case EQ: return EQ_I;
+    case LT: return LT_I;
+    case BT: return BT_I;
+    case LE: return LE_I;
+    case BE: return BE_I;
+    case NEQ: return NEQ_I;
+    case ARRAY_ACCCESS: return ARRAY_ACCESS_I;
+    default: return instruction;
+  }
+}
+
+unsigned Code::genericForm(unsigned instruction) {
+  switch (instruction) {
+    case ADD_INT_INT: case ADD_STR_STR: case ADD_I: return ADD;
+    case SUB_INT_INT: case SUB_I: return SUB;
+    case MUL_INT_INT: case MUL_I: return MUL;
+    case DIV_INT_INT: case DIV_I: return DIV;
+    case EQ_INT_INT: case EQ_I: return EQ;
+    case LT_INT_INT: case LT_I: return LT;
+    case BT_INT_INT: case BT_I: return BT;
+    case LE_INT_INT: case LE_I: return LE;
+    case BE_INT_INT: case BE_I: return BE;
+    case NEQ_INT_INT: case NEQ_I: return NEQ;
+    case ARRAY_ACCESS_I: return ARRAY_ACCCESS;
+    default: return instruction;
+  }
+}
+
+unsigned Code::branchOperand(unsigned instruction) {
+  switch (instruction) {
+    case BR: case BRT: case BRF:
+      return 1;
+    case GUARD:
+      return 2;
+    case LOCAL_LT_BRF:
+      return 3;
+    default:
+      return 0;
+  }
+}
+
+const char *Code::instructionName(unsigned instruction) {
+  //顺序必须和Instruction的定义一致
+  static const char *names[] = {
+    "ADD", "SUB", "MUL", "DIV", "MOD",
+    "EQ", "LT", "BT", "LE", "BE", "NEQ",
+    "SCONST", "ICONST", "FCONST",
+    "NCONST",
+    "CALL",
+    "TAILCALL",
+    "INVOKE",
+    "RET",
+    "BR", "BRT", "BRF",
+    "GUARD",
+    "AND", "OR",
+    "GLOAD", "GSTORE",
+    "CLOAD", "CSTORE",
+    "LOAD", "STORE",
+    "LOAD_CELL", "STORE_CELL",
+    "ARRAY_GENERATE",
+    "ARRAY_ACCCESS", "ARRAY_ASSIGN",
+    "LAMB",
+    "DOT_ACCESS",
+    "DOT_ASSIGN",
+    "NEW_INSTANCE",
+    "NEG",
+    "POP",
+    "INC_LOCAL", "LOCAL_LT_BRF", "LOCAL_ARRAY_ACCESS",
+    "ADD_INT_INT", "SUB_INT_INT", "MUL_INT_INT", "DIV_INT_INT",
+    "EQ_INT_INT", "LT_INT_INT", "BT_INT_INT", "LE_INT_INT", "BE_INT_INT",
+    "NEQ_INT_INT",
+    "ADD_STR_STR",
+    "ADD_I", "SUB_I", "MUL_I", "DIV_I",
+    "EQ_I", "LT_I", "BT_I", "LE_I", "BE_I", "NEQ_I",
+    "ARRAY_ACCESS_I",
+    "HALT"
+  };
+  static_assert(sizeof(names) / sizeof(names[0]) == HALT + 1,
+      "instruction names do not match the instruction set");
+  if (instruction > HALT)
+    return "UNKNOWN";
+  return names[instruction];
+}
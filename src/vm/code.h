@@ -8,10 +8,13 @@
  *  函数（或闭包）经过编译后，产生的字节码存放在该类的实例中，运行时从这里获取
  *字节代码
  *
- *  指令分为无操作数、单操作数、双操作数，分别对应1个、5个、9个字(32位)
+ *  每条指令占一个字(32位)，之后紧跟它的操作数，每个操作数也占一个字，
+ *普通指令最多一个操作数，超级指令最多三个操作数
  *  下面注释中的“栈”泛指“操作数栈”，如果是“调用栈”会直接标明“调用栈”
  *  函数调用如果没有返回值，则往操作数栈压入空对象（这在函数代码翻译成字节代码
  *时实现）
+ *  每个表达式都恰好往栈中压入一个对象，作为语句的表达式由编译器补上POP指令，
+ *所以函数中每条指令执行时操作数栈的深度是编译时确定的
  */
 
 enum Instruction {
@@ -24,16 +27,33 @@ enum Instruction {
   //获取常量池中的常量，转化为相应的类型对象并压入栈中
   SCONST, ICONST, FCONST, 
 
+  //压入空对象
+  NCONST,
+
   //调用函数，将新的栈帧压入调用栈中，将栈中的入参传递给栈帧，
   //进入下一轮循环
   CALL, 
 
-  //函数返回，返回值（如果有）将压入栈中。弹出调用栈，进入下一轮循环
+  //尾调用，出现在return f(...)中，操作数同CALL。调用的是普通函数时，把函数对象和
+  //实参移到当前函数对象所在的位置，弹出当前栈帧后再压入被调用函数的栈帧，
+  //调用栈的深度不变；调用原生函数时和CALL相同，之后由紧跟的RET返回
+  TAILCALL,
+
+  //方法调用，对应obj.method(args)，操作数依次为域访问的内联缓存下标、实参个数。
+  //接收者和实参已经依次压入栈，通过内联缓存找到方法后替换接收者，之后和CALL相同
+  INVOKE,
+
+  //函数返回，弹出栈顶的返回值，回收栈帧在操作数栈上占用的空间后再把返回值压入栈中。
+  //弹出调用栈，进入下一轮循环
   RET, 
 
   //跳转操作，分为无条件跳转，如果为真（假）则跳转
   BR, BRT, BRF, 
 
+  //内联守卫，操作数依次为守卫下标、跳转地址。内联展开的函数体之前的检查，
+  //全局名字仍然绑定到被内联的函数时继续执行展开的函数体，否则跳转到普通调用
+  GUARD,
+
   //与（或）逻辑，从栈中获取两个对象，执行与（或）逻辑
   AND, OR,
 
@@ -41,14 +61,18 @@ enum Instruction {
   //将结果压入栈中或将栈顶元素弹出对其进行赋值
   GLOAD, GSTORE, 
 
-  //操作闭包变量，根据下表从局部环境的上层环境查找
-  //将结果压入栈或将栈顶元素弹出对其进行赋值
+  //操作闭包变量，根据下标从闭包的单元表中取得单元，
+  //将单元中的值压入栈或将栈顶元素弹出存入单元
   CLOAD, CSTORE,
 
   //操作局部变量，根据下标从局部环境中查找，
   //将结果压入栈中或将栈顶元素弹出对其进行赋值
   LOAD, STORE, 
 
+  //操作被lamb引用的局部变量，该局部变量中存放的是单元，
+  //将单元中的值压入栈或将栈顶元素弹出存入单元
+  LOAD_CELL, STORE_CELL,
+
   //生成数组
   ARRAY_GENERATE,
 
@@ -58,26 +82,62 @@ enum Instruction {
   //LAMBDA表达式
   LAMB,
   
-  //域访问
+  //域访问，弹出对象，把它的成员压入栈中
+  //操作数是函数中域访问点的内联缓存下标，缓存中记录了成员的名称
   DOT_ACCESS,
 
-  //域赋值
+  //域赋值，依次弹出对象和值，把值赋给对象的成员，操作数同DOT_ACCESS
   DOT_ASSIGN,
 
-  //元字符指令，虚拟机从栈帧中获取相应的字符串，该串在语言中不是字符串，
-  //但其在被虚拟机处理时需要当作字符串，如域访问、域赋值的后缀(eg. a.b中的b)
-  RAW_STRING,
-
   //创建对象
   NEW_INSTANCE,
 
   //弹出栈顶元素，取其负值并压入栈
   NEG,
+
+  //弹出栈顶元素并丢弃，用于表达式语句
+  POP,
+
+  //超级指令，由常见的指令序列合并而成，只由fuseSuperInstructions生成，
+  //合并后减少了指令分派和操作数栈的读写。新增超级指令前可以用
+  //tools/mine_ngrams.py统计程序执行时最常见的指令序列
+
+  //局部变量加上整数常量，操作数依次为局部变量下标、整数值
+  //对应 ICONST k; LOAD a; ADD; STORE a，即 a = a + k
+  INC_LOCAL,
+
+  //两个局部变量比较，a < b不成立时跳转，操作数依次为a、b的下标和跳转地址
+  //对应 LOAD b; LOAD a; LT; BRF t，即 while/if a < b
+  LOCAL_LT_BRF,
+
+  //用局部变量作下标访问局部变量中的数组，操作数依次为数组、下标的局部变量下标
+  //对应 LOAD arr; LOAD i; ARRAY_ACCCESS，即 arr[i]
+  LOCAL_ARRAY_ACCESS,
+
+  //特化指令，通用的运算指令第一次执行时根据操作数类型把自己改写成特化形式，
+  //特化指令先检查操作数类型，类型不符时改回通用形式重新执行
+  //两个操作数都是整数的四则运算和比较
+  ADD_INT_INT, SUB_INT_INT, MUL_INT_INT, DIV_INT_INT,
+  EQ_INT_INT, LT_INT_INT, BT_INT_INT, LE_INT_INT, BE_INT_INT, NEQ_INT_INT,
+
+  //两个操作数都是字符串的拼接
+  ADD_STR_STR,
+
+  //有类型指令，由中间表示上的类型推导（见ir_pass.h）在操作数已被证明是整数时生成，
+  //执行时不检查操作数类型，也不会改写成其它形式
+  //两个操作数都是整数的四则运算和比较
+  ADD_I, SUB_I, MUL_I, DIV_I,
+  EQ_I, LT_I, BT_I, LE_I, BE_I, NEQ_I,
+
+  //下标是整数的数组访问，仍然检查数组的类型
+  ARRAY_ACCESS_I,
   
   //中止程序
   HALT
 };
 
+class JitCode;
+
 class Code {
 public:
   //生成指令，并返回指令的最后的地址
@@ -109,8 +169,14 @@ public:
 
   unsigned fconst(unsigned index);
 
+  unsigned nconst();
+
   unsigned call(unsigned paramNum);
 
+  unsigned tailcall(unsigned paramNum);
+
+  unsigned invoke(unsigned cacheIndex, unsigned paramNum);
+
   unsigned ret();
 
   unsigned br(unsigned index);
@@ -119,6 +185,8 @@ public:
 
   unsigned brf(unsigned index);
 
+  unsigned guard(unsigned guardIndex, unsigned index);
+
   unsigned andLogic();
 
   unsigned orLogic();
@@ -135,6 +203,10 @@ public:
 
   unsigned store(unsigned index);
 
+  unsigned loadCell(unsigned index);
+
+  unsigned storeCell(unsigned index);
+
   unsigned arrayGenerate(unsigned size);
 
   unsigned arrayAccess();
@@ -143,16 +215,16 @@ public:
 
   unsigned lamb(unsigned lambSrcIndex);
 
-  unsigned dotAccess();
-
-  unsigned dotAssign();
+  unsigned dotAccess(unsigned cacheIndex);
 
-  unsigned rawString(unsigned index);
+  unsigned dotAssign(unsigned cacheIndex);
 
   unsigned newInstance();
 
   unsigned neg();
 
+  unsigned pop();
+
   unsigned halt();
 
   //获取代码
@@ -164,16 +236,91 @@ public:
   //设置某个位置的字节码
   void set(size_t index, unsigned code);
 
+  //把positions中的每个位置都设置为code，用于修正同一目标的多条跳转
+  void set(const std::vector<size_t> &positions, unsigned code);
+
   //获取某个位置的字节码
   unsigned get(size_t index) const;
 
   //返回字节码的长度
-  unsigned getCodeSize();
+  unsigned getCodeSize() const;
+
+  //计算运行时操作数栈所需的最大深度，在函数编译完成后调用
+  void calcMaxStackDepth();
+
+  //获取运行时操作数栈所需的最大深度
+  unsigned getMaxStackDepth() const;
+
+  //沿控制流计算每条指令执行前操作数栈的深度（不含栈帧窗口），
+  //按指令位置索引，不可达的指令为-1
+  std::vector<int> stackDepths() const;
+
+  //把常见的指令序列合并成超级指令，并修正跳转地址，在函数编译完成后调用
+  //合并后局部变量直接从栈帧窗口读写
+  void fuseSuperInstructions();
+
+  //指令的操作数个数
+  static unsigned operandNum(unsigned instruction);
+
+  //通用运算指令在两个操作数都是整数时的特化形式，没有特化形式则返回原指令
+  static unsigned intSpecialized(unsigned instruction);
+
+  //通用运算指令在两个操作数都被证明是整数时的有类型形式，没有则返回原指令
+  static unsigned intTyped(unsigned instruction);
+
+  //特化指令和有类型指令对应的通用形式，都不是则返回原指令
+  static unsigned genericForm(unsigned instruction);
+
+  //跳转指令中跳转地址所在的操作数位置（从1开始），非跳转指令返回0
+  static unsigned branchOperand(unsigned instruction);
+
+  //指令的名称，用于调试和指令统计
+  static const char *instructionName(unsigned instruction);
+
+  //即时编译得到的机器码，没有编译时为空，见jit.h
+  JitCode *getJitCode() const {
+    return jitCode_.get();
+  }
+
+  void setJitCode(std::shared_ptr<JitCode> jitCode) {
+    jitCode_ = std::move(jitCode);
+  }
+
+  //记录一次调用，返回累计的调用次数
+  unsigned countCall() {
+    return ++callCount_;
+  }
+
+  //记录一次循环回边（向回跳转的BR）的执行，返回该回边累计的执行次数
+  //每个循环的回边是不同的指令，所以计数按回边所在的位置分别记录
+  unsigned countBackEdge(unsigned branch) {
+    if (branch >= backEdgeCounts_.size())
+      backEdgeCounts_.resize(codes_.size(), 0);
+    return ++backEdgeCounts_[branch];
+  }
+
 private:
   unsigned push(unsigned code);
 
+  //position处的指令执行后栈深度的变化
+  int stackEffect(size_t position) const;
+
+  //从pos开始尝试合并一条超级指令，成功则把它追加到fused并返回被合并的字数，
+  //否则返回0；targets标记了原字节码中所有的跳转目标
+  size_t fuseAt(size_t pos, const std::vector<bool> &targets,
+      std::vector<unsigned> &fused) const;
+
 private:
   std::vector<unsigned> codes_;
+
+  unsigned maxStackDepth_ = 0;
+
+  std::shared_ptr<JitCode> jitCode_;
+
+  unsigned callCount_ = 0;
+
+  //按回边位置记录的执行次数，第一次记录时才按字节码长度分配
+  std::vector<unsigned> backEdgeCounts_;
 };
 using CodePtr = std::shared_ptr<Code>;
 
@@ -0,0 +1,194 @@
+#include "inliner.h"
+
+#include "../ast_list.h"
+#include "../symbols.h"
+
+FuncPtr Inliner::findCallee(FuncObject &caller, const std::string &name, size_t argc) {
+  EnvPtr env = caller.outerEnv();
+  MapEnv *slotEnv = nullptr;
+  size_t slot = 0;
+  if (env == nullptr || !env->locateSlot(name, slotEnv, slot))
+    return nullptr;
+  ObjectPtr obj = slotEnv->getSlot(slot);
+  if (obj == nullptr || obj->kind_ != ObjKind::FUNCTION)
+    return nullptr;
+
+  //只内联已经编译的普通函数，名字在两个函数中解析到同一个外部环境
+  FuncPtr callee = std::static_pointer_cast<FuncObject>(obj);
+  if (callee.get() == &caller || !callee->isCompile() || callee->isMethod() ||
+      callee->outerEnv() != env || callee->params() == nullptr)
+    return nullptr;
+
+  if (callee->params()->size() != argc || callee->hasCellLocals())
+    return nullptr;
+
+  if (!canInline(caller, *callee))
+    return nullptr;
+  return callee;
+}
+
+bool Inliner::canInline(FuncObject &caller, FuncObject &callee) {
+  Code &code = *callee.getCodes();
+  if (code.getCodeSize() > maxCalleeSize)
+    return false;
+
+  //源码中的局部变量只能使用形参：其它局部变量在普通调用时初值为空，展开后
+  //却会保留上一次执行时的值。编译时新增的局部变量总是先赋值后读取
+  size_t paramNum = callee.params()->size();
+  size_t sourceLocals = callee.localVarSize() - callee.tempLocalSize();
+  auto isSourceLocal = [&](unsigned index) {
+    return index >= paramNum && index < sourceLocals;
+  };
+
+  auto names = callee.getOuterNames();
+  for (size_t i = 0; i < code.getCodeSize(); i += 1 + Code::operandNum(code.get(i))) {
+    switch (code.get(i)) {
+      case LAMB: case CLOAD: case CSTORE: case LOAD_CELL: case STORE_CELL:
+      case HALT:
+        return false;
+      case LOAD: case STORE: case INC_LOCAL:
+        if (isSourceLocal(code.get(i + 1)))
+          return false;
+        break;
+      case LOCAL_LT_BRF: case LOCAL_ARRAY_ACCESS:
+        if (isSourceLocal(code.get(i + 1)) || isSourceLocal(code.get(i + 2)))
+          return false;
+        break;
+      case GLOAD: case GSTORE: {
+        //递归调用，或者引用了调用者自身（调用者中该名字总是解析为调用者）
+        const std::string &name = (*names)[code.get(i + 1)];
+        if (name == callee.funcName() || name == caller.funcName())
+          return false;
+        break;
+      }
+      default:
+        break;
+    }
+  }
+  return true;
+}
+
+Inliner::Inliner(FuncObject &caller, FuncPtr callee, const std::string &name):
+  caller_(caller), callee_(callee), name_(name), codes_(caller.getCodes()) {}
+
+void Inliner::emit() {
+  //调用处下方还有表达式中先求值的操作数（如s + f(x)中的s）时，同样存入局部变量，
+  //使守卫和函数体划分出的基本块在边界上操作数栈为空
+  size_t paramNum = callee_->params()->size();
+  int depth = codes_->stackDepths()[codes_->nextPosition()];
+  size_t pending = depth > static_cast<int>(paramNum) ? depth - paramNum : 0;
+
+  localBase_ = caller_.addTempLocals(callee_->localVarSize() + 1 + pending);
+  resultLocal_ = localBase_ + callee_->localVarSize();
+  size_t pendingBase = resultLocal_ + 1;
+
+  //实参按源码顺序压栈，逆序存入形参，两条路径共用
+  for (size_t i = paramNum; i > 0; --i)
+    codes_->store(localBase_ + i - 1);
+  for (size_t i = pending; i > 0; --i)
+    codes_->store(pendingBase + i - 1);
+
+  unsigned funcIndex = caller_.getRuntimeIndex(name_);
+  unsigned guardOperand = codes_->guard(caller_.addInlineGuard(funcIndex, callee_), 0);
+  emitBody();
+
+  //守卫不成立时跳过展开的函数体，进行普通调用
+  codes_->set(guardOperand, codes_->nextPosition());
+  codes_->gload(funcIndex);
+  for (size_t i = 0; i < paramNum; ++i)
+    codes_->load(localBase_ + i);
+  codes_->call(paramNum);
+  codes_->store(resultLocal_);
+
+  unsigned end = codes_->nextPosition();
+  for (unsigned position: endFixups_)
+    codes_->set(position, end);
+  for (size_t i = 0; i < pending; ++i)
+    codes_->load(pendingBase + i);
+  codes_->load(resultLocal_);
+}
+
+void Inliner::emitBody() {
+  const std::vector<unsigned> &in = callee_->getCodes()->getCodes();
+  std::vector<unsigned> &out = codes_->getCodes();
+
+  //被调用函数中每条指令在调用者中的位置，以及需要修正的跳转地址所在的位置
+  std::vector<unsigned> newPosition(in.size() + 1, 0);
+  std::vector<size_t> branches;
+  for (size_t i = 0; i < in.size(); i += 1 + Code::operandNum(in[i])) {
+    unsigned instruction = in[i];
+    newPosition[i] = out.size();
+    if (instruction == RET) {
+      codes_->store(resultLocal_);
+      endFixups_.push_back(codes_->br(0));
+      continue;
+    }
+    if (instruction == TAILCALL) {
+      //展开后不再有可以复用的栈帧，之后的RET返回被调用函数的结果
+      codes_->call(in[i + 1]);
+      continue;
+    }
+
+    //被调用函数已经合并了超级指令，展开回原来的指令序列，调用者的中间表示只认识
+    //这些指令；调用者编译完成时会重新合并
+    if (instruction == INC_LOCAL) {
+      codes_->iconst(g_IntSymbols->getIndex(static_cast<int>(in[i + 2])));
+      codes_->load(localBase_ + in[i + 1]);
+      codes_->add();
+      codes_->store(localBase_ + in[i + 1]);
+      continue;
+    }
+    if (instruction == LOCAL_LT_BRF) {
+      codes_->load(localBase_ + in[i + 2]);
+      codes_->load(localBase_ + in[i + 1]);
+      codes_->lt();
+      branches.push_back(codes_->brf(in[i + 3]));
+      continue;
+    }
+    if (instruction == LOCAL_ARRAY_ACCESS) {
+      codes_->load(localBase_ + in[i + 1]);
+      codes_->load(localBase_ + in[i + 2]);
+      codes_->arrayAccess();
+      continue;
+    }
+
+    size_t start = out.size();
+    out.insert(out.end(), in.begin() + i, in.begin() + i + 1 + Code::operandNum(instruction));
+    switch (instruction) {
+      case LOAD: case STORE:
+        out[start + 1] += localBase_;
+        break;
+      case GLOAD: case GSTORE:
+        out[start + 1] = nameIndex(out[start + 1]);
+        break;
+      case DOT_ACCESS: case DOT_ASSIGN: case INVOKE:
+        out[start + 1] = dotCache(out[start + 1]);
+        break;
+      case GUARD:
+        out[start + 1] = guard(out[start + 1]);
+        break;
+      default:
+        break;
+    }
+    unsigned offset = Code::branchOperand(instruction);
+    if (offset != 0)
+      branches.push_back(start + offset);
+  }
+  newPosition[in.size()] = out.size();
+
+  for (size_t position: branches)
+    out[position] = newPosition[out[position]];
+}
+
+unsigned Inliner::nameIndex(unsigned calleeIndex) {
+  return caller_.getRuntimeIndex((*callee_->getOuterNames())[calleeIndex]);
+}
+
+unsigned Inliner::dotCache(unsigned calleeIndex) {
+  return caller_.addDotCache(nameIndex(callee_->getDotCache(calleeIndex).nameIndex));
+}
+
+unsigned Inliner::guard(unsigned calleeIndex) {
+  const InlineGuard &guard = callee_->getInlineGuard(calleeIndex);
+  return caller_.addInlineGuard(nameIndex(guard.nameIndex), guard.callee);
+}
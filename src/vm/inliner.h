@@ -0,0 +1,66 @@
+#ifndef SPARROW_INLINER_H_
+#define SPARROW_INLINER_H_
+
+#include <string>
+#include <vector>
+#include "../env.h"
+#include "code.h"
+
+/**函数内联
+ *  编译调用者时，对于直接以全局函数名调用的小函数f(args)，把被调用函数已经编译
+ *好的字节码复制到调用处，省去CALL、RET以及栈帧的开销。展开后的代码如下：
+ *
+ *        实参...                 依次压入实参
+ *        STORE pn ... STORE p1   存入为形参分配的局部变量
+ *        STORE sk ... STORE s1   调用处下方尚未使用的操作数存入局部变量
+ *        GUARD g slow            f仍然绑定到被内联的函数时继续执行
+ *        函数体                  重新映射局部变量、名字、内联缓存和跳转地址，
+ *                                RET改为 STORE r; BR end
+ *  slow: GLOAD f; LOAD p1 ... LOAD pn; CALL n; STORE r
+ *  end:  LOAD s1 ... LOAD sk; LOAD r
+ *
+ *  守卫和函数体划分出的基本块在边界上操作数栈因此都是空的，中间表示（见ir.h）
+ *依赖这一点。f之后被重新绑定到其它对象时守卫不成立，退回到普通调用。
+ *  被内联的函数必须已经编译（即定义在调用者之前），不递归、不创建闭包也不使用
+ *闭包变量，和调用者位于同一个外部环境，并且字节码足够短
+ */
+class Inliner {
+public:
+  //可以内联的函数字节码的最大长度（字）
+  static const unsigned maxCalleeSize = 48;
+
+  //查找调用者中以name调用、传入argc个实参时可以内联的函数，不能内联时返回空指针
+  static FuncPtr findCallee(FuncObject &caller, const std::string &name, size_t argc);
+
+  Inliner(FuncObject &caller, FuncPtr callee, const std::string &name);
+
+  //实参压栈之后，生成展开的函数体以及守卫不成立时的普通调用
+  void emit();
+
+private:
+  //把被调用函数的字节码复制到调用者中
+  void emitBody();
+
+  //被调用函数的每条指令是否都可以复制到调用者中
+  static bool canInline(FuncObject &caller, FuncObject &callee);
+
+  //被调用函数的名字下标、内联缓存下标、守卫下标在调用者中对应的下标
+  unsigned nameIndex(unsigned calleeIndex);
+  unsigned dotCache(unsigned calleeIndex);
+  unsigned guard(unsigned calleeIndex);
+
+private:
+  FuncObject &caller_;
+  FuncPtr callee_;
+  std::string name_;
+  CodePtr codes_;
+
+  //为被调用函数的局部变量分配的第一个局部变量，以及存放返回值的局部变量
+  size_t localBase_ = 0;
+  size_t resultLocal_ = 0;
+
+  //函数体中RET改成的跳转，跳转地址在函数体和普通调用都生成之后填入
+  std::vector<unsigned> endFixups_;
+};
+
+#endif
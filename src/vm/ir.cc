@@ -0,0 +1,515 @@
+#include "ir.h"
+
+#include <algorithm>
+
+const unsigned IRFunction::kNone;
+
+/*****************************构造************************************/
+
+bool IRFunction::build(Code &code, size_t localSize, const std::vector<size_t> &cellLocals) {
+  blocks_.clear();
+  layout_.clear();
+  rpo_.clear();
+  rpoIndex_.clear();
+  defs_.clear();
+  replaced_.clear();
+  entryDefs_.assign(localSize, kNone);
+  localSize_ = localSize;
+
+  if (!buildBlocks(code) || !buildArgs())
+    return false;
+
+  //被lamb引用的局部变量和通过单元访问的局部变量不做SSA转换
+  std::vector<bool> tracked(localSize, true);
+  for (size_t slot: cellLocals) {
+    if (slot < tracked.size())
+      tracked[slot] = false;
+  }
+  for (Block &block: blocks_) {
+    for (Inst &inst: block.insts) {
+      switch (inst.op) {
+        case LOAD: case STORE:
+          if (inst.operands[0] >= localSize)
+            return false;
+          break;
+        case LOAD_CELL: case STORE_CELL:
+          if (inst.operands[0] < localSize)
+            tracked[inst.operands[0]] = false;
+          break;
+        default:
+          break;
+      }
+    }
+  }
+
+  buildDominators();
+  buildSSA(tracked);
+  return true;
+}
+
+bool IRFunction::buildBlocks(Code &code) {
+  const std::vector<unsigned> &codes = code.getCodes();
+  if (codes.empty())
+    return false;
+
+  //基本块的起始位置：入口、跳转目标、结束基本块的指令之后
+  std::vector<bool> leader(codes.size() + 1, false);
+  leader[0] = true;
+  for (size_t i = 0; i < codes.size(); i += 1 + Code::operandNum(codes[i])) {
+    unsigned op = codes[i];
+    if (op > HALT || i + Code::operandNum(op) >= codes.size())
+      return false;
+    unsigned offset = Code::branchOperand(op);
+    if (offset != 0) {
+      if (codes[i + offset] >= codes.size())
+        return false;
+      leader[codes[i + offset]] = true;
+    }
+    if (endsBlock(op))
+      leader[i + 1 + Code::operandNum(op)] = true;
+  }
+
+  std::vector<size_t> blockAt(codes.size() + 1, kNone);
+  for (size_t i = 0; i < codes.size(); i += 1 + Code::operandNum(codes[i])) {
+    if (leader[i]) {
+      blockAt[i] = blocks_.size();
+      blocks_.emplace_back();
+      layout_.push_back(blockAt[i]);
+    }
+    Inst inst;
+    inst.op = codes[i];
+    inst.operands.assign(codes.begin() + i + 1, codes.begin() + i + 1 + Code::operandNum(codes[i]));
+    blocks_.back().insts.push_back(std::move(inst));
+  }
+
+  //跳转目标必须是指令的开头
+  for (Block &block: blocks_) {
+    Inst &last = block.insts.back();
+    unsigned offset = Code::branchOperand(last.op);
+    if (offset != 0) {
+      size_t target = blockAt[last.operands[offset - 1]];
+      if (target == kNone)
+        return false;
+      last.operands[offset - 1] = target;
+    }
+  }
+
+  for (size_t b = 0; b < blocks_.size(); ++b) {
+    Block &block = blocks_[b];
+    const Inst &last = block.insts.back();
+    if (fallsThrough(last.op)) {
+      //最后一个基本块不能顺序执行到字节码之外
+      if (b + 1 >= blocks_.size())
+        return false;
+      block.succs.push_back(b + 1);
+    }
+    unsigned offset = Code::branchOperand(last.op);
+    if (offset != 0 && std::find(block.succs.begin(), block.succs.end(),
+          last.operands[offset - 1]) == block.succs.end())
+      block.succs.push_back(last.operands[offset - 1]);
+  }
+
+  //从入口出发的深度优先遍历，得到可达的基本块和逆后序
+  std::vector<size_t> postOrder;
+  std::vector<std::pair<size_t, size_t>> stack{{0, 0}};
+  blocks_[0].reachable = true;
+  while (!stack.empty()) {
+    size_t b = stack.back().first;
+    size_t &next = stack.back().second;
+    if (next < blocks_[b].succs.size()) {
+      size_t succ = blocks_[b].succs[next++];
+      if (!blocks_[succ].reachable) {
+        blocks_[succ].reachable = true;
+        stack.push_back({succ, 0});
+      }
+    }
+    else {
+      postOrder.push_back(b);
+      stack.pop_back();
+    }
+  }
+  rpo_.assign(postOrder.rbegin(), postOrder.rend());
+  rpoIndex_.assign(blocks_.size(), kNone);
+  for (size_t i = 0; i < rpo_.size(); ++i)
+    rpoIndex_[rpo_[i]] = i;
+
+  for (size_t b: rpo_) {
+    for (size_t succ: blocks_[b].succs)
+      blocks_[succ].preds.push_back(b);
+  }
+  return true;
+}
+
+bool IRFunction::buildArgs() {
+  for (size_t b: rpo_) {
+    Block &block = blocks_[b];
+    std::vector<size_t> stack;
+    for (size_t i = 0; i < block.insts.size(); ++i) {
+      Inst &inst = block.insts[i];
+      unsigned inputs = 0, outputs = 0;
+      if (!stackShape(inst, inputs, outputs) || stack.size() < inputs)
+        return false;
+      inst.args.assign(stack.end() - inputs, stack.end());
+      stack.resize(stack.size() - inputs);
+      stack.insert(stack.end(), outputs, i);
+    }
+    if (!stack.empty())
+      return false;
+  }
+  return true;
+}
+
+void IRFunction::buildDominators() {
+  //Cooper、Harvey、Kennedy的迭代算法，按逆后序处理
+  size_t entry = rpo_[0];
+  blocks_[entry].idom = entry;
+  auto intersect = [this](size_t a, size_t b) {
+    while (a != b) {
+      while (rpoIndex_[a] > rpoIndex_[b])
+        a = blocks_[a].idom;
+      while (rpoIndex_[b] > rpoIndex_[a])
+        b = blocks_[b].idom;
+    }
+    return a;
+  };
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t i = 1; i < rpo_.size(); ++i) {
+      Block &block = blocks_[rpo_[i]];
+      size_t idom = kNone;
+      for (size_t pred: block.preds) {
+        if (blocks_[pred].idom == kNone)
+          continue;
+        idom = idom == kNone ? pred : intersect(pred, idom);
+      }
+      if (idom != block.idom) {
+        block.idom = idom;
+        changed = true;
+      }
+    }
+  }
+}
+
+void IRFunction::buildSSA(const std::vector<bool> &tracked) {
+  std::vector<std::vector<unsigned>> exitDefs(blocks_.size());
+  std::vector<unsigned> phis;
+
+  //逆后序中只有一个前驱的基本块，前驱总是先被处理（由回边到达的基本块有两个以上的
+  //前驱，或者是入口）。汇合处先为每个变量放置PHI，之后再化简
+  for (size_t b: rpo_) {
+    Block &block = blocks_[b];
+    block.entryDefs.assign(localSize_, kNone);
+    bool isEntry = b == rpo_[0];
+    for (unsigned slot = 0; slot < localSize_; ++slot) {
+      if (!tracked[slot])
+        continue;
+      if (isEntry && block.preds.empty()) {
+        block.entryDefs[slot] = entryDef(slot);
+      }
+      else if (block.preds.size() >= 2 || isEntry) {
+        block.entryDefs[slot] = newDef(Def::Kind::PHI, slot, b, kNone);
+        phis.push_back(block.entryDefs[slot]);
+      }
+      else {
+        block.entryDefs[slot] = exitDefs[block.preds[0]][slot];
+      }
+    }
+
+    std::vector<unsigned> current = block.entryDefs;
+    for (size_t i = 0; i < block.insts.size(); ++i) {
+      Inst &inst = block.insts[i];
+      if (inst.op == LOAD && tracked[inst.operands[0]]) {
+        inst.def = current[inst.operands[0]];
+      }
+      else if (inst.op == STORE && tracked[inst.operands[0]]) {
+        inst.def = newDef(Def::Kind::STORE, inst.operands[0], b, i);
+        current[inst.operands[0]] = inst.def;
+      }
+    }
+    exitDefs[b] = std::move(current);
+  }
+
+  for (unsigned phi: phis) {
+    Def &def = defs_[phi];
+    for (size_t pred: blocks_[def.block].preds)
+      def.args.push_back(exitDefs[pred][def.slot]);
+    if (def.block == rpo_[0])
+      def.args.push_back(entryDef(def.slot));
+  }
+
+  //所有参数（除去自身）都是同一个版本的PHI被这个版本代替，反复化简直到不变
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (unsigned phi: phis) {
+      if (replaced_[phi] != phi)
+        continue;
+      unsigned same = kNone;
+      bool trivial = true;
+      for (unsigned arg: defs_[phi].args) {
+        arg = resolve(arg);
+        if (arg == phi || arg == same)
+          continue;
+        if (same != kNone) {
+          trivial = false;
+          break;
+        }
+        same = arg;
+      }
+      if (trivial && same != kNone) {
+        replaced_[phi] = same;
+        changed = true;
+      }
+    }
+  }
+
+  for (size_t b: rpo_) {
+    Block &block = blocks_[b];
+    for (unsigned &def: block.entryDefs) {
+      if (def != kNone)
+        def = resolve(def);
+    }
+    for (Inst &inst: block.insts) {
+      if (inst.def != kNone)
+        inst.def = resolve(inst.def);
+    }
+  }
+  for (unsigned phi: phis) {
+    for (unsigned &arg: defs_[phi].args)
+      arg = resolve(arg);
+  }
+}
+
+unsigned IRFunction::entryDef(unsigned slot) {
+  if (entryDefs_[slot] == kNone)
+    entryDefs_[slot] = newDef(Def::Kind::ENTRY, slot, kNone, kNone);
+  return entryDefs_[slot];
+}
+
+unsigned IRFunction::resolve(unsigned def) const {
+  while (replaced_[def] != def)
+    def = replaced_[def];
+  return def;
+}
+
+unsigned IRFunction::newDef(Def::Kind kind, unsigned slot, size_t block, size_t inst) {
+  Def def;
+  def.kind = kind;
+  def.slot = slot;
+  def.block = block;
+  def.inst = inst;
+  defs_.push_back(std::move(def));
+  replaced_.push_back(defs_.size() - 1);
+  return defs_.size() - 1;
+}
+
+/*****************************分析************************************/
+
+bool IRFunction::dominates(size_t a, size_t b) const {
+  size_t entry = rpo_[0];
+  while (b != a && b != entry)
+    b = blocks_[b].idom;
+  return b == a;
+}
+
+std::vector<std::vector<size_t>> IRFunction::domChildren() const {
+  std::vector<std::vector<size_t>> children(blocks_.size());
+  for (size_t i = 1; i < rpo_.size(); ++i)
+    children[blocks_[rpo_[i]].idom].push_back(rpo_[i]);
+  return children;
+}
+
+std::vector<IRFunction::Loop> IRFunction::loops() const {
+  std::vector<Loop> result;
+  std::vector<size_t> loopOf(blocks_.size(), kNone);
+  for (size_t b: rpo_) {
+    for (size_t header: blocks_[b].succs) {
+      if (!dominates(header, b))
+        continue;
+      if (loopOf[header] == kNone) {
+        loopOf[header] = result.size();
+        Loop loop;
+        loop.header = header;
+        loop.body.assign(blocks_.size(), false);
+        loop.body[header] = true;
+        result.push_back(std::move(loop));
+      }
+
+      //从回边的起点逆着控制流走到循环头，经过的基本块都属于循环
+      std::vector<bool> &body = result[loopOf[header]].body;
+      std::vector<size_t> worklist{b};
+      while (!worklist.empty()) {
+        size_t current = worklist.back();
+        worklist.pop_back();
+        if (body[current])
+          continue;
+        body[current] = true;
+        for (size_t pred: blocks_[current].preds)
+          worklist.push_back(pred);
+      }
+    }
+  }
+  return result;
+}
+
+bool IRFunction::pureTree(size_t block, size_t inst, size_t &start) const {
+  const std::vector<Inst> &insts = blocks_[block].insts;
+  size_t count = 0;
+  start = inst;
+  std::vector<size_t> worklist{inst};
+  while (!worklist.empty()) {
+    size_t current = worklist.back();
+    worklist.pop_back();
+    if (!isPure(insts[current]))
+      return false;
+    ++count;
+    start = std::min(start, current);
+    worklist.insert(worklist.end(), insts[current].args.begin(), insts[current].args.end());
+  }
+  //纯指令最多压入一个值，所以树中的指令互不相同，数量和区间长度相等即为连续
+  return count == inst - start + 1;
+}
+
+bool IRFunction::isPure(const Inst &inst) const {
+  switch (inst.op) {
+    case SCONST: case ICONST: case FCONST: case NCONST:
+    case ADD: case SUB: case MUL: case DIV:
+    case EQ: case LT: case BT: case LE: case BE: case NEQ:
+    case AND: case OR: case NEG:
+    case ADD_I: case SUB_I: case MUL_I: case DIV_I:
+    case EQ_I: case LT_I: case BT_I: case LE_I: case BE_I: case NEQ_I:
+      return true;
+    case LOAD:
+      return inst.def != kNone;
+    default:
+      return false;
+  }
+}
+
+bool IRFunction::canThrow(const Inst &inst) {
+  switch (inst.op) {
+    case LOAD:
+    //有类型的整数运算不检查类型，除法仍可能除以0
+    case ADD_I: case SUB_I: case MUL_I:
+    case EQ_I: case LT_I: case BT_I: case LE_I: case BE_I: case NEQ_I:
+      return false;
+    default:
+      return !isConstant(inst.op);
+  }
+}
+
+bool IRFunction::isConstant(unsigned op) {
+  return op == SCONST || op == ICONST || op == FCONST || op == NCONST;
+}
+
+bool IRFunction::stackShape(const Inst &inst, unsigned &inputs, unsigned &outputs) {
+  inputs = 0;
+  outputs = 0;
+  switch (inst.op) {
+    case ADD: case SUB: case MUL: case DIV: case MOD:
+    case EQ: case LT: case BT: case LE: case BE: case NEQ:
+    case AND: case OR: case ARRAY_ACCCESS:
+    case ADD_I: case SUB_I: case MUL_I: case DIV_I:
+    case EQ_I: case LT_I: case BT_I: case LE_I: case BE_I: case NEQ_I:
+    case ARRAY_ACCESS_I:
+      inputs = 2;
+      outputs = 1;
+      return true;
+    case NEG: case DOT_ACCESS:
+      inputs = 1;
+      outputs = 1;
+      return true;
+    case SCONST: case ICONST: case FCONST: case NCONST:
+    case LOAD: case GLOAD: case CLOAD: case LOAD_CELL: case LAMB:
+      outputs = 1;
+      return true;
+    case STORE: case GSTORE: case CSTORE: case STORE_CELL: case POP:
+    case BRT: case BRF: case RET:
+      inputs = 1;
+      return true;
+    case BR: case GUARD: case HALT:
+      return true;
+    case CALL: case TAILCALL:
+      //函数对象和实参
+      inputs = inst.operands[0] + 1;
+      outputs = 1;
+      return true;
+    case INVOKE:
+      //接收者和实参
+      inputs = inst.operands[1] + 1;
+      outputs = 1;
+      return true;
+    case ARRAY_GENERATE:
+      inputs = inst.operands[0];
+      outputs = 1;
+      return true;
+    case ARRAY_ASSIGN:
+      inputs = 3;
+      return true;
+    case DOT_ASSIGN:
+      inputs = 2;
+      return true;
+    case NEW_INSTANCE:
+      //弹出类，压入新对象和它的初始化函数
+      inputs = 1;
+      outputs = 2;
+      return true;
+    default:
+      //超级指令和特化指令在优化之后才出现
+      return false;
+  }
+}
+
+bool IRFunction::fallsThrough(unsigned op) {
+  //TAILCALL调用原生函数时会继续执行之后的RET
+  return op != BR && op != RET && op != HALT;
+}
+
+bool IRFunction::endsBlock(unsigned op) {
+  return Code::branchOperand(op) != 0 || !fallsThrough(op);
+}
+
+/*****************************修改与生成************************************/
+
+size_t IRFunction::addBlockBefore(size_t before) {
+  size_t index = blocks_.size();
+  blocks_.emplace_back();
+  blocks_.back().reachable = true;
+  layout_.insert(std::find(layout_.begin(), layout_.end(), before), index);
+  return index;
+}
+
+size_t IRFunction::layoutPrev(size_t block) const {
+  auto iter = std::find(layout_.begin(), layout_.end(), block);
+  if (iter == layout_.begin() || iter == layout_.end())
+    return kNone;
+  return *(iter - 1);
+}
+
+unsigned IRFunction::newLocal() {
+  return localSize_++;
+}
+
+void IRFunction::lower(Code &code) const {
+  std::vector<unsigned> codes;
+  std::vector<unsigned> position(blocks_.size(), 0);
+  std::vector<size_t> branches;
+  for (size_t b: layout_) {
+    if (!blocks_[b].reachable)
+      continue;
+    position[b] = codes.size();
+    for (const Inst &inst: blocks_[b].insts) {
+      size_t start = codes.size();
+      codes.push_back(inst.op);
+      codes.insert(codes.end(), inst.operands.begin(), inst.operands.end());
+      unsigned offset = Code::branchOperand(inst.op);
+      if (offset != 0)
+        branches.push_back(start + offset);
+    }
+  }
+  for (size_t branch: branches)
+    codes[branch] = position[codes[branch]];
+  code.getCodes().swap(codes);
+}
@@ -0,0 +1,195 @@
+#ifndef SPARROW_IR_H_
+#define SPARROW_IR_H_
+
+#include <vector>
+#include "code.h"
+
+/**函数级的SSA中间表示
+ *  AST生成的栈式字节码按跳转划分成基本块，基本块中仍是一串栈式指令，但每条指令
+ *记录了它弹出的操作数由块内哪条指令压入，块内的表达式因此构成一棵棵指令树。
+ *没有被lamb引用的局部变量槽位转换成SSA形式：每条STORE定义该变量的一个新版本，
+ *基本块的汇合处插入PHI，每条LOAD记录它读取的版本。版本之间的关系和支配树、循环
+ *一起供优化遍（见ir_pass.h）分析
+ *
+ *  AST生成的字节码在基本块的边界上操作数栈总是空的（内联展开时调用处下方的操作数
+ *也先存入局部变量，见inliner.h），中间表示依赖这一点，不满足时不进行构造。优化遍直接修改基本块中的指令，修改之后指令的操作数来源和局部变量
+ *版本不再保证正确，只能用lower重新生成字节码；下一个优化遍之前重新构造中间表示。
+ *生成字节码时基本块按原来的顺序排列，跳转地址按基本块重新计算
+ */
+class IRFunction {
+public:
+  //没有操作数来源、局部变量版本、基本块时的取值
+  static const unsigned kNone = ~0u;
+
+  struct Inst {
+    unsigned op;
+
+    //字节码中的操作数，跳转指令的跳转地址改为目标基本块的下标
+    std::vector<unsigned> operands;
+
+    //弹出的操作数由块内哪条指令压入，按压栈的顺序排列
+    std::vector<size_t> args;
+
+    //LOAD读取、STORE定义的局部变量版本，不做SSA转换的变量为kNone
+    unsigned def = kNone;
+  };
+
+  struct Block {
+    std::vector<Inst> insts;
+    std::vector<size_t> preds;
+    std::vector<size_t> succs;
+
+    //进入基本块时各局部变量的版本
+    std::vector<unsigned> entryDefs;
+
+    //支配树中的直接支配者，入口块是它自己
+    size_t idom = kNone;
+
+    bool reachable = false;
+  };
+
+  //局部变量的一个版本
+  struct Def {
+    enum class Kind { ENTRY, STORE, PHI };
+
+    Kind kind;
+    unsigned slot;
+
+    //定义所在的基本块和STORE指令，函数入口的版本不属于任何基本块
+    size_t block;
+    size_t inst;
+
+    //PHI：由各个前驱流入的版本
+    std::vector<unsigned> args;
+  };
+
+  //自然循环
+  struct Loop {
+    size_t header;
+
+    //每个基本块是否属于该循环
+    std::vector<bool> body;
+  };
+
+  /**由字节码构造中间表示
+   *  localSize是局部变量的个数，cellLocals中的局部变量被lamb引用，存放的是单元，
+   *不做SSA转换。有不认识的指令或基本块边界上操作数栈不空时返回false
+   */
+  bool build(Code &code, size_t localSize, const std::vector<size_t> &cellLocals);
+
+  //按基本块的顺序重新生成字节码，不可达的基本块被丢弃
+  void lower(Code &code) const;
+
+  size_t blockNum() const {
+    return blocks_.size();
+  }
+
+  Block &block(size_t index) {
+    return blocks_[index];
+  }
+
+  const Block &block(size_t index) const {
+    return blocks_[index];
+  }
+
+  const Def &def(unsigned id) const {
+    return defs_[id];
+  }
+
+  //局部变量版本的个数，包括被化简掉的PHI
+  size_t defNum() const {
+    return defs_.size();
+  }
+
+  //b是否被a支配，两者都必须可达
+  bool dominates(size_t a, size_t b) const;
+
+  //支配树中每个基本块直接支配的基本块
+  std::vector<std::vector<size_t>> domChildren() const;
+
+  //由回边找到的自然循环，同一循环头的回边合并为一个循环
+  std::vector<Loop> loops() const;
+
+  //逆后序排列的可达基本块
+  const std::vector<size_t> &reversePostOrder() const {
+    return rpo_;
+  }
+
+  //在layout顺序中before之前插入一个空的可达基本块，顺序执行到before的前驱改为进入它
+  size_t addBlockBefore(size_t before);
+
+  //基本块在生成字节码时的前一个基本块，没有则返回kNone
+  size_t layoutPrev(size_t block) const;
+
+  //分配一个新的局部变量，返回它的下标
+  unsigned newLocal();
+
+  size_t localSize() const {
+    return localSize_;
+  }
+
+  /**以块内第inst条指令为根的指令树
+   *  树中的指令都没有副作用、结果只取决于操作数，并且在块中占据连续的一段时返回
+   *true，start为这一段的起始下标
+   */
+  bool pureTree(size_t block, size_t inst, size_t &start) const;
+
+  //指令没有副作用，结果只取决于操作数和读取的局部变量版本
+  bool isPure(const Inst &inst) const;
+
+  //指令执行时是否可能抛出异常
+  static bool canThrow(const Inst &inst);
+
+  //压入常量的指令
+  static bool isConstant(unsigned op);
+
+  //指令弹出和压入的值的个数，不认识的指令返回false
+  static bool stackShape(const Inst &inst, unsigned &inputs, unsigned &outputs);
+
+  //执行完指令后是否会顺序执行下一条指令
+  static bool fallsThrough(unsigned op);
+
+  //指令之后是否开始新的基本块
+  static bool endsBlock(unsigned op);
+
+private:
+  //划分基本块，计算前驱后继和可达性
+  bool buildBlocks(Code &code);
+
+  //模拟操作数栈，记录每条指令的操作数来源
+  bool buildArgs();
+
+  void buildSSA(const std::vector<bool> &tracked);
+
+  void buildDominators();
+
+  //slot在函数入口的版本
+  unsigned entryDef(unsigned slot);
+
+  //PHI被化简后代替它的版本
+  unsigned resolve(unsigned def) const;
+
+  unsigned newDef(Def::Kind kind, unsigned slot, size_t block, size_t inst);
+
+private:
+  std::vector<Block> blocks_;
+
+  //生成字节码时基本块的顺序
+  std::vector<size_t> layout_;
+
+  std::vector<size_t> rpo_;
+
+  //每个基本块在逆后序中的序号
+  std::vector<size_t> rpoIndex_;
+
+  std::vector<Def> defs_;
+
+  //化简掉的PHI由哪个版本代替，没有化简的为自身
+  std::vector<unsigned> replaced_;
+
+  std::vector<unsigned> entryDefs_;
+
+  size_t localSize_ = 0;
+};
+
+#endif
@@ -0,0 +1,534 @@
+#include "ir_pass.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <utility>
+
+using Inst = IRFunction::Inst;
+using Block = IRFunction::Block;
+using Def = IRFunction::Def;
+
+namespace {
+
+const unsigned kNone = IRFunction::kNone;
+
+Inst makeInst(unsigned op, std::vector<unsigned> operands) {
+  Inst inst;
+  inst.op = op;
+  inst.operands = std::move(operands);
+  return inst;
+}
+
+//对一个基本块的修改，下标都是修改前的指令下标
+struct BlockEdits {
+  //起始下标 -> 结束下标（含）和替换成的指令
+  std::map<size_t, std::pair<size_t, std::vector<Inst>>> replaced;
+
+  //在某条指令之后插入的指令
+  std::map<size_t, std::vector<Inst>> inserted;
+};
+
+void applyEdits(Block &block, const BlockEdits &edits) {
+  std::vector<Inst> insts;
+  for (size_t i = 0; i < block.insts.size(); ++i) {
+    auto replace = edits.replaced.find(i);
+    if (replace != edits.replaced.end()) {
+      insts.insert(insts.end(), replace->second.second.begin(), replace->second.second.end());
+      i = replace->second.first;
+    }
+    else {
+      insts.push_back(block.insts[i]);
+    }
+    auto insert = edits.inserted.find(i);
+    if (insert != edits.inserted.end())
+      insts.insert(insts.end(), insert->second.begin(), insert->second.end());
+  }
+  block.insts.swap(insts);
+}
+
+}
+
+/*****************************复制传播************************************/
+
+unsigned CopyPropagation::run(IRFunction &ir) {
+  unsigned changes = 0;
+  for (size_t b: ir.reversePostOrder()) {
+    Block &block = ir.block(b);
+    std::vector<unsigned> current = block.entryDefs;
+    for (Inst &inst: block.insts) {
+      if (inst.op == STORE && inst.def != kNone) {
+        current[inst.operands[0]] = inst.def;
+        continue;
+      }
+      if (inst.op != LOAD || inst.def == kNone)
+        continue;
+
+      //沿着赋值链向前查找，取最早的仍然有效的来源
+      const Inst *source = nullptr;
+      unsigned def = inst.def;
+      while (ir.def(def).kind == Def::Kind::STORE) {
+        const Block &defBlock = ir.block(ir.def(def).block);
+        const Inst &producer = defBlock.insts[defBlock.insts[ir.def(def).inst].args[0]];
+        if (IRFunction::isConstant(producer.op)) {
+          source = &producer;
+          break;
+        }
+        if (producer.op != LOAD || producer.def == kNone)
+          break;
+        if (current[producer.operands[0]] == producer.def)
+          source = &producer;
+        def = producer.def;
+      }
+      if (source == nullptr || (source->op == LOAD && source->operands[0] == inst.operands[0]))
+        continue;
+
+      inst.op = source->op;
+      inst.operands = source->operands;
+      inst.def = source->def;
+      ++changes;
+    }
+  }
+  return changes;
+}
+
+/*****************************公共子表达式删除************************************/
+
+unsigned CommonSubexpressionElimination::run(IRFunction &ir) {
+  //值编号，相同编号的指令压入相同的值
+  std::map<std::vector<unsigned>, unsigned> numbers;
+  unsigned numberSize = 0;
+  std::vector<std::vector<unsigned>> valueNumbers(ir.blockNum());
+  for (size_t b: ir.reversePostOrder()) {
+    const Block &block = ir.block(b);
+    std::vector<unsigned> &vn = valueNumbers[b];
+    vn.resize(block.insts.size());
+    for (size_t i = 0; i < block.insts.size(); ++i) {
+      const Inst &inst = block.insts[i];
+      std::vector<unsigned> key{inst.op};
+      if (IRFunction::isConstant(inst.op)) {
+        key.insert(key.end(), inst.operands.begin(), inst.operands.end());
+      }
+      else if (inst.op == LOAD && inst.def != kNone) {
+        key.push_back(inst.def);
+      }
+      else if (ir.isPure(inst)) {
+        for (size_t arg: inst.args)
+          key.push_back(vn[arg]);
+      }
+      else {
+        vn[i] = numberSize++;
+        continue;
+      }
+      auto result = numbers.insert({key, numberSize});
+      if (result.second)
+        ++numberSize;
+      vn[i] = result.first->second;
+    }
+  }
+
+  //后出现的表达式树[start, end]和支配它的first处的表达式相同
+  struct Match {
+    size_t block;
+    size_t start;
+    size_t end;
+    std::pair<size_t, size_t> first;
+    bool cancelled;
+  };
+  std::vector<Match> matches;
+
+  //沿支配树遍历时可用的表达式，离开基本块时按记录撤销
+  const std::pair<size_t, size_t> none(kNone, kNone);
+  std::vector<std::pair<size_t, size_t>> available(numberSize, none);
+  std::vector<std::pair<unsigned, std::pair<size_t, size_t>>> undo;
+  auto setAvailable = [&](unsigned number, std::pair<size_t, size_t> location) {
+    undo.push_back({number, available[number]});
+    available[number] = location;
+  };
+
+  auto visit = [&](size_t b) {
+    const Block &block = ir.block(b);
+    const std::vector<unsigned> &vn = valueNumbers[b];
+    for (size_t i = 0; i < block.insts.size(); ++i) {
+      const Inst &inst = block.insts[i];
+      size_t start = 0;
+      if (IRFunction::isConstant(inst.op) || inst.op == LOAD || !ir.isPure(inst) ||
+          !ir.pureTree(b, i, start) || i - start + 1 < 3)
+        continue;
+      if (available[vn[i]] == none) {
+        setAvailable(vn[i], {b, i});
+        continue;
+      }
+
+      //整棵树被替换，树中的子表达式不再作为公共子表达式的来源或替换对象
+      for (Match &match: matches) {
+        if (match.block == b && match.end >= start && match.end < i)
+          match.cancelled = true;
+      }
+      for (size_t k = start; k < i; ++k) {
+        if (available[vn[k]] == std::make_pair(b, k))
+          setAvailable(vn[k], none);
+      }
+      matches.push_back({b, start, i, available[vn[i]], false});
+    }
+  };
+
+  std::vector<std::vector<size_t>> children = ir.domChildren();
+  //基本块、下一个要访问的子节点、进入时的撤销记录长度
+  struct Frame {
+    size_t block;
+    size_t next;
+    size_t undoSize;
+  };
+  std::vector<Frame> stack;
+  size_t entry = ir.reversePostOrder()[0];
+  stack.push_back({entry, 0, undo.size()});
+  visit(entry);
+  while (!stack.empty()) {
+    Frame &frame = stack.back();
+    if (frame.next < children[frame.block].size()) {
+      size_t child = children[frame.block][frame.next++];
+      stack.push_back({child, 0, undo.size()});
+      visit(child);
+      continue;
+    }
+    while (undo.size() > frame.undoSize) {
+      available[undo.back().first] = undo.back().second;
+      undo.pop_back();
+    }
+    stack.pop_back();
+  }
+
+  std::map<size_t, BlockEdits> edits;
+  std::map<std::pair<size_t, size_t>, unsigned> temps;
+  unsigned changes = 0;
+  for (const Match &match: matches) {
+    if (match.cancelled)
+      continue;
+    auto temp = temps.find(match.first);
+    if (temp == temps.end()) {
+      temp = temps.insert({match.first, ir.newLocal()}).first;
+      edits[match.first.first].inserted[match.first.second] = {
+        makeInst(STORE, {temp->second}), makeInst(LOAD, {temp->second})};
+    }
+    edits[match.block].replaced[match.start] = {match.end, {makeInst(LOAD, {temp->second})}};
+    ++changes;
+  }
+  for (auto &edit: edits)
+    applyEdits(ir.block(edit.first), edit.second);
+  return changes;
+}
+
+/*****************************循环不变量外提************************************/
+
+unsigned LoopInvariantCodeMotion::run(IRFunction &ir) {
+  unsigned changes = 0;
+  size_t entry = ir.reversePostOrder()[0];
+  for (const IRFunction::Loop &loop: ir.loops()) {
+    size_t header = loop.header;
+    if (header == entry)
+      continue;
+
+    //前置块放在循环头之前，循环中顺序执行到循环头的基本块会改为进入前置块
+    size_t prev = ir.layoutPrev(header);
+    if (prev != kNone && prev < loop.body.size() && loop.body[prev] &&
+        IRFunction::fallsThrough(ir.block(prev).insts.back().op))
+      continue;
+
+    const Block &block = ir.block(header);
+    std::vector<bool> invariant(block.insts.size(), false);
+    std::vector<size_t> user(block.insts.size(), kNone);
+    for (size_t i = 0; i < block.insts.size(); ++i) {
+      const Inst &inst = block.insts[i];
+      for (size_t arg: inst.args)
+        user[arg] = i;
+
+      bool isInvariant = false;
+      if (IRFunction::isConstant(inst.op)) {
+        isInvariant = true;
+      }
+      else if (inst.op == LOAD) {
+        isInvariant = inst.def != kNone && (ir.def(inst.def).kind == Def::Kind::ENTRY ||
+            !loop.body[ir.def(inst.def).block]);
+      }
+      else if (ir.isPure(inst)) {
+        isInvariant = true;
+        for (size_t arg: inst.args)
+          isInvariant = isInvariant && invariant[arg];
+      }
+      if (!isInvariant && IRFunction::canThrow(inst))
+        break;
+      invariant[i] = isInvariant;
+    }
+
+    //外提的是以不变运算为根的最大的表达式树
+    std::vector<std::pair<size_t, size_t>> trees;
+    for (size_t i = 0; i < block.insts.size(); ++i) {
+      size_t start = 0;
+      if (invariant[i] && !block.insts[i].args.empty() &&
+          (user[i] == kNone || !invariant[user[i]]) && ir.pureTree(header, i, start))
+        trees.push_back({start, i});
+    }
+    if (trees.empty())
+      continue;
+
+    std::vector<size_t> preds = block.preds;
+    size_t preheader = ir.addBlockBefore(header);
+    BlockEdits edits;
+    for (const std::pair<size_t, size_t> &tree: trees) {
+      unsigned temp = ir.newLocal();
+      std::vector<Inst> &hoisted = ir.block(preheader).insts;
+      const std::vector<Inst> &insts = ir.block(header).insts;
+      hoisted.insert(hoisted.end(), insts.begin() + tree.first, insts.begin() + tree.second + 1);
+      hoisted.push_back(makeInst(STORE, {temp}));
+      edits.replaced[tree.first] = {tree.second, {makeInst(LOAD, {temp})}};
+      ++changes;
+    }
+    applyEdits(ir.block(header), edits);
+
+    //从循环外跳到循环头的跳转改为跳到前置块
+    for (size_t pred: preds) {
+      if (loop.body[pred])
+        continue;
+      Inst &last = ir.block(pred).insts.back();
+      unsigned offset = Code::branchOperand(last.op);
+      if (offset != 0 && last.operands[offset - 1] == header)
+        last.operands[offset - 1] = preheader;
+    }
+  }
+  return changes;
+}
+
+/*****************************死代码删除************************************/
+
+unsigned DeadCodeElimination::run(IRFunction &ir) {
+  std::vector<bool> live(ir.defNum(), false);
+  std::vector<unsigned> worklist;
+  for (size_t b: ir.reversePostOrder()) {
+    for (const Inst &inst: ir.block(b).insts) {
+      if (inst.op == LOAD && inst.def != kNone)
+        worklist.push_back(inst.def);
+    }
+  }
+  while (!worklist.empty()) {
+    unsigned def = worklist.back();
+    worklist.pop_back();
+    if (live[def])
+      continue;
+    live[def] = true;
+    if (ir.def(def).kind == Def::Kind::PHI)
+      worklist.insert(worklist.end(), ir.def(def).args.begin(), ir.def(def).args.end());
+  }
+
+  unsigned changes = 0;
+  for (size_t b: ir.reversePostOrder()) {
+    Block &block = ir.block(b);
+    for (Inst &inst: block.insts) {
+      if (inst.op == STORE && inst.def != kNone && !live[inst.def]) {
+        inst.op = POP;
+        inst.operands.clear();
+        inst.def = kNone;
+        ++changes;
+      }
+    }
+
+    std::vector<bool> removed(block.insts.size(), false);
+    bool changed = false;
+    for (size_t i = 0; i < block.insts.size(); ++i) {
+      if (block.insts[i].op != POP)
+        continue;
+      size_t value = block.insts[i].args[0];
+      size_t start = 0;
+      if (value + 1 != i || !ir.pureTree(b, value, start))
+        continue;
+      bool canThrow = false;
+      for (size_t k = start; k <= value; ++k)
+        canThrow = canThrow || IRFunction::canThrow(block.insts[k]);
+      if (canThrow)
+        continue;
+      for (size_t k = start; k <= i; ++k)
+        removed[k] = true;
+      changed = true;
+      ++changes;
+    }
+    if (!changed)
+      continue;
+    std::vector<Inst> insts;
+    for (size_t i = 0; i < block.insts.size(); ++i) {
+      if (!removed[i])
+        insts.push_back(std::move(block.insts[i]));
+    }
+    block.insts.swap(insts);
+  }
+  return changes;
+}
+
+/*****************************类型推导************************************/
+
+namespace {
+
+//值的类型，NONE表示还没有推导出来，ANY表示可能是任何类型
+enum class Type { NONE, INT, FLOAT, BOOL, STR, ANY };
+
+Type join(Type a, Type b) {
+  if (a == Type::NONE || a == b)
+    return b;
+  if (b == Type::NONE)
+    return a;
+  return Type::ANY;
+}
+
+Type resultType(const Inst &inst, const std::vector<Type> &types) {
+  switch (inst.op) {
+    case ICONST:
+      return Type::INT;
+    case FCONST:
+      return Type::FLOAT;
+    case SCONST:
+      return Type::STR;
+    case ADD: case SUB: case MUL: case DIV:
+    case EQ: case LT: case BT: case LE: case BE: case NEQ: {
+      Type a = types[inst.args[0]];
+      Type b = types[inst.args[1]];
+      bool isCompare = inst.op != ADD && inst.op != SUB && inst.op != MUL && inst.op != DIV;
+      if (a == Type::NONE || b == Type::NONE)
+        return Type::NONE;
+      if ((a == Type::INT || a == Type::FLOAT) && (b == Type::INT || b == Type::FLOAT)) {
+        if (isCompare)
+          return Type::BOOL;
+        return a == Type::INT && b == Type::INT ? Type::INT : Type::FLOAT;
+      }
+      if (inst.op == ADD && a == Type::STR && b == Type::STR)
+        return Type::STR;
+      return Type::ANY;
+    }
+    case ADD_I: case SUB_I: case MUL_I: case DIV_I:
+      return Type::INT;
+    case EQ_I: case LT_I: case BT_I: case LE_I: case BE_I: case NEQ_I:
+      return Type::BOOL;
+    case NEG: {
+      Type a = types[inst.args[0]];
+      return a == Type::INT || a == Type::FLOAT || a == Type::NONE ? a : Type::ANY;
+    }
+    default:
+      return Type::ANY;
+  }
+}
+
+}
+
+unsigned TypeInference::run(IRFunction &ir) {
+  //局部变量各个版本的类型，由STORE和PHI逐步合并，直到不再变化
+  std::vector<Type> defTypes(ir.defNum(), Type::NONE);
+  for (size_t id = 0; id < ir.defNum(); ++id) {
+    if (ir.def(id).kind == Def::Kind::ENTRY)
+      defTypes[id] = Type::ANY;
+  }
+
+  std::vector<std::vector<Type>> types(ir.blockNum());
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    auto update = [&](unsigned def, Type type) {
+      Type joined = join(defTypes[def], type);
+      if (joined != defTypes[def]) {
+        defTypes[def] = joined;
+        changed = true;
+      }
+    };
+    for (size_t b: ir.reversePostOrder()) {
+      const Block &block = ir.block(b);
+      types[b].assign(block.insts.size(), Type::ANY);
+      for (size_t i = 0; i < block.insts.size(); ++i) {
+        const Inst &inst = block.insts[i];
+        if (inst.op == LOAD) {
+          types[b][i] = inst.def == kNone ? Type::ANY : defTypes[inst.def];
+        }
+        else if (inst.op == STORE) {
+          if (inst.def != kNone)
+            update(inst.def, types[b][inst.args[0]]);
+        }
+        else {
+          types[b][i] = resultType(inst, types[b]);
+        }
+      }
+    }
+    for (size_t id = 0; id < ir.defNum(); ++id) {
+      if (ir.def(id).kind != Def::Kind::PHI)
+        continue;
+      for (unsigned arg: ir.def(id).args)
+        update(id, defTypes[arg]);
+    }
+  }
+
+  unsigned changes = 0;
+  for (size_t b: ir.reversePostOrder()) {
+    Block &block = ir.block(b);
+    for (Inst &inst: block.insts) {
+      unsigned typed = Code::intTyped(inst.op);
+      if (typed == inst.op)
+        continue;
+      //数组访问只要求下标是整数
+      bool proven = types[b][inst.args[1]] == Type::INT &&
+        (inst.op == ARRAY_ACCCESS || types[b][inst.args[0]] == Type::INT);
+      if (!proven)
+        continue;
+      inst.op = typed;
+      ++changes;
+    }
+  }
+  return changes;
+}
+
+/*****************************优化遍管理************************************/
+
+void PassManager::add(IRPassPtr pass) {
+  passes_.push_back(pass);
+  changes_.push_back(0);
+}
+
+void PassManager::run(Code &code, size_t &localSize, const std::vector<size_t> &cellLocals) {
+  for (unsigned round = 0; round < maxRounds; ++round) {
+    bool changed = false;
+    for (size_t i = 0; i < passes_.size(); ++i) {
+      IRFunction ir;
+      if (!ir.build(code, localSize, cellLocals)) {
+        built_ = false;
+        return;
+      }
+      unsigned changes = passes_[i]->run(ir);
+      if (changes == 0)
+        continue;
+      ir.lower(code);
+      localSize = ir.localSize();
+      changes_[i] += changes;
+      changed = true;
+    }
+    if (!changed)
+      break;
+  }
+}
+
+void PassManager::report(const std::string &name) const {
+  const char *enabled = std::getenv("SPARROW_IR_STATS");
+  if (enabled == nullptr || *enabled == '\0')
+    return;
+  std::cerr << "ir " << name << ":";
+  if (!built_) {
+    std::cerr << " not optimized" << std::endl;
+    return;
+  }
+  for (size_t i = 0; i < passes_.size(); ++i)
+    std::cerr << " " << passes_[i]->name() << " " << changes_[i];
+  std::cerr << std::endl;
+}
+
+PassManager PassManager::standard() {
+  PassManager manager;
+  manager.add(std::make_shared<CopyPropagation>());
+  manager.add(std::make_shared<CommonSubexpressionElimination>());
+  manager.add(std::make_shared<LoopInvariantCodeMotion>());
+  manager.add(std::make_shared<DeadCodeElimination>());
+  manager.add(std::make_shared<TypeInference>());
+  return manager;
+}
@@ -0,0 +1,129 @@
+#ifndef SPARROW_IR_PASS_H_
+#define SPARROW_IR_PASS_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "ir.h"
+
+/**中间表示上的优化遍
+ *  每个优化遍分析一份刚构造的中间表示并直接修改其中的指令，返回修改的次数。修改
+ *之后中间表示只能用来生成字节码，由PassManager重新构造后交给下一个优化遍
+ */
+class IRPass {
+public:
+  virtual ~IRPass() {}
+
+  virtual const char *name() const = 0;
+
+  virtual unsigned run(IRFunction &ir) = 0;
+};
+
+using IRPassPtr = std::shared_ptr<IRPass>;
+
+/**复制传播
+ *  y = x之后读取y改为读取x（x在读取处仍是赋给y时的版本），y = 常量之后读取y
+ *改为压入常量，沿着连续的复制找到最早的来源。被复制的变量因此不再被读取，
+ *赋值由死代码删除去掉
+ */
+class CopyPropagation: public IRPass {
+public:
+  const char *name() const override {
+    return "copy";
+  }
+
+  unsigned run(IRFunction &ir) override;
+};
+
+/**公共子表达式删除
+ *  对指令进行值编号：常量按值，LOAD按读取的局部变量版本，纯运算按运算和操作数的
+ *编号。沿支配树遍历，表达式树和支配它的一处相同时，先出现的一处把结果另存一份
+ *到新的局部变量中，后出现的一处改为读取这个局部变量
+ */
+class CommonSubexpressionElimination: public IRPass {
+public:
+  const char *name() const override {
+    return "cse";
+  }
+
+  unsigned run(IRFunction &ir) override;
+};
+
+/**循环不变量外提
+ *  循环头中只依赖循环外定义的局部变量和常量的纯运算（如while i < n * 2中的n * 2）
+ *移到循环前新增的前置块中计算一次，存入新的局部变量，循环头改为读取它。循环头在
+ *每次进入循环时都会执行，外提不会计算原本不会计算的表达式；循环体中的不变量可能
+ *一次都不执行，不进行外提。遇到第一条可能抛出异常的非不变指令后停止，保证异常的
+ *先后顺序不变
+ */
+class LoopInvariantCodeMotion: public IRPass {
+public:
+  const char *name() const override {
+    return "licm";
+  }
+
+  unsigned run(IRFunction &ir) override;
+};
+
+/**死代码删除
+ *  没有被任何LOAD读取（包括经过PHI）的局部变量版本，它的STORE改为POP；
+ *POP弹出的值由不会抛出异常的纯运算得到时，连同这些运算一起删除
+ */
+class DeadCodeElimination: public IRPass {
+public:
+  const char *name() const override {
+    return "dce";
+  }
+
+  unsigned run(IRFunction &ir) override;
+};
+
+/**类型推导
+ *  在SSA形式上推导每个值的类型：常量的类型已知，局部变量的版本取赋给它的值的
+ *类型，PHI取各个来源的合并，函数入口的版本（形参以及初值为空的局部变量）类型未知；
+ *整数之间的四则运算仍是整数。两个操作数都被证明是整数的运算和比较改写成不检查类型
+ *的有类型指令（ADD_I、LT_I等），下标被证明是整数的数组访问改写成ARRAY_ACCESS_I，
+ *其余保持通用指令
+ */
+class TypeInference: public IRPass {
+public:
+  const char *name() const override {
+    return "types";
+  }
+
+  unsigned run(IRFunction &ir) override;
+};
+
+/**优化遍管理
+ *  按顺序执行各个优化遍，每个优化遍之前由字节码重新构造中间表示，有修改时生成
+ *新的字节码。所有优化遍都没有修改或者达到轮数上限时停止。字节码不满足构造条件时
+ *保持原样
+ */
+class PassManager {
+public:
+  void add(IRPassPtr pass);
+
+  /**优化一个函数的字节码
+   *  localSize是局部变量的个数，优化遍新增的局部变量会加到其中
+   */
+  void run(Code &code, size_t &localSize, const std::vector<size_t> &cellLocals);
+
+  //环境变量SPARROW_IR_STATS非空时，把函数name上各优化遍的修改次数输出到标准错误
+  void report(const std::string &name) const;
+
+  //复制传播、公共子表达式删除、循环不变量外提、死代码删除、类型推导
+  static PassManager standard();
+
+private:
+  static const unsigned maxRounds = 4;
+
+  std::vector<IRPassPtr> passes_;
+
+  //每个优化遍的修改次数
+  std::vector<unsigned> changes_;
+
+  //中间表示是否构造成功
+  bool built_ = true;
+};
+
+#endif
@@ -0,0 +1,1073 @@
+#ifdef SPARROW_JIT
+
+#include "jit.h"
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <functional>
+#include <sys/mman.h>
+#include "vm.h"
+#include "../symbols.h"
+
+bool Jit::enabled = false;
+
+/*****************************汇编器************************************/
+
+namespace {
+
+enum Reg {
+  RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+  R8 = 8, R9 = 9, R10 = 10, R11 = 11, R12 = 12, R13 = 13, R14 = 14, R15 = 15
+};
+
+//条件跳转和setcc的条件码
+enum Cond {
+  CC_E = 0x4, CC_NE = 0x5, CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF
+};
+
+//x86-64机器码的生成，只包含模板用到的指令
+//内存操作数都是[基址寄存器 + 偏移]的形式，跳转目标用标签表示，生成结束后统一回填
+class Assembler {
+public:
+  using Label = size_t;
+
+  Label newLabel() {
+    labels_.push_back(kUnbound);
+    return labels_.size() - 1;
+  }
+
+  void bind(Label label) {
+    labels_[label] = code_.size();
+  }
+
+  size_t offset() const {
+    return code_.size();
+  }
+
+  //回填所有跳转的相对地址
+  const std::vector<unsigned char> &finish() {
+    for (auto &fixup: fixups_) {
+      int32_t rel = static_cast<int32_t>(labels_[fixup.second] - (fixup.first + 4));
+      std::memcpy(&code_[fixup.first], &rel, 4);
+    }
+    fixups_.clear();
+    return code_;
+  }
+
+  void push(Reg r) {
+    rex(false, 0, r);
+    emit(0x50 + (r & 7));
+  }
+
+  void pop(Reg r) {
+    rex(false, 0, r);
+    emit(0x58 + (r & 7));
+  }
+
+  void ret() {
+    emit(0xC3);
+  }
+
+  //mov dst, src（64位）
+  void movRR(Reg dst, Reg src) {
+    rex(true, src, dst);
+    emit(0x89);
+    modrmReg(src, dst);
+  }
+
+  //mov dst, imm64
+  void movRI64(Reg dst, uint64_t imm) {
+    rex(true, 0, dst);
+    emit(0xB8 + (dst & 7));
+    emitBytes(&imm, 8);
+  }
+
+  //mov dst32, imm32
+  void movRI32(Reg dst, uint32_t imm) {
+    rex(false, 0, dst);
+    emit(0xB8 + (dst & 7));
+    emitBytes(&imm, 4);
+  }
+
+  //mov dst, [base + disp]（64位）
+  void movRM64(Reg dst, Reg base, int disp) {
+    rex(true, dst, base);
+    emit(0x8B);
+    mem(dst, base, disp);
+  }
+
+  //mov [base + disp], src（64位）
+  void movMR64(Reg base, int disp, Reg src) {
+    rex(true, src, base);
+    emit(0x89);
+    mem(src, base, disp);
+  }
+
+  //mov dst32, [base + disp]
+  void movRM32(Reg dst, Reg base, int disp) {
+    rex(false, dst, base);
+    emit(0x8B);
+    mem(dst, base, disp);
+  }
+
+  //mov [base + disp], src32
+  void movMR32(Reg base, int disp, Reg src) {
+    rex(false, src, base);
+    emit(0x89);
+    mem(src, base, disp);
+  }
+
+  //mov byte [base + disp], src8，src只能是al、cl、dl、bl
+  void movMR8(Reg base, int disp, Reg src) {
+    rex(false, src, base);
+    emit(0x88);
+    mem(src, base, disp);
+  }
+
+  //movzx dst32, byte [base + disp]
+  void movzxRM8(Reg dst, Reg base, int disp) {
+    rex(false, dst, base);
+    emit(0x0F);
+    emit(0xB6);
+    mem(dst, base, disp);
+  }
+
+  //mov byte [base + disp], imm8
+  void movMI8(Reg base, int disp, uint8_t imm) {
+    rex(false, 0, base);
+    emit(0xC6);
+    mem(0, base, disp);
+    emit(imm);
+  }
+
+  //mov dword [base + disp], imm32
+  void movMI32(Reg base, int disp, uint32_t imm) {
+    rex(false, 0, base);
+    emit(0xC7);
+    mem(0, base, disp);
+    emitBytes(&imm, 4);
+  }
+
+  //cmp byte [base + disp], imm8
+  void cmpMI8(Reg base, int disp, uint8_t imm) {
+    rex(false, 0, base);
+    emit(0x80);
+    mem(7, base, disp);
+    emit(imm);
+  }
+
+  //add/sub/cmp/imul r32, [base + disp]
+  void addRM32(Reg r, Reg base, int disp) {
+    aluRM32(0x03, r, base, disp);
+  }
+
+  void subRM32(Reg r, Reg base, int disp) {
+    aluRM32(0x2B, r, base, disp);
+  }
+
+  void cmpRM32(Reg r, Reg base, int disp) {
+    aluRM32(0x3B, r, base, disp);
+  }
+
+  void imulRM32(Reg r, Reg base, int disp) {
+    rex(false, r, base);
+    emit(0x0F);
+    emit(0xAF);
+    mem(r, base, disp);
+  }
+
+  //add dword [base + disp], imm32
+  void addMI32(Reg base, int disp, int32_t imm) {
+    rex(false, 0, base);
+    emit(0x81);
+    mem(0, base, disp);
+    emitBytes(&imm, 4);
+  }
+
+  //neg dword [base + disp]
+  void negM32(Reg base, int disp) {
+    rex(false, 0, base);
+    emit(0xF7);
+    mem(3, base, disp);
+  }
+
+  //cdq; idiv dword [base + disp]
+  void cdq() {
+    emit(0x99);
+  }
+
+  void idivM32(Reg base, int disp) {
+    rex(false, 0, base);
+    emit(0xF7);
+    mem(7, base, disp);
+  }
+
+  //add/sub r64, imm32
+  void addRI64(Reg r, int32_t imm) {
+    rex(true, 0, r);
+    emit(0x81);
+    modrmReg(0, r);
+    emitBytes(&imm, 4);
+  }
+
+  void subRI64(Reg r, int32_t imm) {
+    rex(true, 0, r);
+    emit(0x81);
+    modrmReg(5, r);
+    emitBytes(&imm, 4);
+  }
+
+  //test r64, r64
+  void testRR64(Reg a, Reg b) {
+    rex(true, b, a);
+    emit(0x85);
+    modrmReg(b, a);
+  }
+
+  //test r32, r32
+  void testRR32(Reg a, Reg b) {
+    rex(false, b, a);
+    emit(0x85);
+    modrmReg(b, a);
+  }
+
+  //setcc r8，r只能是al、cl、dl、bl
+  void setcc(Cond cc, Reg r) {
+    emit(0x0F);
+    emit(0x90 | cc);
+    modrmReg(0, r);
+  }
+
+  void jmp(Label label) {
+    emit(0xE9);
+    fixup(label);
+  }
+
+  void jcc(Cond cc, Label label) {
+    emit(0x0F);
+    emit(0x80 | cc);
+    fixup(label);
+  }
+
+  //jmp r64
+  void jmpR(Reg r) {
+    rex(false, 0, r);
+    emit(0xFF);
+    modrmReg(4, r);
+  }
+
+  //call r64
+  void callR(Reg r) {
+    rex(false, 0, r);
+    emit(0xFF);
+    modrmReg(2, r);
+  }
+
+private:
+  static const size_t kUnbound = static_cast<size_t>(-1);
+
+  void emit(unsigned char byte) {
+    code_.push_back(byte);
+  }
+
+  void emitBytes(const void *bytes, size_t n) {
+    const unsigned char *p = static_cast<const unsigned char *>(bytes);
+    code_.insert(code_.end(), p, p + n);
+  }
+
+  //REX前缀，reg是ModRM.reg字段（寄存器编号或扩展操作码），rm是ModRM.rm或基址寄存器
+  void rex(bool wide, unsigned reg, unsigned rm) {
+    unsigned char byte = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+    if (byte != 0x40)
+      emit(byte);
+  }
+
+  void modrmReg(unsigned reg, unsigned rm) {
+    emit(0xC0 | ((reg & 7) << 3) | (rm & 7));
+  }
+
+  //[base + disp]形式的ModRM，rsp、r12作为基址时需要SIB，rbp、r13不能省略偏移
+  void mem(unsigned reg, Reg base, int disp) {
+    unsigned char mod;
+    if (disp == 0 && (base & 7) != RBP)
+      mod = 0x00;
+    else if (disp >= -128 && disp <= 127)
+      mod = 0x40;
+    else
+      mod = 0x80;
+    emit(mod | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP)
+      emit(0x24);
+    if (mod == 0x40)
+      emit(static_cast<unsigned char>(static_cast<int8_t>(disp)));
+    else if (mod == 0x80)
+      emitBytes(&disp, 4);
+  }
+
+  void aluRM32(unsigned char opcode, Reg r, Reg base, int disp) {
+    rex(false, r, base);
+    emit(opcode);
+    mem(r, base, disp);
+  }
+
+  void fixup(Label label) {
+    fixups_.push_back(std::make_pair(code_.size(), label));
+    code_.insert(code_.end(), 4, 0);
+  }
+
+private:
+  std::vector<unsigned char> code_;
+
+  //标签在code_中的偏移
+  std::vector<size_t> labels_;
+
+  //<需要回填的rel32的位置，目标标签>
+  std::vector<std::pair<size_t, Label>> fixups_;
+};
+
+const size_t Assembler::kUnbound;
+
+}  // namespace
+
+/*****************************运行时函数************************************/
+
+//机器码中较重的情况由这些函数完成，它们都是ByteCodeInterpreter的友元
+//函数在机器码当前的栈顶sp上操作，成功时返回新的栈顶；出错时把操作数栈恢复到
+//执行前的样子并返回空指针，机器码随即返回解释器重新执行这条指令
+class JitRuntime {
+public:
+  using Helper = Value *(*)(JitContext *context, Value *sp, unsigned a, unsigned b);
+
+  static Value *sconst(JitContext *, Value *sp, unsigned index, unsigned) {
+    sp[0] = Value(g_StrSymbols->getObject(index));
+    return sp + 1;
+  }
+
+  static Value *load(JitContext *context, Value *sp, unsigned index, unsigned) {
+    sp[0] = context->locals[index];
+    return sp + 1;
+  }
+
+  static Value *store(JitContext *context, Value *sp, unsigned index, unsigned) {
+    context->locals[index] = std::move(sp[-1]);
+    return sp - 1;
+  }
+
+  static Value *pop(JitContext *, Value *sp, unsigned, unsigned) {
+    sp[-1].reset();
+    return sp - 1;
+  }
+
+  //通用的二元运算，结果由arithmeticTypeCast压入操作数栈
+  static Value *binary(JitContext *context, Value *sp, unsigned op, unsigned) {
+    if (!arithmeticOperands(sp[-1], sp[-2]))
+      return nullptr;
+    OperandStack *stack = syncStack(context, sp - 2);
+    Value a = std::move(sp[-1]);
+    Value b = std::move(sp[-2]);
+    try {
+      context->interpreter->arithmeticTypeCast(a, b, static_cast<Instruction>(op));
+    }
+    catch (...) {
+      sp[-2] = std::move(b);
+      sp[-1] = std::move(a);
+      return nullptr;
+    }
+    return stack->base() + stack->size();
+  }
+
+  static Value *neg(JitContext *, Value *sp, unsigned, unsigned) {
+    Value &value = sp[-1];
+    if (value.isInt())
+      value = Value::makeInt(-value.asInt());
+    else if (value.isFloat())
+      value = Value::makeFloat(-value.asFloat());
+    else
+      return nullptr;
+    return sp;
+  }
+
+  static Value *logic(JitContext *, Value *sp, unsigned op, unsigned) {
+    const Value &a = sp[-1];
+    const Value &b = sp[-2];
+    if (!a.isBool() || !b.isBool())
+      return nullptr;
+    bool result = op == AND ? a.asBool() && b.asBool() : a.asBool() || b.asBool();
+    sp[-2] = Value::makeBool(result);
+    return sp - 1;
+  }
+
+  static Value *gload(JitContext *context, Value *sp, unsigned nameIndex, unsigned) {
+    try {
+      sp[0] = context->frame->getOuterObj(nameIndex);
+    }
+    catch (...) {
+      return nullptr;
+    }
+    return sp + 1;
+  }
+
+  static Value *gstore(JitContext *context, Value *sp, unsigned nameIndex, unsigned) {
+    try {
+      context->frame->setOuterObj(nameIndex, sp[-1].toObject());
+    }
+    catch (...) {
+      return nullptr;
+    }
+    sp[-1].reset();
+    return sp - 1;
+  }
+
+  static Value *cload(JitContext *context, Value *sp, unsigned index, unsigned) {
+    sp[0] = context->frame->getFunction()->upvalue(index)->value_;
+    return sp + 1;
+  }
+
+  static Value *cstore(JitContext *context, Value *sp, unsigned index, unsigned) {
+    context->frame->getFunction()->upvalue(index)->value_ = std::move(sp[-1]);
+    return sp - 1;
+  }
+
+  static Value *loadCell(JitContext *context, Value *sp, unsigned index, unsigned) {
+    sp[0] = context->locals[index].objectAs<Cell>()->value_;
+    return sp + 1;
+  }
+
+  static Value *storeCell(JitContext *context, Value *sp, unsigned index, unsigned) {
+    context->locals[index].objectAs<Cell>()->value_ = std::move(sp[-1]);
+    return sp - 1;
+  }
+
+  static Value *arrayGenerate(JitContext *, Value *sp, unsigned size, unsigned) {
+    ArrayPtr array = std::make_shared<Array>(size);
+    Value *first = sp - size;
+    for (unsigned i = 0; i < size; ++i)
+      array->set(i, std::move(first[i]));
+    first[0] = Value(array);
+    return first + 1;
+  }
+
+  static Value *arrayAccess(JitContext *, Value *sp, unsigned, unsigned) {
+    const Value &index = sp[-1];
+    Value &array = sp[-2];
+    if (!index.isInt() || !array.is(ObjKind::Array))
+      return nullptr;
+    try {
+      Value element = array.objectAs<Array>()->get(index.asInt());
+      array = std::move(element);
+    }
+    catch (...) {
+      return nullptr;
+    }
+    return sp - 1;
+  }
+
+  static Value *arrayAssign(JitContext *, Value *sp, unsigned, unsigned) {
+    const Value &index = sp[-1];
+    Value &array = sp[-2];
+    if (!index.isInt() || !array.is(ObjKind::Array))
+      return nullptr;
+    try {
+      array.objectAs<Array>()->set(index.asInt(), sp[-3]);
+    }
+    catch (...) {
+      return nullptr;
+    }
+    sp[-2].reset();
+    sp[-3].reset();
+    return sp - 3;
+  }
+
+  static Value *localArrayAccess(JitContext *context, Value *sp, unsigned arrayIndex,
+      unsigned indexIndex) {
+    const Value &array = context->locals[arrayIndex];
+    const Value &index = context->locals[indexIndex];
+    if (!index.isInt() || !array.is(ObjKind::Array))
+      return nullptr;
+    try {
+      sp[0] = array.objectAs<Array>()->get(index.asInt());
+    }
+    catch (...) {
+      return nullptr;
+    }
+    return sp + 1;
+  }
+
+  static Value *lamb(JitContext *context, Value *sp, unsigned lambSrcIndex, unsigned) {
+    try {
+      sp[0] = Value(ByteCodeInterpreter::newClosure(context->frame, context->locals,
+            lambSrcIndex));
+    }
+    catch (...) {
+      return nullptr;
+    }
+    return sp + 1;
+  }
+
+  static Value *dotAccess(JitContext *context, Value *sp, unsigned cacheIndex, unsigned) {
+    try {
+      Value member = ByteCodeInterpreter::dotAccess(context->frame, cacheIndex, sp[-1]);
+      sp[-1] = std::move(member);
+    }
+    catch (...) {
+      return nullptr;
+    }
+    return sp;
+  }
+
+  static Value *dotAssign(JitContext *context, Value *sp, unsigned cacheIndex, unsigned) {
+    try {
+      ByteCodeInterpreter::dotAssign(context->frame, cacheIndex, sp[-1], sp[-2]);
+    }
+    catch (...) {
+      return nullptr;
+    }
+    sp[-1].reset();
+    sp[-2].reset();
+    return sp - 2;
+  }
+
+  //局部变量不是整数时的INC_LOCAL
+  static Value *incLocal(JitContext *context, Value *sp, unsigned index, unsigned k) {
+    Value &local = context->locals[index];
+    if (!arithmeticOperands(local, Value::makeInt(0)))
+      return nullptr;
+    OperandStack *stack = syncStack(context, sp);
+    try {
+      context->interpreter->arithmeticTypeCast(local,
+          Value::makeInt(static_cast<int>(k)), ADD);
+    }
+    catch (...) {
+      return nullptr;
+    }
+    local = stack->getAndPop();
+    return sp;
+  }
+
+  //局部变量不是整数时的LOCAL_LT_BRF，把比较结果压入栈中，由机器码完成跳转
+  static Value *localLess(JitContext *context, Value *sp, unsigned a, unsigned b) {
+    if (!arithmeticOperands(context->locals[a], context->locals[b]))
+      return nullptr;
+    OperandStack *stack = syncStack(context, sp);
+    try {
+      context->interpreter->arithmeticTypeCast(context->locals[a], context->locals[b], LT);
+    }
+    catch (...) {
+      return nullptr;
+    }
+    if (!stack->top().isBool()) {
+      stack->pop();
+      return nullptr;
+    }
+    return sp + 1;
+  }
+
+  //GUARD的守卫是否成立，参数和其它运行时函数保持一致，不改变栈顶
+  static unsigned guard(JitContext *context, Value *, unsigned guardIndex, unsigned) {
+    return context->frame->getFunction()->inlineGuardHolds(guardIndex) ? 1 : 0;
+  }
+
+private:
+  //运行时函数借用操作数栈时，先把栈顶同步为机器码当前的栈顶
+  static OperandStack *syncStack(JitContext *context, Value *sp) {
+    OperandStack *stack = context->interpreter->operandStack_.get();
+    stack->setSize(sp - stack->base());
+    return stack;
+  }
+
+  //arithmeticTypeCast能否处理这两个操作数，不能处理时它会先打印调试信息再抛出异常，
+  //这里提前检查，交给解释器重新执行时只报告一次
+  static bool arithmeticOperands(const Value &a, const Value &b) {
+    return ((a.isInt() || a.isFloat()) && (b.isInt() || b.isFloat())) ||
+        (a.is(ObjKind::STRING) && b.is(ObjKind::STRING)) || b.isNone();
+  }
+};
+
+/*****************************模板编译************************************/
+
+namespace {
+
+//机器码中用到的Value布局
+const int kValueSize = sizeof(Value);
+const int kKind = Value::kindOffset();
+const int kPayload = Value::payloadOffset();
+
+const uint8_t kNone = static_cast<uint8_t>(ValueKind::NONE);
+const uint8_t kInt = static_cast<uint8_t>(ValueKind::INT);
+const uint8_t kFloat = static_cast<uint8_t>(ValueKind::FLOAT);
+const uint8_t kBool = static_cast<uint8_t>(ValueKind::BOOL);
+const uint8_t kObject = static_cast<uint8_t>(ValueKind::OBJECT);
+
+//机器码中固定使用的寄存器
+const Reg kSp = RBX;
+const Reg kLocals = R12;
+const Reg kContext = R13;
+
+//栈顶往下第n个值（栈顶为1）相对kSp的偏移
+int slot(int n) {
+  return -n * kValueSize;
+}
+
+//第index个局部变量相对kLocals的偏移
+int local(unsigned index) {
+  return static_cast<int>(index) * kValueSize;
+}
+
+class TemplateCompiler {
+public:
+  TemplateCompiler(const Code &code): code_(code) {}
+
+  std::shared_ptr<JitCode> compile();
+
+private:
+  using Label = Assembler::Label;
+
+  //逐条生成指令的机器码，遇到不支持的指令时返回false
+  bool emitInstruction(unsigned position);
+
+  //返回解释器，从position处的指令开始解释执行
+  void emitExit(unsigned position);
+
+  //返回解释器的桩，运行时函数出错时跳转到这里
+  Label exitStub(unsigned position);
+
+  //调用运行时函数，rdi = context，rsi = sp，edx = a，ecx = b
+  void emitCall(void *function, unsigned a, unsigned b);
+
+  //调用操作数栈上的运行时函数，失败时返回解释器重新执行position处的指令
+  void emitHelper(JitRuntime::Helper helper, unsigned position, unsigned a = 0,
+      unsigned b = 0);
+
+  //整数快速路径之外的情况放在函数体之后的慢速路径中，执行完后跳回done
+  void addSlowPath(Label slow, Label done, std::function<void()> body);
+
+  //整数二元运算和比较的模板
+  void emitIntBinary(unsigned op, unsigned position);
+
+private:
+  const Code &code_;
+  Assembler as_;
+
+  //每条指令的起始位置对应的标签
+  std::map<unsigned, Label> labels_;
+
+  //返回解释器的桩，<指令位置，标签>
+  std::map<unsigned, Label> exitStubs_;
+
+  //慢速路径，函数体生成之后再依次生成
+  std::vector<std::function<void()>> slowPaths_;
+
+  //所有出口共用的尾部：保存栈顶，恢复寄存器并返回
+  Label exit_ = 0;
+};
+
+std::shared_ptr<JitCode> TemplateCompiler::compile() {
+  size_t size = code_.getCodeSize();
+  for (size_t i = 0; i < size; i += 1 + Code::operandNum(code_.get(i)))
+    labels_[i] = as_.newLabel();
+  exit_ = as_.newLabel();
+
+  //入口：保存被调用者保存的寄存器（五个，保持栈16字节对齐），装入执行状态后
+  //跳到rsi指定的指令
+  as_.push(RBP);
+  as_.push(RBX);
+  as_.push(R12);
+  as_.push(R13);
+  as_.push(R14);
+  as_.movRR(kContext, RDI);
+  as_.movRM64(kSp, RDI, offsetof(JitContext, sp));
+  as_.movRM64(kLocals, RDI, offsetof(JitContext, locals));
+  as_.jmpR(RSI);
+
+  std::vector<unsigned> entries(size, 0);
+  for (size_t i = 0; i < size; i += 1 + Code::operandNum(code_.get(i))) {
+    as_.bind(labels_[i]);
+    entries[i] = as_.offset();
+    if (!emitInstruction(i))
+      return nullptr;
+  }
+
+  for (size_t i = 0; i < slowPaths_.size(); ++i)
+    slowPaths_[i]();
+  for (auto &stub: exitStubs_) {
+    as_.bind(stub.second);
+    as_.movRI32(RAX, stub.first);
+    as_.jmp(exit_);
+  }
+
+  as_.bind(exit_);
+  as_.movMR64(kContext, offsetof(JitContext, sp), kSp);
+  as_.pop(R14);
+  as_.pop(R13);
+  as_.pop(R12);
+  as_.pop(RBX);
+  as_.pop(RBP);
+  as_.ret();
+
+  JitCodePtr jitCode = std::make_shared<JitCode>(as_.finish(), std::move(entries));
+  if (!jitCode->valid())
+    return nullptr;
+  return jitCode;
+}
+
+void TemplateCompiler::emitExit(unsigned position) {
+  as_.movRI32(RAX, position);
+  as_.jmp(exit_);
+}
+
+Assembler::Label TemplateCompiler::exitStub(unsigned position) {
+  auto it = exitStubs_.find(position);
+  if (it != exitStubs_.end())
+    return it->second;
+  Label label = as_.newLabel();
+  exitStubs_[position] = label;
+  return label;
+}
+
+void TemplateCompiler::emitCall(void *function, unsigned a, unsigned b) {
+  as_.movRR(RDI, kContext);
+  as_.movRR(RSI, kSp);
+  as_.movRI32(RDX, a);
+  as_.movRI32(RCX, b);
+  as_.movRI64(RAX, reinterpret_cast<uint64_t>(function));
+  as_.callR(RAX);
+}
+
+void TemplateCompiler::emitHelper(JitRuntime::Helper helper, unsigned position,
+    unsigned a, unsigned b) {
+  emitCall(reinterpret_cast<void *>(helper), a, b);
+  as_.testRR64(RAX, RAX);
+  as_.jcc(CC_E, exitStub(position));
+  as_.movRR(kSp, RAX);
+}
+
+void TemplateCompiler::addSlowPath(Label slow, Label done, std::function<void()> body) {
+  Assembler &as = as_;
+  slowPaths_.push_back([&as, slow, done, body]() {
+    as.bind(slow);
+    body();
+    as.jmp(done);
+  });
+}
+
+void TemplateCompiler::emitIntBinary(unsigned op, unsigned position) {
+  //a是栈顶，b是次栈顶，结果a op b写回次栈顶
+  //有类型指令的操作数已被证明是整数，不生成类型检查和慢速路径
+  bool typed = op >= ADD_I && op <= NEQ_I;
+  Label slow = as_.newLabel();
+  Label done = as_.newLabel();
+  if (!typed) {
+    as_.cmpMI8(kSp, slot(1) + kKind, kInt);
+    as_.jcc(CC_NE, slow);
+    as_.cmpMI8(kSp, slot(2) + kKind, kInt);
+    as_.jcc(CC_NE, slow);
+  }
+  as_.movRM32(RAX, kSp, slot(1) + kPayload);
+
+  unsigned generic = Code::genericForm(op);
+  switch (generic) {
+    case ADD:
+      as_.addRM32(RAX, kSp, slot(2) + kPayload);
+      as_.movMR32(kSp, slot(2) + kPayload, RAX);
+      break;
+    case SUB:
+      as_.subRM32(RAX, kSp, slot(2) + kPayload);
+      as_.movMR32(kSp, slot(2) + kPayload, RAX);
+      break;
+    case MUL:
+      as_.imulRM32(RAX, kSp, slot(2) + kPayload);
+      as_.movMR32(kSp, slot(2) + kPayload, RAX);
+      break;
+    case DIV:
+      as_.cdq();
+      as_.idivM32(kSp, slot(2) + kPayload);
+      as_.movMR32(kSp, slot(2) + kPayload, RAX);
+      break;
+    default: {
+      Cond cc = CC_E;
+      switch (generic) {
+        case EQ: cc = CC_E; break;
+        case LT: cc = CC_L; break;
+        case BT: cc = CC_G; break;
+        case LE: cc = CC_LE; break;
+        case BE: cc = CC_GE; break;
+        default: cc = CC_NE; break;
+      }
+      as_.cmpRM32(RAX, kSp, slot(2) + kPayload);
+      as_.setcc(cc, RAX);
+      as_.movMR8(kSp, slot(2) + kPayload, RAX);
+      as_.movMI8(kSp, slot(2) + kKind, kBool);
+      break;
+    }
+  }
+  as_.subRI64(kSp, kValueSize);
+  as_.bind(done);
+
+  if (!typed) {
+    addSlowPath(slow, done, [this, generic, position]() {
+      emitHelper(JitRuntime::binary, position, generic);
+    });
+  }
+}
+
+bool TemplateCompiler::emitInstruction(unsigned position) {
+  unsigned instruction = code_.get(position);
+  unsigned op1 = Code::operandNum(instruction) > 0 ? code_.get(position + 1) : 0;
+  unsigned op2 = Code::operandNum(instruction) > 1 ? code_.get(position + 2) : 0;
+
+  switch (instruction) {
+    case ADD: case SUB: case MUL: case DIV:
+    case EQ: case LT: case BT: case LE: case BE: case NEQ:
+    case ADD_INT_INT: case SUB_INT_INT: case MUL_INT_INT: case DIV_INT_INT:
+    case EQ_INT_INT: case LT_INT_INT: case BT_INT_INT: case LE_INT_INT: case BE_INT_INT:
+    case NEQ_INT_INT:
+    case ADD_I: case SUB_I: case MUL_I: case DIV_I:
+    case EQ_I: case LT_I: case BT_I: case LE_I: case BE_I: case NEQ_I:
+      emitIntBinary(instruction, position);
+      return true;
+    case MOD:
+      emitHelper(JitRuntime::binary, position, MOD);
+      return true;
+    case ADD_STR_STR:
+      emitHelper(JitRuntime::binary, position, Code::genericForm(instruction));
+      return true;
+    case SCONST:
+      emitHelper(JitRuntime::sconst, position, op1);
+      return true;
+    case ICONST:
+      as_.movMI8(kSp, kKind, kInt);
+      as_.movMI32(kSp, kPayload, static_cast<uint32_t>(g_IntSymbols->get(op1)));
+      as_.addRI64(kSp, kValueSize);
+      return true;
+    case FCONST: {
+      double value = g_FloatSymbols->get(op1);
+      uint64_t bits;
+      std::memcpy(&bits, &value, sizeof(bits));
+      as_.movRI64(RAX, bits);
+      as_.movMR64(kSp, kPayload, RAX);
+      as_.movMI8(kSp, kKind, kFloat);
+      as_.addRI64(kSp, kValueSize);
+      return true;
+    }
+    case NCONST:
+      as_.movMI8(kSp, kKind, kNone);
+      as_.addRI64(kSp, kValueSize);
+      return true;
+    case BR:
+      as_.jmp(labels_[op1]);
+      return true;
+    case BRT:
+    case BRF:
+      //条件不是布尔值时由解释器报告错误
+      as_.cmpMI8(kSp, slot(1) + kKind, kBool);
+      as_.jcc(CC_NE, exitStub(position));
+      as_.movzxRM8(RAX, kSp, slot(1) + kPayload);
+      as_.subRI64(kSp, kValueSize);
+      as_.testRR32(RAX, RAX);
+      as_.jcc(instruction == BRT ? CC_NE : CC_E, labels_[op1]);
+      return true;
+    case GUARD:
+      emitCall(reinterpret_cast<void *>(JitRuntime::guard), op1, 0);
+      as_.testRR32(RAX, RAX);
+      as_.jcc(CC_E, labels_[op2]);
+      return true;
+    case AND:
+    case OR:
+      emitHelper(JitRuntime::logic, position, instruction);
+      return true;
+    case GLOAD:
+      emitHelper(JitRuntime::gload, position, op1);
+      return true;
+    case GSTORE:
+      emitHelper(JitRuntime::gstore, position, op1);
+      return true;
+    case CLOAD:
+      emitHelper(JitRuntime::cload, position, op1);
+      return true;
+    case CSTORE:
+      emitHelper(JitRuntime::cstore, position, op1);
+      return true;
+    case LOAD: {
+      //局部变量不是对象时直接复制类型和立即数
+      Label slow = as_.newLabel();
+      Label done = as_.newLabel();
+      as_.cmpMI8(kLocals, local(op1) + kKind, kObject);
+      as_.jcc(CC_E, slow);
+      as_.movzxRM8(RCX, kLocals, local(op1) + kKind);
+      as_.movRM64(RAX, kLocals, local(op1) + kPayload);
+      as_.movMR8(kSp, kKind, RCX);
+      as_.movMR64(kSp, kPayload, RAX);
+      as_.addRI64(kSp, kValueSize);
+      as_.bind(done);
+      addSlowPath(slow, done, [this, position, op1]() {
+        emitHelper(JitRuntime::load, position, op1);
+      });
+      return true;
+    }
+    case STORE: {
+      //新值和旧值都不是对象时直接复制，不需要维护引用计数
+      Label slow = as_.newLabel();
+      Label done = as_.newLabel();
+      as_.cmpMI8(kSp, slot(1) + kKind, kObject);
+      as_.jcc(CC_E, slow);
+      as_.cmpMI8(kLocals, local(op1) + kKind, kObject);
+      as_.jcc(CC_E, slow);
+      as_.movzxRM8(RCX, kSp, slot(1) + kKind);
+      as_.movRM64(RAX, kSp, slot(1) + kPayload);
+      as_.movMR8(kLocals, local(op1) + kKind, RCX);
+      as_.movMR64(kLocals, local(op1) + kPayload, RAX);
+      as_.subRI64(kSp, kValueSize);
+      as_.bind(done);
+      addSlowPath(slow, done, [this, position, op1]() {
+        emitHelper(JitRuntime::store, position, op1);
+      });
+      return true;
+    }
+    case LOAD_CELL:
+      emitHelper(JitRuntime::loadCell, position, op1);
+      return true;
+    case STORE_CELL:
+      emitHelper(JitRuntime::storeCell, position, op1);
+      return true;
+    case ARRAY_GENERATE:
+      emitHelper(JitRuntime::arrayGenerate, position, op1);
+      return true;
+    case ARRAY_ACCCESS: case ARRAY_ACCESS_I:
+      emitHelper(JitRuntime::arrayAccess, position);
+      return true;
+    case ARRAY_ASSIGN:
+      emitHelper(JitRuntime::arrayAssign, position);
+      return true;
+    case LAMB:
+      emitHelper(JitRuntime::lamb, position, op1);
+      return true;
+    case DOT_ACCESS:
+      emitHelper(JitRuntime::dotAccess, position, op1);
+      return true;
+    case DOT_ASSIGN:
+      emitHelper(JitRuntime::dotAssign, position, op1);
+      return true;
+    case NEG: {
+      Label slow = as_.newLabel();
+      Label done = as_.newLabel();
+      as_.cmpMI8(kSp, slot(1) + kKind, kInt);
+      as_.jcc(CC_NE, slow);
+      as_.negM32(kSp, slot(1) + kPayload);
+      as_.bind(done);
+      addSlowPath(slow, done, [this, position]() {
+        emitHelper(JitRuntime::neg, position);
+      });
+      return true;
+    }
+    case POP: {
+      Label slow = as_.newLabel();
+      Label done = as_.newLabel();
+      as_.cmpMI8(kSp, slot(1) + kKind, kObject);
+      as_.jcc(CC_E, slow);
+      as_.subRI64(kSp, kValueSize);
+      as_.bind(done);
+      addSlowPath(slow, done, [this, position]() {
+        emitHelper(JitRuntime::pop, position);
+      });
+      return true;
+    }
+    case INC_LOCAL: {
+      Label slow = as_.newLabel();
+      Label done = as_.newLabel();
+      as_.cmpMI8(kLocals, local(op1) + kKind, kInt);
+      as_.jcc(CC_NE, slow);
+      as_.addMI32(kLocals, local(op1) + kPayload, static_cast<int32_t>(op2));
+      as_.bind(done);
+      addSlowPath(slow, done, [this, position, op1, op2]() {
+        emitHelper(JitRuntime::incLocal, position, op1, op2);
+      });
+      return true;
+    }
+    case LOCAL_LT_BRF: {
+      unsigned target = code_.get(position + 3);
+      Label slow = as_.newLabel();
+      Label done = as_.newLabel();
+      as_.cmpMI8(kLocals, local(op1) + kKind, kInt);
+      as_.jcc(CC_NE, slow);
+      as_.cmpMI8(kLocals, local(op2) + kKind, kInt);
+      as_.jcc(CC_NE, slow);
+      as_.movRM32(RAX, kLocals, local(op1) + kPayload);
+      as_.cmpRM32(RAX, kLocals, local(op2) + kPayload);
+      as_.jcc(CC_GE, labels_[target]);
+      as_.bind(done);
+      Label targetLabel = labels_[target];
+      addSlowPath(slow, done, [this, position, op1, op2, targetLabel]() {
+        emitHelper(JitRuntime::localLess, position, op1, op2);
+        as_.movzxRM8(RAX, kSp, slot(1) + kPayload);
+        as_.subRI64(kSp, kValueSize);
+        as_.testRR32(RAX, RAX);
+        as_.jcc(CC_E, targetLabel);
+      });
+      return true;
+    }
+    case LOCAL_ARRAY_ACCESS:
+      emitHelper(JitRuntime::localArrayAccess, position, op1, op2);
+      return true;
+    case CALL: case TAILCALL: case INVOKE: case RET: case NEW_INSTANCE: case HALT:
+      //切换栈帧的指令由解释器执行
+      emitExit(position);
+      return true;
+    default:
+      return false;
+  }
+}
+
+}  // namespace
+
+/*****************************可执行代码************************************/
+
+JitCode::JitCode(const std::vector<unsigned char> &machineCode,
+    std::vector<unsigned> entries): entries_(std::move(entries)) {
+  //先以可写方式映射并复制机器码，再改为只读可执行
+  size_ = machineCode.size();
+  void *memory = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+      -1, 0);
+  if (memory == MAP_FAILED)
+    return;
+  std::memcpy(memory, machineCode.data(), size_);
+  if (mprotect(memory, size_, PROT_READ | PROT_EXEC) != 0) {
+    munmap(memory, size_);
+    return;
+  }
+  memory_ = static_cast<unsigned char *>(memory);
+}
+
+JitCode::~JitCode() {
+  if (memory_ != nullptr)
+    munmap(memory_, size_);
+}
+
+bool JitCode::valid() const {
+  return memory_ != nullptr;
+}
+
+unsigned JitCode::run(JitContext *context, unsigned position) const {
+  Entry entry = reinterpret_cast<Entry>(memory_);
+  return entry(context, memory_ + entries_[position]);
+}
+
+/*****************************即时编译器************************************/
+
+void Jit::countCall(Code &code) {
+  if (code.countCall() == callThreshold)
+    code.setJitCode(compile(code));
+}
+
+bool Jit::countBackEdge(Code &code, unsigned branch) {
+  if (code.getJitCode() == nullptr && code.countBackEdge(branch) == backEdgeThreshold)
+    code.setJitCode(compile(code));
+  return code.getJitCode() != nullptr;
+}
+
+JitCodePtr Jit::compile(const Code &code) {
+  TemplateCompiler compiler(code);
+  return compiler.compile();
+}
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef SPARROW_JIT_H_
+#define SPARROW_JIT_H_
+
+#include <vector>
+#include <memory>
+#include "code.h"
+
+/**基线即时编译器
+ *  函数被调用的次数达到阈值后，把它的栈式字节码逐条翻译成x86-64机器码，每条
+ *指令对应一段固定的机器码模板：局部变量、整数常量、整数运算和比较、跳转直接在
+ *机器码中读写操作数栈上的值，其余情况调用解释器的运行时函数完成
+ *
+ *  机器码只执行函数体内部的指令，CALL、TAILCALL、INVOKE、RET、NEW_INSTANCE等
+ *切换栈帧的指令仍由解释器执行：机器码在这些指令处返回解释器，解释器执行完后
+ *再从下一条指令对应的机器码位置进入。运行时函数出错时不抛出异常（机器码没有
+ *异常展开信息），而是恢复操作数栈并返回解释器重新执行该指令，由解释器报告错误
+ *
+ *  机器码执行期间，rbx是操作数栈顶（下一个空位），r12是当前栈帧窗口，r13是
+ *JitContext。操作数栈顶之上的位置中不会有对象，所以可以直接写入立即数
+ *
+ *  执行分为两层：函数先由解释器执行，调用次数或某个循环回边的执行次数达到阈值后
+ *编译成机器码。调用次数达到阈值时，之后新建的栈帧直接执行机器码；回边达到阈值时，
+ *正在执行的栈帧在循环头转入机器码（栈上替换，OSR）。机器码和解释器使用同一个栈帧
+ *窗口和操作数栈，所以转入时不需要转换栈帧，只需从循环头对应的机器码开始执行
+ *
+ *  只在x86-64上由SPARROW_JIT打开，运行时还需要--jit选项
+ */
+
+class ByteCodeInterpreter;
+class StackFrame;
+class Value;
+
+//机器码和解释器之间传递的执行状态
+struct JitContext {
+  ByteCodeInterpreter *interpreter = nullptr;
+  StackFrame *frame = nullptr;
+  Value *locals = nullptr;
+
+  //操作数栈顶，进入和离开机器码时同步
+  Value *sp = nullptr;
+};
+
+//一个函数的机器码，存放在可执行的内存页中
+class JitCode {
+public:
+  JitCode(const std::vector<unsigned char> &machineCode, std::vector<unsigned> entries);
+
+  ~JitCode();
+
+  JitCode(const JitCode &) = delete;
+  JitCode &operator=(const JitCode &) = delete;
+
+  //可执行内存是否分配成功
+  bool valid() const;
+
+  //从字节码position处对应的机器码开始执行，返回需要由解释器执行的下一条指令的位置
+  unsigned run(JitContext *context, unsigned position) const;
+
+private:
+  using Entry = unsigned (*)(JitContext *context, const unsigned char *target);
+
+  unsigned char *memory_ = nullptr;
+  size_t size_ = 0;
+
+  //每条字节码指令对应的机器码在memory_中的偏移
+  std::vector<unsigned> entries_;
+};
+using JitCodePtr = std::shared_ptr<JitCode>;
+
+class Jit {
+public:
+  //是否开启即时编译，由--jit选项设置
+  static bool enabled;
+
+  //函数被调用多少次后进行即时编译
+  static const unsigned callThreshold = 100;
+
+  //循环回边执行多少次后进行即时编译，并把正在执行的栈帧转入机器码
+  static const unsigned backEdgeThreshold = 1000;
+
+  //记录一次调用，调用次数恰好达到阈值时即时编译该字节码
+  //字节码中有不支持的指令时不生成机器码，之后一直由解释器执行
+  static void countCall(Code &code);
+
+  //记录branch处的回边执行了一次，执行次数恰好达到阈值时即时编译该字节码
+  //返回字节码是否已有机器码，有则解释器在循环头转入机器码
+  static bool countBackEdge(Code &code, unsigned branch);
+
+  //把字节码翻译成机器码，有不支持的指令时返回空指针
+  static JitCodePtr compile(const Code &code);
+};
+
+#endif
@@ -13,6 +13,9 @@
 #include "../pre_process/preprocessor.h"
 #include "../pre_process/parse_order_tree.h"
 #include "vm.h"
+#ifdef SPARROW_JIT
+#include "jit.h"
+#endif
 
 std::unique_ptr<Lexer> lexer;
 std::unique_ptr<BasicParser> parser;
@@ -39,7 +42,7 @@ void initNativeFunc() {
 void init(EnvPtr env, SymbolsPtr symbols) {
   //环境现在里面只有其它环境对象，直接遍历一遍全部元素即可
   MapEnvPtr mEnv = std::dynamic_pointer_cast<MapEnv>(env);
-  const std::map<std::string, ObjectPtr> &elements = mEnv->getElements();
+  const std::map<std::string, size_t> &elements = mEnv->getSlotIndex();
   for (auto &e: elements) {
     symbols->getRuntimeIndex(e.first);
   }
@@ -96,8 +99,28 @@ void evalAndCompile(std::map<std::string, EnvPtr> &env, ParseOrderTreeNodePtr no
 }
 
 int main(int argc, char *argv[]) {
-  if (argc != 2) {
+  //用法：main [--register] [--jit] 入口文件
+  //--register选择寄存器字节码作为编译目标，--jit对栈式字节码开启即时编译
+  int entryArg = 1;
+  for (; entryArg < argc - 1; ++entryArg) {
+    std::string option(argv[entryArg]);
+    if (option == "--register") {
+      FuncObject::compileTarget = CompileTarget::REGISTER;
+    }
+    else if (option == "--jit") {
+#ifdef SPARROW_JIT
+      Jit::enabled = true;
+#else
+      std::cerr << "jit is not supported in this build" << std::endl;
+#endif
+    }
+    else {
+      break;
+    }
+  }
+  if (argc != entryArg + 1) {
     std::cerr << "Please confirm program entry" << std::endl;
+    std::cerr << "usage: " << argv[0] << " [--register] [--jit] <file>" << std::endl;
     exit(-1);
   }
   try {
@@ -105,7 +128,7 @@ int main(int argc, char *argv[]) {
     std::map<std::string, EnvPtr> environments;  //<绝对路径名，环境>
 
     //程序入口
-    std::string entryFile(argv[1]);
+    std::string entryFile(argv[entryArg]);
 
     //词法解析器
     lexer.reset(new LexerImp());
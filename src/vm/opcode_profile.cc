@@ -0,0 +1,48 @@
+#include "opcode_profile.h"
+
+#include <cstdlib>
+#include <fstream>
+#include "code.h"
+
+OpcodeProfiler::~OpcodeProfiler() {
+  const char *path = std::getenv("SPARROW_OPCODE_PROFILE");
+  dump(path != nullptr ? path : "sparrow_opcodes.prof");
+}
+
+void OpcodeProfiler::record(unsigned instruction) {
+  //统计以当前指令结尾的各个长度的序列，先执行的指令位于高位
+  uint64_t packed = instruction;
+  for (size_t i = 0; i < historySize_; ++i) {
+    packed |= static_cast<uint64_t>(history_[historySize_ - 1 - i]) << (8 * (i + 1));
+    counts_[(static_cast<uint64_t>(i + 2) << 32) | packed] += 1;
+  }
+
+  //控制流发生转移的指令结束当前基本块，之后的指令不再和之前的组成序列
+  if (Code::branchOperand(instruction) != 0 || instruction == CALL ||
+      instruction == TAILCALL || instruction == INVOKE ||
+      instruction == NEW_INSTANCE || instruction == RET || instruction == HALT) {
+    historySize_ = 0;
+    return;
+  }
+  if (historySize_ == maxLength - 1) {
+    for (size_t i = 1; i < historySize_; ++i)
+      history_[i - 1] = history_[i];
+    --historySize_;
+  }
+  history_[historySize_++] = instruction;
+}
+
+void OpcodeProfiler::dump(const std::string &path) const {
+  std::ofstream out(path, std::ios::app);
+  if (!out)
+    return;
+  for (auto &count: counts_) {
+    size_t length = count.first >> 32;
+    out << count.second << "\t";
+    for (size_t i = 0; i < length; ++i) {
+      unsigned instruction = (count.first >> (8 * (length - 1 - i))) & 0xff;
+      out << (i == 0 ? "" : " ") << Code::instructionName(instruction);
+    }
+    out << "\n";
+  }
+}
@@ -0,0 +1,41 @@
+#ifndef SPARROW_OPCODE_PROFILE_H_
+#define SPARROW_OPCODE_PROFILE_H_
+
+/**指令序列统计
+ *  以SPARROW_OPCODE_PROFILE选项编译时，虚拟机在执行每条指令前调用record，
+ *统计同一基本块内连续执行的2~4条指令（n-gram）的执行次数。
+ *  解释器析构时把统计结果追加到环境变量SPARROW_OPCODE_PROFILE指定的文件中
+ *（未指定时为当前目录下的sparrow_opcodes.prof），多个程序的结果可以累积在
+ *同一个文件里，再用tools/mine_ngrams.py汇总，挑选值得合并成超级指令的序列
+ */
+
+#include <string>
+#include <unordered_map>
+#include <cstdint>
+
+class OpcodeProfiler {
+public:
+  OpcodeProfiler() = default;
+
+  //析构时输出统计结果
+  ~OpcodeProfiler();
+
+  //记录一条即将执行的指令
+  void record(unsigned instruction);
+
+  //把统计结果追加到文件中，每行为“次数\t指令序列”
+  void dump(const std::string &path) const;
+
+private:
+  //统计的最长序列
+  static const size_t maxLength = 4;
+
+  //当前基本块内最近执行的指令，跳转、调用、返回之后清空
+  unsigned history_[maxLength - 1];
+  size_t historySize_ = 0;
+
+  //序列的执行次数，键的高32位为序列长度，低32位每8位存放一条指令
+  std::unordered_map<uint64_t, unsigned long long> counts_;
+};
+
+#endif
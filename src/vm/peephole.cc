@@ -0,0 +1,212 @@
+#include "peephole.h"
+
+#include <cstdlib>
+#include <iostream>
+
+Peephole::Peephole(Code &code): codes_(code.getCodes()),
+  removed_(code.getCodeSize() + 1, false) {}
+
+void Peephole::run() {
+  for (size_t i = 0; i < codes_.size(); i += 1 + Code::operandNum(codes_[i]))
+    ++stats_.before;
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    changed |= threadJumps();
+    changed |= removeJumpsToNext();
+    changed |= removeDeadCode();
+    changed |= forwardStores();
+  }
+  rebuild();
+}
+
+const Peephole::Stats &Peephole::stats() const {
+  return stats_;
+}
+
+void Peephole::report(const std::string &name) const {
+  const char *enabled = std::getenv("SPARROW_PEEPHOLE_STATS");
+  if (enabled == nullptr || *enabled == '\0')
+    return;
+  std::cerr << "peephole " << name << ": " << stats_.before << " -> " << stats_.after
+    << " instructions, removed " << stats_.before - stats_.after
+    << " (threaded " << stats_.threaded << ", jumps " << stats_.jumpsRemoved
+    << ", dead " << stats_.deadRemoved << ", forwarded " << stats_.forwarded << ")"
+    << std::endl;
+}
+
+size_t Peephole::nextLive(size_t position) const {
+  while (position < codes_.size() && removed_[position])
+    position += 1 + Code::operandNum(codes_[position]);
+  return position;
+}
+
+bool Peephole::fallsThrough(unsigned instruction) {
+  //TAILCALL调用原生函数时会继续执行之后的RET
+  return instruction != BR && instruction != RET && instruction != HALT;
+}
+
+bool Peephole::threadJumps() {
+  bool changed = false;
+  for (size_t i = 0; i < codes_.size(); i += 1 + Code::operandNum(codes_[i])) {
+    unsigned offset = Code::branchOperand(codes_[i]);
+    if (removed_[i] || offset == 0)
+      continue;
+
+    //沿着BR链找到最终的目标，BR构成死循环时保持原样
+    size_t original = nextLive(codes_[i + offset]);
+    size_t target = original;
+    for (size_t steps = 0; steps < 16 && target < codes_.size() && codes_[target] == BR;
+        ++steps)
+      target = nextLive(codes_[target + 1]);
+    if (target < codes_.size() && codes_[target] == BR)
+      target = original;
+    if (target != original) {
+      ++stats_.threaded;
+      changed = true;
+    }
+    codes_[i + offset] = target;
+  }
+  return changed;
+}
+
+bool Peephole::removeJumpsToNext() {
+  bool changed = false;
+  for (size_t i = 0; i < codes_.size(); i += 1 + Code::operandNum(codes_[i])) {
+    if (removed_[i] || codes_[i] != BR)
+      continue;
+    if (nextLive(codes_[i + 1]) == nextLive(i + 2)) {
+      removed_[i] = true;
+      ++stats_.jumpsRemoved;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+bool Peephole::removeDeadCode() {
+  std::vector<bool> reachable(codes_.size() + 1, false);
+  std::vector<size_t> worklist{nextLive(0)};
+  while (!worklist.empty()) {
+    size_t i = worklist.back();
+    worklist.pop_back();
+    if (i >= codes_.size() || reachable[i])
+      continue;
+    reachable[i] = true;
+    unsigned instruction = codes_[i];
+    if (fallsThrough(instruction))
+      worklist.push_back(nextLive(i + 1 + Code::operandNum(instruction)));
+    unsigned offset = Code::branchOperand(instruction);
+    if (offset != 0)
+      worklist.push_back(nextLive(codes_[i + offset]));
+  }
+
+  bool changed = false;
+  for (size_t i = 0; i < codes_.size(); i += 1 + Code::operandNum(codes_[i])) {
+    if (!removed_[i] && !reachable[i]) {
+      removed_[i] = true;
+      ++stats_.deadRemoved;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+bool Peephole::forwardStores() {
+  //每个局部变量被读取的次数
+  std::vector<unsigned> reads;
+  auto countRead = [&reads](unsigned local) {
+    if (local >= reads.size())
+      reads.resize(local + 1, 0);
+    ++reads[local];
+  };
+  //每条指令的前驱，顺序执行到达的前驱记在最前面
+  std::vector<std::vector<size_t>> preds(codes_.size() + 1);
+  for (size_t i = 0; i < codes_.size(); i += 1 + Code::operandNum(codes_[i])) {
+    if (removed_[i])
+      continue;
+    unsigned instruction = codes_[i];
+    switch (instruction) {
+      case LOAD: case INC_LOCAL:
+        countRead(codes_[i + 1]);
+        break;
+      case LOCAL_LT_BRF: case LOCAL_ARRAY_ACCESS:
+        countRead(codes_[i + 1]);
+        countRead(codes_[i + 2]);
+        break;
+      default:
+        break;
+    }
+    if (fallsThrough(instruction))
+      preds[nextLive(i + 1 + Code::operandNum(instruction))].push_back(i);
+    unsigned offset = Code::branchOperand(instruction);
+    if (offset != 0)
+      preds[nextLive(codes_[i + offset])].push_back(i);
+  }
+
+  //q是否是紧接着执行到next的STORE local
+  auto storesInto = [&](size_t q, size_t next, unsigned local) {
+    return codes_[q] == STORE && codes_[q + 1] == local && nextLive(q + 2) == next;
+  };
+
+  size_t entry = nextLive(0);
+  for (size_t p = 0; p < codes_.size(); p += 1 + Code::operandNum(codes_[p])) {
+    if (removed_[p] || codes_[p] != LOAD || p == entry)
+      continue;
+    unsigned local = codes_[p + 1];
+    if (reads[local] != 1 || preds[p].empty())
+      continue;
+
+    //到达LOAD的每条路径都以STORE local结束：或者顺序执行到LOAD，或者
+    //顺序执行到一条只能由它到达、跳转到LOAD的BR
+    std::vector<size_t> stores;
+    bool forwardable = true;
+    for (size_t q: preds[p]) {
+      if (storesInto(q, p, local)) {
+        stores.push_back(q);
+      }
+      else if (codes_[q] == BR && preds[q].size() == 1 &&
+          storesInto(preds[q][0], q, local)) {
+        stores.push_back(preds[q][0]);
+      }
+      else {
+        forwardable = false;
+        break;
+      }
+    }
+    if (!forwardable)
+      continue;
+
+    removed_[p] = true;
+    for (size_t q: stores)
+      removed_[q] = true;
+    ++stats_.forwarded;
+    return true;
+  }
+  return false;
+}
+
+void Peephole::rebuild() {
+  std::vector<unsigned> optimized;
+  optimized.reserve(codes_.size());
+  std::vector<unsigned> newPosition(codes_.size() + 1, 0);
+  for (size_t i = 0; i < codes_.size(); i += 1 + Code::operandNum(codes_[i])) {
+    newPosition[i] = optimized.size();
+    if (removed_[i])
+      continue;
+    optimized.insert(optimized.end(), codes_.begin() + i,
+        codes_.begin() + i + 1 + Code::operandNum(codes_[i]));
+    ++stats_.after;
+  }
+  newPosition[codes_.size()] = optimized.size();
+
+  //跳到被删除指令的跳转落到它之后第一条保留的指令
+  for (size_t i = 0; i < optimized.size(); i += 1 + Code::operandNum(optimized[i])) {
+    unsigned offset = Code::branchOperand(optimized[i]);
+    if (offset != 0)
+      optimized[i + offset] = newPosition[optimized[i + offset]];
+  }
+  codes_.swap(optimized);
+  removed_.assign(codes_.size() + 1, false);
+}
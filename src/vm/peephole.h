@@ -0,0 +1,72 @@
+#ifndef SPARROW_PEEPHOLE_H_
+#define SPARROW_PEEPHOLE_H_
+
+#include <string>
+#include <vector>
+#include "code.h"
+
+/**窥孔优化
+ *  AST逐个节点生成的栈式字节码比较直白：嵌套的if、elif、while会产生跳到另一条
+ *BR的BR，没有else的if末尾是跳到下一条指令的BR，return之后的BR永远不会执行，
+ *赋值后立即读取又会产生STORE x; LOAD x。函数编译完成、合并超级指令之前，在
+ *字节码上反复进行以下优化，直到没有变化为止：
+ *
+ *  1.跳转线程化：跳转目标是BR时，直接跳到这条BR的目标
+ *  2.删除跳到下一条指令的BR
+ *  3.删除从函数入口出发无法到达的指令
+ *  4.存取转发：局部变量x只在一处被读取，且到达这处LOAD x的每条路径都是刚执行完
+ *    STORE x时，值本来就在栈顶，删除这些STORE和LOAD
+ *
+ *  优化时只标记被删除的指令，最后统一生成新的字节码并修正跳转地址。跳到被删除
+ *指令的跳转改为跳到它之后的第一条保留的指令
+ */
+class Peephole {
+public:
+  //一个函数的优化统计
+  struct Stats {
+    //优化前后的指令条数
+    unsigned before = 0;
+    unsigned after = 0;
+
+    //线程化的跳转、删除的BR、删除的不可达指令、转发的STORE/LOAD对
+    unsigned threaded = 0;
+    unsigned jumpsRemoved = 0;
+    unsigned deadRemoved = 0;
+    unsigned forwarded = 0;
+  };
+
+  explicit Peephole(Code &code);
+
+  //执行优化并重新生成字节码
+  void run();
+
+  const Stats &stats() const;
+
+  //环境变量SPARROW_PEEPHOLE_STATS非空时，把函数name的优化统计输出到标准错误
+  void report(const std::string &name) const;
+
+private:
+  bool threadJumps();
+  bool removeJumpsToNext();
+  bool removeDeadCode();
+  bool forwardStores();
+
+  //生成删除标记之外的指令，并修正跳转地址
+  void rebuild();
+
+  //position处或之后第一条没有被删除的指令的位置，没有则返回字节码长度
+  size_t nextLive(size_t position) const;
+
+  //指令执行完后是否会顺序执行下一条指令
+  static bool fallsThrough(unsigned instruction);
+
+private:
+  std::vector<unsigned> &codes_;
+
+  //每个位置的指令是否被删除
+  std::vector<bool> removed_;
+
+  Stats stats_;
+};
+
+#endif
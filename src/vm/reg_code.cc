@@ -0,0 +1,418 @@
+#include "reg_code.h"
+
+#include <algorithm>
+#include <initializer_list>
+#include "../symbols.h"
+#include "vm.h"
+
+/*****************************翻译器************************************/
+
+//逐条翻译栈式字节码，用一个虚拟的操作数栈记录每个栈位上的值位于哪个操作数：
+//LOAD和常量指令不产生代码，只把局部变量或常量记在栈位上，由使用它的指令直接引用；
+//其它指令的结果写入该栈位对应的临时寄存器。跳转前后各条路径的栈位都必须位于
+//临时寄存器中，所以在跳转指令和跳转目标处把记录的局部变量和常量移入临时寄存器
+class RegCode::Translator {
+public:
+  Translator(const Code &code, size_t localSize, RegCode &result):
+    code_(code), localSize_(localSize), result_(result), out_(result.codes_) {}
+
+  void run();
+
+private:
+  //深度为depth的栈位对应的临时寄存器
+  unsigned temp(size_t depth) const {
+    return static_cast<unsigned>(localSize_ + depth);
+  }
+
+  //生成一条指令，返回指令的位置
+  size_t emit(std::initializer_list<unsigned> words);
+
+  //生成一条结果写入栈顶之上新栈位的指令，并把结果压入虚拟栈
+  void emitResult(unsigned instruction, std::initializer_list<unsigned> sources);
+
+  //把常量放入常量表，返回表示该常量的操作数
+  unsigned constant(unsigned instruction, unsigned index);
+
+  //把栈位上记录的局部变量或常量移入它的临时寄存器
+  void materialize(size_t depth);
+
+  //把从depth开始的所有栈位移入临时寄存器
+  void materializeFrom(size_t depth);
+
+  //局部变量被改写之前，把记录着它的栈位移入临时寄存器
+  void materializeLocal(unsigned local);
+
+  unsigned pop();
+
+  //翻译一条指令
+  void translate(unsigned instruction, unsigned operand);
+
+  //把值存入局部变量，值刚由上一条指令写入临时寄存器时，直接改写那条指令的目标
+  void store(unsigned local, unsigned value);
+
+private:
+  static const size_t kNoDest = static_cast<size_t>(-1);
+
+  const Code &code_;
+  size_t localSize_;
+  RegCode &result_;
+  std::vector<unsigned> &out_;
+
+  //虚拟的操作数栈，记录每个栈位上的值所在的操作数
+  std::vector<unsigned> slots_;
+
+  //常量去重，<常量指令，常量池下标> -> 常量操作数
+  std::map<std::pair<unsigned, unsigned>, unsigned> constantIndex_;
+
+  //上一条指令目标寄存器操作数的位置，上一条指令不是单一目标的指令时为kNoDest
+  size_t lastDest_ = kNoDest;
+
+  //跳转地址所在的位置，翻译完成后改写成新的地址
+  std::vector<size_t> branchFixups_;
+
+  //正在翻译的指令在栈式字节码中的位置，用于读取第一个以外的操作数
+  size_t position_ = 0;
+};
+
+size_t RegCode::Translator::emit(std::initializer_list<unsigned> words) {
+  size_t position = out_.size();
+  out_.insert(out_.end(), words);
+  lastDest_ = kNoDest;
+  return position;
+}
+
+void RegCode::Translator::emitResult(unsigned instruction,
+    std::initializer_list<unsigned> sources) {
+  unsigned dest = temp(slots_.size());
+  size_t position = emit({instruction, dest});
+  out_.insert(out_.end(), sources);
+  lastDest_ = position + 1;
+  slots_.push_back(dest);
+}
+
+unsigned RegCode::Translator::constant(unsigned instruction, unsigned index) {
+  auto key = std::make_pair(instruction, index);
+  auto iter = constantIndex_.find(key);
+  if (iter != constantIndex_.end())
+    return iter->second;
+
+  Value value;
+  switch (instruction) {
+    case ICONST:
+      value = Value::makeInt(g_IntSymbols->get(index));
+      break;
+    case FCONST:
+      value = Value::makeFloat(g_FloatSymbols->get(index));
+      break;
+    case SCONST:
+      value = Value(g_StrSymbols->getObject(index));
+      break;
+    default:
+      value = Value::makeNone();
+      break;
+  }
+  result_.constants_.push_back(std::move(value));
+  unsigned operand = static_cast<unsigned>(result_.constants_.size() - 1) | kConstantBit;
+  constantIndex_.insert({key, operand});
+  return operand;
+}
+
+void RegCode::Translator::materialize(size_t depth) {
+  if (slots_[depth] != temp(depth)) {
+    emit({R_MOVE, temp(depth), slots_[depth]});
+    slots_[depth] = temp(depth);
+  }
+}
+
+void RegCode::Translator::materializeFrom(size_t depth) {
+  for (size_t i = depth; i < slots_.size(); ++i)
+    materialize(i);
+}
+
+void RegCode::Translator::materializeLocal(unsigned local) {
+  for (size_t i = 0; i < slots_.size(); ++i) {
+    if (slots_[i] == local)
+      materialize(i);
+  }
+}
+
+unsigned RegCode::Translator::pop() {
+  if (slots_.empty())
+    throw VMException("operand stack underflow while translating to register code");
+  unsigned operand = slots_.back();
+  slots_.pop_back();
+  return operand;
+}
+
+void RegCode::Translator::store(unsigned local, unsigned value) {
+  if (std::find(slots_.begin(), slots_.end(), local) != slots_.end()) {
+    //栈中还记录着该局部变量的旧值，先把旧值移走，再生成单独的移动指令
+    materializeLocal(local);
+    emit({R_MOVE, local, value});
+  }
+  else if (lastDest_ != kNoDest && out_[lastDest_] == value) {
+    out_[lastDest_] = local;
+    lastDest_ = kNoDest;
+  }
+  else {
+    emit({R_MOVE, local, value});
+  }
+}
+
+void RegCode::Translator::translate(unsigned instruction, unsigned operand) {
+  switch (instruction) {
+    case ADD: case SUB: case MUL: case DIV: case MOD:
+    case EQ: case LT: case BT: case LE: case BE: case NEQ: {
+      unsigned a = pop();
+      unsigned b = pop();
+      emitResult(R_ADD + (instruction - ADD), {a, b});
+      break;
+    }
+    case ADD_I: case SUB_I: case MUL_I: case DIV_I:
+    case EQ_I: case LT_I: case BT_I: case LE_I: case BE_I: case NEQ_I: {
+      unsigned a = pop();
+      unsigned b = pop();
+      emitResult(R_ADD_I + (instruction - ADD_I), {a, b});
+      break;
+    }
+    case AND: case OR: {
+      unsigned a = pop();
+      unsigned b = pop();
+      emitResult(instruction == AND ? R_AND : R_OR, {a, b});
+      break;
+    }
+    case NEG: {
+      unsigned a = pop();
+      emitResult(R_NEG, {a});
+      break;
+    }
+    case SCONST: case ICONST: case FCONST: case NCONST:
+      slots_.push_back(constant(instruction, operand));
+      break;
+    case LOAD:
+      slots_.push_back(operand);
+      break;
+    case STORE:
+      store(operand, pop());
+      break;
+    case GLOAD:
+      emitResult(R_GLOAD, {operand});
+      break;
+    case CLOAD:
+      emitResult(R_CLOAD, {operand});
+      break;
+    case LOAD_CELL:
+      emitResult(R_LOAD_CELL, {operand});
+      break;
+    case LAMB:
+      emitResult(R_LAMB, {operand});
+      break;
+    case GSTORE:
+      emit({R_GSTORE, pop(), operand});
+      break;
+    case CSTORE:
+      emit({R_CSTORE, pop(), operand});
+      break;
+    case STORE_CELL:
+      emit({R_STORE_CELL, pop(), operand});
+      break;
+    case CALL: case TAILCALL: {
+      //函数和实参需要依次位于连续的寄存器中
+      size_t base = slots_.size() - operand - 1;
+      materializeFrom(base);
+      emit({instruction == CALL ? R_CALL : R_TAILCALL, temp(base), operand});
+      slots_.resize(base + 1);
+      break;
+    }
+    case INVOKE: {
+      //接收者和实参需要依次位于连续的寄存器中，operand是内联缓存下标
+      unsigned paramsNum = code_.get(position_ + 2);
+      size_t base = slots_.size() - paramsNum - 1;
+      materializeFrom(base);
+      emit({R_INVOKE, temp(base), paramsNum, operand});
+      slots_.resize(base + 1);
+      break;
+    }
+    case ARRAY_GENERATE: {
+      size_t base = slots_.size() - operand;
+      materializeFrom(base);
+      emit({R_ARRAY, temp(base), operand});
+      slots_.resize(base + 1);
+      slots_[base] = temp(base);
+      break;
+    }
+    case NEW_INSTANCE: {
+      size_t base = slots_.size() - 1;
+      materialize(base);
+      emit({R_NEW, temp(base)});
+      slots_.push_back(temp(base + 1));
+      break;
+    }
+    case RET:
+      emit({R_RET, pop()});
+      //之后的指令只能通过跳转到达，到达时栈位都已经位于临时寄存器中
+      for (size_t i = 0; i < slots_.size(); ++i)
+        slots_[i] = temp(i);
+      break;
+    case BR:
+      materializeFrom(0);
+      branchFixups_.push_back(emit({R_JMP, operand}) + 1);
+      break;
+    case BRT: case BRF: {
+      unsigned cond = pop();
+      materializeFrom(0);
+      branchFixups_.push_back(emit({instruction == BRT ? R_BRT : R_BRF, cond, operand}) + 2);
+      break;
+    }
+    case GUARD:
+      materializeFrom(0);
+      branchFixups_.push_back(emit({R_GUARD, operand, code_.get(position_ + 2)}) + 2);
+      break;
+    case ARRAY_ACCCESS: {
+      unsigned index = pop();
+      unsigned array = pop();
+      emitResult(R_GETINDEX, {array, index});
+      break;
+    }
+    case ARRAY_ACCESS_I: {
+      unsigned index = pop();
+      unsigned array = pop();
+      emitResult(R_GETINDEX_I, {array, index});
+      break;
+    }
+    case ARRAY_ASSIGN: {
+      unsigned index = pop();
+      unsigned array = pop();
+      unsigned value = pop();
+      emit({R_SETINDEX, array, index, value});
+      break;
+    }
+    case DOT_ACCESS: {
+      unsigned object = pop();
+      emitResult(R_GETDOT, {object, operand});
+      break;
+    }
+    case DOT_ASSIGN: {
+      unsigned object = pop();
+      unsigned value = pop();
+      emit({R_SETDOT, object, value, operand});
+      break;
+    }
+    case POP:
+      pop();
+      break;
+    case HALT:
+      emit({R_HALT});
+      break;
+    default:
+      throw VMException(std::string("can not translate instruction to register code: ") +
+          Code::instructionName(instruction));
+  }
+}
+
+void RegCode::Translator::run() {
+  size_t codeSize = code_.getCodeSize();
+
+  //标记所有的跳转目标
+  std::vector<bool> targets(codeSize + 1, false);
+  for (size_t i = 0; i < codeSize; i += 1 + Code::operandNum(code_.get(i))) {
+    unsigned offset = Code::branchOperand(code_.get(i));
+    if (offset != 0)
+      targets[code_.get(i + offset)] = true;
+  }
+
+  //BR之前可能留有由跳转目标使用的值，BR之后的指令只能由跳转到达，
+  //它的栈深度以沿控制流计算的为准，各个栈位都已位于临时寄存器中
+  std::vector<int> depths = code_.stackDepths();
+
+  std::vector<unsigned> newPosition(codeSize + 1, 0);
+  for (size_t i = 0; i < codeSize; ) {
+    unsigned instruction = code_.get(i);
+    unsigned operandNum = Code::operandNum(instruction);
+    if (targets[i])
+      materializeFrom(0);
+    if (targets[i] && depths[i] >= 0 && slots_.size() != static_cast<size_t>(depths[i])) {
+      slots_.clear();
+      for (int depth = 0; depth < depths[i]; ++depth)
+        slots_.push_back(temp(depth));
+    }
+    newPosition[i] = out_.size();
+    if (targets[i])
+      lastDest_ = kNoDest;
+    position_ = i;
+    translate(instruction, operandNum > 0 ? code_.get(i + 1) : 0);
+    i += 1 + operandNum;
+  }
+  newPosition[codeSize] = out_.size();
+
+  for (size_t position: branchFixups_)
+    out_[position] = newPosition[out_[position]];
+}
+
+/*****************************寄存器字节码********************************/
+
+RegCodePtr RegCode::translate(const Code &code, size_t localSize) {
+  RegCodePtr result = std::make_shared<RegCode>();
+  result->frameSize_ = localSize + code.getMaxStackDepth();
+  Translator translator(code, localSize, *result);
+  translator.run();
+  return result;
+}
+
+unsigned RegCode::operandNum(unsigned instruction) {
+  switch (instruction) {
+    case R_RET: case R_JMP: case R_NEW:
+      return 1;
+    case R_MOVE: case R_NEG:
+    case R_GLOAD: case R_GSTORE: case R_CLOAD: case R_CSTORE:
+    case R_LOAD_CELL: case R_STORE_CELL:
+    case R_CALL: case R_TAILCALL: case R_BRT: case R_BRF: case R_GUARD:
+    case R_ARRAY: case R_LAMB:
+      return 2;
+    case R_ADD: case R_SUB: case R_MUL: case R_DIV: case R_MOD:
+    case R_EQ: case R_LT: case R_BT: case R_LE: case R_BE: case R_NEQ:
+    case R_AND: case R_OR:
+    case R_GETINDEX: case R_SETINDEX: case R_GETDOT: case R_SETDOT:
+    case R_INVOKE:
+    case R_ADD_I: case R_SUB_I: case R_MUL_I: case R_DIV_I:
+    case R_EQ_I: case R_LT_I: case R_BT_I: case R_LE_I: case R_BE_I: case R_NEQ_I:
+    case R_GETINDEX_I:
+      return 3;
+    default:
+      return 0;
+  }
+}
+
+const char *RegCode::instructionName(unsigned instruction) {
+  //顺序必须和RegInstruction的定义一致
+  static const char *names[] = {
+    "R_MOVE",
+    "R_ADD", "R_SUB", "R_MUL", "R_DIV", "R_MOD",
+    "R_EQ", "R_LT", "R_BT", "R_LE", "R_BE", "R_NEQ",
+    "R_AND", "R_OR",
+    "R_NEG",
+    "R_GLOAD", "R_GSTORE",
+    "R_CLOAD", "R_CSTORE",
+    "R_LOAD_CELL", "R_STORE_CELL",
+    "R_CALL",
+    "R_TAILCALL",
+    "R_INVOKE",
+    "R_RET",
+    "R_JMP", "R_BRT", "R_BRF",
+    "R_GUARD",
+    "R_ARRAY",
+    "R_GETINDEX", "R_SETINDEX",
+    "R_LAMB",
+    "R_GETDOT", "R_SETDOT",
+    "R_NEW",
+    "R_ADD_I", "R_SUB_I", "R_MUL_I", "R_DIV_I",
+    "R_EQ_I", "R_LT_I", "R_BT_I", "R_LE_I", "R_BE_I", "R_NEQ_I",
+    "R_GETINDEX_I",
+    "R_HALT"
+  };
+  static_assert(sizeof(names) / sizeof(names[0]) == R_HALT + 1,
+      "register instruction names do not match the instruction set");
+  if (instruction > R_HALT)
+    return "UNKNOWN";
+  return names[instruction];
+}
@@ -0,0 +1,143 @@
+#ifndef SPARROW_REG_CODE_H_
+#define SPARROW_REG_CODE_H_
+
+#include <vector>
+#include <map>
+#include <memory>
+#include "../env.h"
+#include "code.h"
+
+/**寄存器字节代码
+ *  寄存器字节码由函数编译出的栈式字节码翻译而来，是三地址形式的指令，
+ *操作数直接指明读写的寄存器，不再经过操作数栈中转，例如 a = b + c
+ *在栈式字节码中是 LOAD c; LOAD b; ADD; STORE a，在这里只有一条 R_ADD a b c
+ *
+ *  寄存器就是栈帧窗口中的位置：开头是局部变量，之后是临时寄存器。栈式字节码
+ *中每条指令执行时的栈深度是编译时确定的，深度为d的栈位对应第（局部变量个数 + d）
+ *个寄存器，所以栈式字节码可以逐条翻译。翻译时局部变量和常量不会被复制到临时
+ *寄存器，而是直接作为之后指令的操作数
+ *
+ *  下面注释中A表示目标寄存器，B、C表示源操作数。源操作数最高位为1时表示
+ *常量表中的常量，否则表示寄存器；其余操作数（名字下标、跳转地址等）的含义
+ *和对应的栈式指令相同
+ */
+
+enum RegInstruction {
+  //数据移动，A = B
+  R_MOVE,
+
+  //四则运算和比较，A = B op C，B对应栈式指令的栈顶操作数
+  R_ADD, R_SUB, R_MUL, R_DIV, R_MOD,
+  R_EQ, R_LT, R_BT, R_LE, R_BE, R_NEQ,
+
+  //与、或逻辑，A = B op C
+  R_AND, R_OR,
+
+  //取负值，A = -B
+  R_NEG,
+
+  //非局部变量，R_GLOAD A 名字下标；R_GSTORE B 名字下标
+  R_GLOAD, R_GSTORE,
+
+  //闭包变量，R_CLOAD A 闭包变量下标；R_CSTORE B 闭包变量下标
+  R_CLOAD, R_CSTORE,
+
+  //被lamb引用的局部变量，R_LOAD_CELL A 局部变量下标；R_STORE_CELL B 局部变量下标
+  R_LOAD_CELL, R_STORE_CELL,
+
+  //调用函数，R_CALL A 实参个数，函数位于A，实参依次位于A之后的寄存器，
+  //返回值写入A
+  R_CALL,
+
+  //尾调用，R_TAILCALL A 实参个数，操作数同R_CALL，复用当前栈帧
+  R_TAILCALL,
+
+  //方法调用，R_INVOKE A 实参个数 内联缓存下标，接收者位于A，实参依次位于A之后，
+  //通过内联缓存找到方法替换A中的接收者，之后和R_CALL相同
+  R_INVOKE,
+
+  //函数返回，R_RET B
+  R_RET,
+
+  //跳转，R_JMP 地址；R_BRT B 地址；R_BRF B 地址
+  R_JMP, R_BRT, R_BRF,
+
+  //内联守卫，R_GUARD 守卫下标 地址，守卫不成立时跳转
+  R_GUARD,
+
+  //生成数组，R_ARRAY A 元素个数，元素依次位于A开始的寄存器，数组写入A
+  R_ARRAY,
+
+  //数组访问，A = B[C]；数组赋值 A[B] = C，这里A也是源操作数
+  R_GETINDEX, R_SETINDEX,
+
+  //创建闭包，R_LAMB A 闭包源码下标
+  R_LAMB,
+
+  //域访问，R_GETDOT A B 内联缓存下标，A = B.成员
+  //域赋值，R_SETDOT A B 内联缓存下标，A.成员 = B，这里A也是源操作数
+  R_GETDOT, R_SETDOT,
+
+  //创建对象，R_NEW A，A中是类元对象，执行后A是新对象，A + 1是它的初始化函数
+  R_NEW,
+
+  //有类型指令，由对应的栈式有类型指令翻译而来，不检查操作数类型
+  //两个操作数都是整数的四则运算和比较，A = B op C
+  R_ADD_I, R_SUB_I, R_MUL_I, R_DIV_I,
+  R_EQ_I, R_LT_I, R_BT_I, R_LE_I, R_BE_I, R_NEQ_I,
+
+  //下标是整数的数组访问，A = B[C]
+  R_GETINDEX_I,
+
+  //中止程序
+  R_HALT
+};
+
+class RegCode {
+public:
+  //源操作数中表示常量的标志位
+  static const unsigned kConstantBit = 1u << 31;
+
+  //把函数的栈式字节码翻译成寄存器字节码
+  //code必须是刚编译完、没有合并超级指令的字节码，并且已经计算过最大栈深度
+  static RegCodePtr translate(const Code &code, size_t localSize);
+
+  //获取字节码的起始地址
+  unsigned *getCodeBase() {
+    return codes_.data();
+  }
+
+  //获取常量表的起始地址
+  const Value *getConstants() const {
+    return constants_.data();
+  }
+
+  //栈帧窗口中的寄存器个数，包括局部变量和临时寄存器
+  size_t getFrameSize() const {
+    return frameSize_;
+  }
+
+  //返回字节码的长度
+  size_t getCodeSize() const {
+    return codes_.size();
+  }
+
+  //指令的操作数个数
+  static unsigned operandNum(unsigned instruction);
+
+  //指令的名称，用于调试
+  static const char *instructionName(unsigned instruction);
+
+private:
+  //翻译过程中的状态，只在translate中使用
+  class Translator;
+
+  std::vector<unsigned> codes_;
+
+  //常量表，常量在翻译时从全局常量池取出并转换成值
+  std::vector<Value> constants_;
+
+  size_t frameSize_ = 0;
+};
+
+#endif
@@ -0,0 +1,413 @@
+#include "vm.h"
+
+#include "reg_code.h"
+#include "../debugger.h"
+
+/***********************寄存器字节码解释器****************************/
+
+/**寄存器字节码的解释循环
+ *  寄存器就是当前栈帧窗口中的位置，开头是局部变量，之后是临时寄存器。执行期间
+ *操作数栈的栈顶始终位于当前栈帧窗口的末尾，窗口之上的位置供借用操作数栈实现的
+ *较重指令（通用运算、原生函数调用、创建对象）临时使用
+ *  分派方式和栈式字节码的解释循环相同，由SPARROW_THREADED_DISPATCH选择
+ */
+#ifdef SPARROW_THREADED_DISPATCH
+#define REG_CASE(op) L_##op
+#else
+#define REG_CASE(op) case op
+#endif
+#define REG_DISPATCH() goto dispatch
+
+//切换栈帧后重新加载缓存的栈帧、字节码、指令计数器、寄存器和常量表
+#define REG_LOAD_FRAME() \
+  do { \
+    frame = &callStack_->top(); \
+    codes = frame->getCodeBase(); \
+    ip = codes + frame->getIp(); \
+    regs = operandStack->base() + frame->getBase(); \
+    consts = frame->getFunction()->getRegCodes()->getConstants(); \
+  } while (0)
+
+//源操作数，最高位为1时是常量表中的常量，否则是寄存器
+#define RK(operand) \
+  (((operand) & RegCode::kConstantBit) ? \
+   consts[(operand) & ~RegCode::kConstantBit] : regs[(operand)])
+
+void ByteCodeInterpreter::runRegister() {
+#ifdef SPARROW_THREADED_DISPATCH
+  //顺序必须和RegInstruction的定义一致
+  static void *dispatchTable[] = {
+    &&L_R_MOVE,
+    &&L_R_ADD, &&L_R_SUB, &&L_R_MUL, &&L_R_DIV, &&L_R_MOD,
+    &&L_R_EQ, &&L_R_LT, &&L_R_BT, &&L_R_LE, &&L_R_BE, &&L_R_NEQ,
+    &&L_R_AND, &&L_R_OR,
+    &&L_R_NEG,
+    &&L_R_GLOAD, &&L_R_GSTORE,
+    &&L_R_CLOAD, &&L_R_CSTORE,
+    &&L_R_LOAD_CELL, &&L_R_STORE_CELL,
+    &&L_R_CALL,
+    &&L_R_TAILCALL,
+    &&L_R_INVOKE,
+    &&L_R_RET,
+    &&L_R_JMP, &&L_R_BRT, &&L_R_BRF,
+    &&L_R_GUARD,
+    &&L_R_ARRAY,
+    &&L_R_GETINDEX, &&L_R_SETINDEX,
+    &&L_R_LAMB,
+    &&L_R_GETDOT, &&L_R_SETDOT,
+    &&L_R_NEW,
+    &&L_R_ADD_I, &&L_R_SUB_I, &&L_R_MUL_I, &&L_R_DIV_I,
+    &&L_R_EQ_I, &&L_R_LT_I, &&L_R_BT_I, &&L_R_LE_I, &&L_R_BE_I, &&L_R_NEQ_I,
+    &&L_R_GETINDEX_I,
+    &&L_R_HALT
+  };
+  static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) == R_HALT + 1,
+      "dispatch table does not match the register instruction set");
+#endif
+
+  //当前栈帧、字节码起始地址、指令计数器、寄存器以及常量表只在CALL、RET时重新加载
+  StackFrame *frame = nullptr;
+  unsigned *codes = nullptr;
+  unsigned *ip = nullptr;
+  Value *regs = nullptr;
+  const Value *consts = nullptr;
+  OperandStack *operandStack = operandStack_.get();
+
+  if (callStack_->empty())
+    return;
+  REG_LOAD_FRAME();
+
+dispatch:
+#ifdef SPARROW_THREADED_DISPATCH
+  goto *dispatchTable[*ip++];
+  {
+#else
+  switch (*ip++) {
+#endif
+    REG_CASE(R_MOVE):
+    {
+      regs[ip[0]] = RK(ip[1]);
+      ip += 2;
+      REG_DISPATCH();
+    }
+
+/**二元运算
+ * 两个操作数都是整数时直接运算，否则借用操作数栈进行通用运算
+ */
+#define REG_BINARY_OP(op, generic, make, expr) \
+    REG_CASE(op): \
+    { \
+      const Value &left = RK(ip[1]); \
+      const Value &right = RK(ip[2]); \
+      if (left.isInt() && right.isInt()) { \
+        int a = left.asInt(); \
+        int b = right.asInt(); \
+        regs[ip[0]] = Value::make(expr); \
+        ip += 3; \
+        REG_DISPATCH(); \
+      } \
+      arithmeticTypeCast(left, right, generic); \
+      regs[ip[0]] = operandStack->getAndPop(); \
+      ip += 3; \
+      REG_DISPATCH(); \
+    }
+
+    REG_BINARY_OP(R_ADD, ADD, makeInt, a + b)
+    REG_BINARY_OP(R_SUB, SUB, makeInt, a - b)
+    REG_BINARY_OP(R_MUL, MUL, makeInt, a * b)
+    REG_BINARY_OP(R_DIV, DIV, makeInt, a / b)
+    REG_BINARY_OP(R_EQ, EQ, makeBool, a == b)
+    REG_BINARY_OP(R_LT, LT, makeBool, a < b)
+    REG_BINARY_OP(R_BT, BT, makeBool, a > b)
+    REG_BINARY_OP(R_LE, LE, makeBool, a <= b)
+    REG_BINARY_OP(R_BE, BE, makeBool, a >= b)
+    REG_BINARY_OP(R_NEQ, NEQ, makeBool, a != b)
+
+#undef REG_BINARY_OP
+
+/**有类型的整数二元运算
+ * 编译时已经证明两个操作数都是整数，不检查类型
+ */
+#define REG_TYPED_BINARY_OP(op, make, expr) \
+    REG_CASE(op): \
+    { \
+      int a = RK(ip[1]).asInt(); \
+      int b = RK(ip[2]).asInt(); \
+      regs[ip[0]] = Value::make(expr); \
+      ip += 3; \
+      REG_DISPATCH(); \
+    }
+
+    REG_TYPED_BINARY_OP(R_ADD_I, makeInt, a + b)
+    REG_TYPED_BINARY_OP(R_SUB_I, makeInt, a - b)
+    REG_TYPED_BINARY_OP(R_MUL_I, makeInt, a * b)
+    REG_TYPED_BINARY_OP(R_DIV_I, makeInt, a / b)
+    REG_TYPED_BINARY_OP(R_EQ_I, makeBool, a == b)
+    REG_TYPED_BINARY_OP(R_LT_I, makeBool, a < b)
+    REG_TYPED_BINARY_OP(R_BT_I, makeBool, a > b)
+    REG_TYPED_BINARY_OP(R_LE_I, makeBool, a <= b)
+    REG_TYPED_BINARY_OP(R_BE_I, makeBool, a >= b)
+    REG_TYPED_BINARY_OP(R_NEQ_I, makeBool, a != b)
+
+#undef REG_TYPED_BINARY_OP
+
+    REG_CASE(R_MOD):
+    {
+      arithmeticTypeCast(RK(ip[1]), RK(ip[2]), MOD);
+      regs[ip[0]] = operandStack->getAndPop();
+      ip += 3;
+      REG_DISPATCH();
+    }
+    REG_CASE(R_AND):
+    REG_CASE(R_OR):
+    {
+      const Value &a = RK(ip[1]);
+      const Value &b = RK(ip[2]);
+      bool isAnd = ip[-1] == R_AND;
+      if (!a.isBool() || !b.isBool())
+        throw VMException(isAnd ? "Invalid Logic Type for AND" : "Invalid Logic Type for OR");
+      regs[ip[0]] = Value::makeBool(isAnd ? a.asBool() && b.asBool() :
+          a.asBool() || b.asBool());
+      ip += 3;
+      REG_DISPATCH();
+    }
+    REG_CASE(R_NEG):
+    {
+      const Value &obj = RK(ip[1]);
+      if (obj.isInt())
+        regs[ip[0]] = Value::makeInt(-obj.asInt());
+      else if (obj.isFloat())
+        regs[ip[0]] = Value::makeFloat(-obj.asFloat());
+      else
+        throw VMException("Invalid type for NEG");
+      ip += 2;
+      REG_DISPATCH();
+    }
+    REG_CASE(R_GLOAD):
+    {
+      regs[ip[0]] = frame->getOuterObj(ip[1]);
+      ip += 2;
+      REG_DISPATCH();
+    }
+    REG_CASE(R_GSTORE):
+    {
+      //全局环境中存放的是对象，立即数需要装箱
+      frame->setOuterObj(ip[1], RK(ip[0]).toObject());
+      ip += 2;
+      REG_DISPATCH();
+    }
+    REG_CASE(R_CLOAD):
+    {
+      regs[ip[0]] = frame->getFunction()->upvalue(ip[1])->value_;
+      ip += 2;
+      REG_DISPATCH();
+    }
+    REG_CASE(R_CSTORE):
+    {
+      frame->getFunction()->upvalue(ip[1])->value_ = RK(ip[0]);
+      ip += 2;
+      REG_DISPATCH();
+    }
+    REG_CASE(R_LOAD_CELL):
+    {
+      regs[ip[0]] = regs[ip[1]].objectAs<Cell>()->value_;
+      ip += 2;
+      REG_DISPATCH();
+    }
+    REG_CASE(R_STORE_CELL):
+    {
+      regs[ip[1]].objectAs<Cell>()->value_ = RK(ip[0]);
+      ip += 2;
+      REG_DISPATCH();
+    }
+    REG_CASE(R_CALL):
+    REG_CASE(R_TAILCALL):
+    REG_CASE(R_INVOKE):
+    {
+      unsigned instruction = ip[-1];
+      bool tailCall = instruction == R_TAILCALL;
+      unsigned funcReg = ip[0];
+      unsigned paramsNum = ip[1];
+      if (instruction == R_INVOKE) {
+        //通过内联缓存找到方法，替换寄存器中的接收者
+        regs[funcReg] = dotAccess(frame, ip[2], regs[funcReg]);
+        ip += 3;
+      }
+      else {
+        ip += 2;
+      }
+      const Value &funcObj = regs[funcReg];
+      size_t argsBase = frame->getBase() + funcReg + 1;
+
+      if (funcObj.is(ObjKind::FUNCTION)) {
+        FuncObject *func = funcObj.objectAs<FuncObject>();
+
+        //如果调用函数是没有编译过的，需要运行时编译
+        if (!func->isCompile())
+          func->compile();
+
+        if (tailCall) {
+          //函数和实参覆盖当前的函数对象和栈帧窗口，复用调用栈中的位置
+          size_t dest = frame->getBase() - 1;
+          Value *values = operandStack->base();
+          for (size_t i = 0; i <= paramsNum; ++i)
+            values[dest + i] = std::move(values[argsBase - 1 + i]);
+          callStack_->pop();
+          pushRegisterFrame(func, dest + 1, paramsNum);
+          REG_LOAD_FRAME();
+          REG_DISPATCH();
+        }
+
+        //保存当前的指令计数器，压入新的栈帧后切换过去
+        frame->setIp(ip - codes);
+        pushRegisterFrame(func, argsBase, paramsNum);
+        REG_LOAD_FRAME();
+        REG_DISPATCH();
+      }
+      else if (funcObj.is(ObjKind::NATIVE_FUNC)) {
+        //原生函数和实参移到操作数栈顶后调用，返回值留在函数所在的寄存器中
+        size_t frameTop = operandStack->size();
+        NativeFunction *func = funcObj.objectAs<NativeFunction>();
+        operandStack->shrink(argsBase + paramsNum);
+        callNative(func, paramsNum);
+        operandStack->grow(frameTop);
+        REG_DISPATCH();
+      }
+      else {
+        MyDebugger::print(static_cast<int>(funcObj.kind()), __FILE__, __LINE__);
+        throw VMException("Invalid type for function call");
+      }
+    }
+    REG_CASE(R_RET):
+    {
+      //回收栈帧窗口，返回值写入调用者存放函数对象的寄存器
+      Value result = RK(ip[0]);
+      size_t dest = frame->getBase() - 1;
+      callStack_->pop();
+      operandStack->shrink(dest);
+      operandStack->push(std::move(result));
+      if (callStack_->empty())
+        return;
+      REG_LOAD_FRAME();
+      operandStack->grow(frame->getBase() +
+          frame->getFunction()->getRegCodes()->getFrameSize());
+      REG_DISPATCH();
+    }
+    REG_CASE(R_JMP):
+    {
+      ip = codes + ip[0];
+      REG_DISPATCH();
+    }
+    REG_CASE(R_BRT):
+    REG_CASE(R_BRF):
+    {
+      const Value &cond = RK(ip[0]);
+      if (!cond.isBool())
+        throw VMException("Invald type for predicate");
+      if (cond.asBool() == (ip[-1] == R_BRT))
+        ip = codes + ip[1];
+      else
+        ip += 2;
+      REG_DISPATCH();
+    }
+    REG_CASE(R_GUARD):
+    {
+      if (frame->getFunction()->inlineGuardHolds(ip[0]))
+        ip += 2;
+      else
+        ip = codes + ip[1];
+      REG_DISPATCH();
+    }
+    REG_CASE(R_ARRAY):
+    {
+      unsigned first = ip[0];
+      unsigned arraySize = ip[1];
+      ip += 2;
+      ArrayPtr array = std::make_shared<Array>(arraySize);
+      for (unsigned i = 0; i < arraySize; ++i)
+        array->set(i, std::move(regs[first + i]));
+      regs[first] = array;
+      REG_DISPATCH();
+    }
+    REG_CASE(R_GETINDEX):
+    {
+      const Value &array = RK(ip[1]);
+      const Value &index = RK(ip[2]);
+      if (!index.isInt())
+        throw VMException("Invalid index type for array access");
+      if (!array.is(ObjKind::Array))
+        throw VMException("Invalid array type for array access");
+      //目标寄存器可能就是数组本身，先复制出元素再写入
+      Value element = array.objectAs<Array>()->get(index.asInt());
+      regs[ip[0]] = std::move(element);
+      ip += 3;
+      REG_DISPATCH();
+    }
+    REG_CASE(R_GETINDEX_I):
+    {
+      const Value &array = RK(ip[1]);
+      int index = RK(ip[2]).asInt();
+      if (!array.is(ObjKind::Array))
+        throw VMException("Invalid array type for array access");
+      Value element = array.objectAs<Array>()->get(index);
+      regs[ip[0]] = std::move(element);
+      ip += 3;
+      REG_DISPATCH();
+    }
+    REG_CASE(R_SETINDEX):
+    {
+      const Value &array = RK(ip[0]);
+      const Value &index = RK(ip[1]);
+      if (!index.isInt())
+        throw VMException("Invalid index type for array assign");
+      if (!array.is(ObjKind::Array))
+        throw VMException("Invalid array type for array assign");
+      array.objectAs<Array>()->set(index.asInt(), RK(ip[2]));
+      ip += 3;
+      REG_DISPATCH();
+    }
+    REG_CASE(R_LAMB):
+    {
+      regs[ip[0]] = newClosure(frame, regs, ip[1]);
+      ip += 2;
+      REG_DISPATCH();
+    }
+    REG_CASE(R_GETDOT):
+    {
+      regs[ip[0]] = dotAccess(frame, ip[2], RK(ip[1]));
+      ip += 3;
+      REG_DISPATCH();
+    }
+    REG_CASE(R_SETDOT):
+    {
+      dotAssign(frame, ip[2], RK(ip[0]), RK(ip[1]));
+      ip += 3;
+      REG_DISPATCH();
+    }
+    REG_CASE(R_NEW):
+    {
+      //类元对象移到操作数栈顶，创建出的对象和初始化函数依次写回寄存器
+      unsigned classReg = *ip++;
+      operandStack->push(regs[classReg]);
+      newInstance();
+      regs[classReg + 1] = operandStack->getAndPop();
+      regs[classReg] = operandStack->getAndPop();
+      REG_DISPATCH();
+    }
+    REG_CASE(R_HALT):
+    {
+      return;
+    }
+#ifndef SPARROW_THREADED_DISPATCH
+    default:
+    {
+      throw VMException("UNKNOWN REGISTER CODE");
+    }
+#endif
+  }
+}
+
+#undef RK
+#undef REG_LOAD_FRAME
+#undef REG_DISPATCH
+#undef REG_CASE
@@ -3,6 +3,10 @@
 #include <cmath>
 #include <algorithm>
 #include "code.h"
+#include "reg_code.h"
+#ifdef SPARROW_JIT
+#include "jit.h"
+#endif
 #include "../symbols.h"
 #include "../ast_list.h"
 #include "../pre_process/lamb_src.h"
@@ -10,142 +14,209 @@
 
 /*****************************栈帧************************************/
 
-StackFrame::StackFrame(FuncPtr funcObj):outerNames_(funcObj->getOuterNames()) {
-  env_ = funcObj->runtimeEnv();
-  codes_ = funcObj->getCodes();
-  //if (codes_ == nullptr)
-    //MyDebugger::print("null codes", __FILE__, __LINE__);
-  //else
-    //MyDebugger::print(codes_->getCodeSize(), __FILE__, __LINE__);
-  codeSize_ = codes_->getCodeSize();
+StackFrame::StackFrame() = default;
+
+void StackFrame::init(FuncObject *funcObj, size_t base) {
+  env_ = funcObj->nonLocalEnv();
+  func_ = funcObj;
+  codes_ = funcObj->getCodes()->getCodes().data();
+  jitCode_ = funcObj->getCodes()->getJitCode();
+  outerNames_ = funcObj->getOuterNames().get();
+  base_ = base;
   ip_ = 0;
 }
 
-void StackFrame::initParams(const std::vector<ObjectPtr> &arguments) {
-  //局部环境中的头几个对象是参数
-  
-  //如果不是原生函数，由于编译顺序和出栈顺序相反，所以需要反顺序初始化
-  unsigned localIndex = 0;
-  for (auto iter = arguments.rbegin(); iter != arguments.rend(); ++iter) {
-    env_->put(localIndex, *iter);
-    ++localIndex;
-  }
+void StackFrame::initRegister(FuncObject *funcObj, size_t base) {
+  init(funcObj, base);
+  codes_ = funcObj->getRegCodes()->getCodeBase();
+  jitCode_ = nullptr;
 }
 
-unsigned StackFrame::getCode() {
-  if (ip_ >= codeSize_)
-    throw VMException("fatal error: memory out of range");
-  return codes_->get(ip_++);
+void StackFrame::release() {
+  env_ = nullptr;
 }
 
-void StackFrame::setIp(unsigned ip) {
-  ip_ = ip;
+size_t StackFrame::getBase() const {
+  return base_;
 }
 
-bool StackFrame::isEnd() {
-  return ip_ >= codeSize_;
+unsigned *StackFrame::getCodeBase() const {
+  return codes_;
 }
 
-ObjectPtr StackFrame::getOuterObj(unsigned nameIndex) {
-  if (outerNames_->empty()) {
-    MyDebugger::print("empty outer names", __FILE__, __LINE__);
-  }
-  return env_->get((*outerNames_)[nameIndex]);
+JitCode *StackFrame::getJitCode() const {
+  return jitCode_;
 }
 
-ObjectPtr StackFrame::getLocalObj(unsigned index) {
-  return env_->get(index);
+void StackFrame::attachJitCode() {
+  jitCode_ = func_->getCodes()->getJitCode();
 }
 
-void StackFrame::setOuterObj(unsigned nameIndex, ObjectPtr obj) {
-  env_->put((*outerNames_)[nameIndex], obj);
+unsigned StackFrame::getIp() const {
+  return ip_;
 }
 
-void StackFrame::setLocalObj(unsigned index, ObjectPtr obj) {
-  env_->put(index, obj);
+void StackFrame::setIp(unsigned ip) {
+  ip_ = ip;
 }
 
-EnvPtr StackFrame::getEnv() const {
-  return env_;
+Value StackFrame::getOuterObj(unsigned nameIndex) {
+  const GlobalRef &ref = func_->resolveGlobal(nameIndex);
+  switch (ref.kind) {
+    case GlobalRef::Kind::SLOT:
+      return Value(ref.env->getSlot(ref.slot));
+    case GlobalRef::Kind::FUNCTION:
+      return Value(func_->shared_from_this());
+    case GlobalRef::Kind::OUTER_ENV:
+      return Value(func_->outerEnv());
+    default:
+      //找不到的变量仍按名字查找，由环境抛出异常
+      return Value(env_->get((*outerNames_)[nameIndex]));
+  }
+}
+
+void StackFrame::setOuterObj(unsigned nameIndex, ObjectPtr obj) {
+  const GlobalRef &ref = func_->resolveGlobal(nameIndex);
+  if (ref.kind == GlobalRef::Kind::SLOT)
+    ref.env->putSlot(ref.slot, std::move(obj));
+  else
+    env_->put((*outerNames_)[nameIndex], obj);
+}
+
+FuncObject *StackFrame::getFunction() const {
+  return func_;
 }
 
 std::string StackFrame::getNames(unsigned index) {
   if (index >= outerNames_->size())
-    throw VMException("index out of range while getting raw string");
+    throw VMException("index out of range while getting name");
   return (*outerNames_)[index];
 }
 
+DotCache &StackFrame::getDotCache(unsigned index) {
+  return func_->getDotCache(index);
+}
+
 /****************************调用栈*********************************/
 
-CallStack::CallStack() = default;
+//调用栈的初始容量
+static const size_t kInitCallStackSize = 256;
+
+//调用栈的最大深度，超过时认为发生了无穷递归
+static const size_t kMaxCallStackDepth = 1000000;
+
+CallStack::CallStack(): frames_(kInitCallStackSize) {}
 
 bool CallStack::empty() const {
-  return stack_.empty();
+  return depth_ == 0;
 }
 
-void CallStack::push(StackFramePtr stackFrame) {
-  stack_.push(stackFrame);
+StackFrame &CallStack::push() {
+  if (depth_ == frames_.size()) {
+    if (depth_ == kMaxCallStackDepth)
+      throw VMException("Call Stack overflow while calling push");
+    frames_.emplace_back();
+  }
+  return frames_[depth_++];
 }
 
-StackFramePtr CallStack::top() const {
-  if (stack_.empty())
+StackFrame &CallStack::top() {
+  if (depth_ == 0)
     throw VMException("Call Stack is empty while calling top");
-  else
-    return stack_.top();
+  return frames_[depth_ - 1];
 }
 
 void CallStack::pop() {
-  stack_.pop();
-}
-
-StackFramePtr CallStack::getAndPop() {
-  if (stack_.empty()) {
-    throw VMException("Call Stack is empty while calling get and pop");
-  }
-  else {
-    StackFramePtr result = stack_.top();
-    stack_.pop();
-    return result;
-  }
+  frames_[--depth_].release();
 }
 
 /************************操作数栈*********************************/
 
-OperandStack::OperandStack() = default;
+//操作数栈的初始容量
+static const size_t kInitOperandStackSize = 1024;
+
+OperandStack::OperandStack(): values_(kInitOperandStackSize) {}
 
 bool OperandStack::empty() const {
-  return stack_.empty(); 
+  return top_ == 0; 
 }
 
 void OperandStack::clear() {
-  while (!stack_.empty())
-    stack_.pop();
+  shrink(0);
 }
 
-void OperandStack::push(ObjectPtr obj) {
-  stack_.push(obj);
+void OperandStack::push(Value value) {
+#ifndef NDEBUG
+  if (top_ >= values_.size())
+    throw VMException("Operand Stack overflow while calling push");
+#endif
+  values_[top_++] = std::move(value);
 }
 
-ObjectPtr OperandStack::top() const {
-  if (stack_.empty())
+const Value &OperandStack::top() const {
+  if (top_ == 0)
     throw VMException("Operand Stack is empty while calling top");
   else
-    return stack_.top();
+    return values_[top_ - 1];
 }
 
 void OperandStack::pop() {
-  stack_.pop();
+#ifndef NDEBUG
+  if (top_ == 0)
+    throw VMException("Operand Stack is empty while calling pop");
+#endif
+  values_[--top_].reset();
 }
 
-ObjectPtr OperandStack::getAndPop() {
-  if (stack_.empty()) {
+Value OperandStack::getAndPop() {
+#ifndef NDEBUG
+  if (top_ == 0)
     throw VMException("Operand Stack is empty while calling get and pop");
-  }
-  else {
-    ObjectPtr result = stack_.top();
-    stack_.pop();
-    return result;
-  }
+#endif
+  //移出而不是复制，避免对象引用计数的增减
+  return std::move(values_[--top_]);
+}
+
+size_t OperandStack::size() const {
+  return top_;
+}
+
+Value &OperandStack::at(size_t index) {
+#ifndef NDEBUG
+  if (index >= top_)
+    throw VMException("index out of range while accessing Operand Stack");
+#endif
+  return values_[index];
+}
+
+Value *OperandStack::base() {
+  return values_.data();
+}
+
+void OperandStack::reserve(size_t n) {
+  if (top_ + n > values_.size())
+    values_.resize(std::max(values_.size() * 2, top_ + n));
+}
+
+void OperandStack::grow(size_t newSize) {
+#ifndef NDEBUG
+  if (newSize > values_.size() || newSize < top_)
+    throw VMException("invalid size while growing Operand Stack");
+#endif
+  top_ = newSize;
+}
+
+void OperandStack::shrink(size_t newSize) {
+  while (top_ > newSize)
+    values_[--top_].reset();
+}
+
+void OperandStack::setSize(size_t newSize) {
+#ifndef NDEBUG
+  if (newSize > values_.size())
+    throw VMException("invalid size while setting Operand Stack");
+#endif
+  top_ = newSize;
 }
 
 /***********************字节码解释器****************************/
@@ -153,84 +224,78 @@ ObjectPtr OperandStack::getAndPop() {
 ByteCodeInterpreter::ByteCodeInterpreter(FuncPtr entry) {
   callStack_ = std::make_shared<CallStack>();
   operandStack_ = std::make_shared<OperandStack>();
-  callStack_->push(std::make_shared<StackFrame>(entry));
+  if (!entry->isCompile())
+    entry->compile();
+  operandStack_->push(entry);
+  if (FuncObject::compileTarget == CompileTarget::REGISTER)
+    pushRegisterFrame(entry.get(), operandStack_->size(), 0);
+  else
+    pushFrame(entry.get(), 0);
 }
 
-void ByteCodeInterpreter::arithmeticTypeCast(ObjectPtr a, ObjectPtr b, Instruction op) {
-  if (a->kind_ == ObjKind::INT && b->kind_ == ObjKind::INT) {
-    IntObjectPtr aInt = std::dynamic_pointer_cast<IntObject>(a);
-    IntObjectPtr bInt = std::dynamic_pointer_cast<IntObject>(b);
-    intArithmeticOp(aInt, bInt, op);
+void ByteCodeInterpreter::arithmeticTypeCast(const Value &a, const Value &b, Instruction op) {
+  if (a.isInt() && b.isInt()) {
+    intArithmeticOp(a.asInt(), b.asInt(), op);
   } 
-  else if (a->kind_ == ObjKind::FLOAT && b->kind_ == ObjKind::FLOAT) {
-    FloatObjectPtr aFloat = std::dynamic_pointer_cast<FloatObject>(a);
-    FloatObjectPtr bFloat = std::dynamic_pointer_cast<FloatObject>(b);
-    floatArithmeticOp(aFloat, bFloat, op);
+  else if (a.isFloat() && b.isFloat()) {
+    floatArithmeticOp(a.asFloat(), b.asFloat(), op);
   }
-  else if (a->kind_ == ObjKind::INT && b->kind_ == ObjKind::FLOAT) {
-    double aValue = std::dynamic_pointer_cast<IntObject>(a)->value_;
-    FloatObjectPtr aFloat = std::make_shared<FloatObject>(aValue);
-    FloatObjectPtr bFloat = std::dynamic_pointer_cast<FloatObject>(b);
-    floatArithmeticOp(aFloat, bFloat, op);
+  else if (a.isInt() && b.isFloat()) {
+    floatArithmeticOp(a.asInt(), b.asFloat(), op);
   }
-  else if (a->kind_ == ObjKind::FLOAT && b->kind_ == ObjKind::INT) {
-    FloatObjectPtr aFloat = std::dynamic_pointer_cast<FloatObject>(a);
-    double bValue = std::static_pointer_cast<IntObject>(b)->value_;
-    FloatObjectPtr bFloat = std::make_shared<FloatObject>(bValue);
-    floatArithmeticOp(aFloat, bFloat, op);
+  else if (a.isFloat() && b.isInt()) {
+    floatArithmeticOp(a.asFloat(), b.asInt(), op);
   }
-  else if (a->kind_ == ObjKind::STRING && b->kind_ == ObjKind::STRING){
-    StrObjectPtr aStr = std::dynamic_pointer_cast<StrObject>(a);
-    StrObjectPtr bStr = std::dynamic_pointer_cast<StrObject>(b);
-    strArithmeticOp(aStr, bStr, op);
+  else if (a.is(ObjKind::STRING) && b.is(ObjKind::STRING)){
+    strArithmeticOp(a.objectAs<StrObject>(), b.objectAs<StrObject>(), op);
   }
-  else if (b->kind_ == ObjKind::NONE) {
+  else if (b.isNone()) {
     if (op == NEQ) 
-      operandStack_->push(std::make_shared<BoolObject>(a->kind_ != ObjKind::NONE));
+      operandStack_->push(Value::makeBool(!a.isNone()));
     else if (op == EQ)
-      operandStack_->push(std::make_shared<BoolObject>(a->kind_ == ObjKind::NONE));
+      operandStack_->push(Value::makeBool(a.isNone()));
     else
       throw VMException("Invalid Operation with None Type");
   }
   else {
-    MyDebugger::print(static_cast<int>(a->kind_), __FILE__, __LINE__);
-    MyDebugger::print(static_cast<int>(b->kind_), __FILE__, __LINE__);
+    MyDebugger::print(static_cast<int>(a.kind()), __FILE__, __LINE__);
+    MyDebugger::print(static_cast<int>(b.kind()), __FILE__, __LINE__);
     //类型不合法，抛出异常
     throw VMException("Invalid type of 2 params for arithmetic operation");
   }
 }
 
-void ByteCodeInterpreter::intArithmeticOp(IntObjectPtr a, IntObjectPtr b, Instruction op) {
+void ByteCodeInterpreter::intArithmeticOp(int a, int b, Instruction op) {
   switch (op) {
     case ADD:
-      operandStack_->push(std::make_shared<IntObject>(a->value_ + b->value_));
+      operandStack_->push(Value::makeInt(a + b));
       break;
     case SUB:
-      operandStack_->push(std::make_shared<IntObject>(a->value_ - b->value_));
+      operandStack_->push(Value::makeInt(a - b));
       break;
     case MUL:
-      operandStack_->push(std::make_shared<IntObject>(a->value_ * b->value_));
+      operandStack_->push(Value::makeInt(a * b));
       break;
     case DIV:
-      operandStack_->push(std::make_shared<IntObject>(a->value_ / b->value_));
+      operandStack_->push(Value::makeInt(a / b));
       break;
     case EQ:
-      operandStack_->push(std::make_shared<BoolObject>(a->value_ == b->value_));
+      operandStack_->push(Value::makeBool(a == b));
       break;
     case LT:
-      operandStack_->push(std::make_shared<BoolObject>(a->value_ < b->value_));
+      operandStack_->push(Value::makeBool(a < b));
       break;
     case BT:
-      operandStack_->push(std::make_shared<BoolObject>(a->value_ > b->value_));
+      operandStack_->push(Value::makeBool(a > b));
       break;
     case LE:
-      operandStack_->push(std::make_shared<BoolObject>(a->value_ <= b->value_));
+      operandStack_->push(Value::makeBool(a <= b));
       break;
     case BE:
-      operandStack_->push(std::make_shared<BoolObject>(a->value_ >= b->value_));
+      operandStack_->push(Value::makeBool(a >= b));
       break;
     case NEQ:
-      operandStack_->push(std::make_shared<BoolObject>(a->value_ != b->value_));
+      operandStack_->push(Value::makeBool(a != b));
       break;
     default:
       //操作符不合法，抛出异常
@@ -238,418 +303,834 @@ void ByteCodeInterpreter::intArithmeticOp(IntObjectPtr a, IntObjectPtr b, Instru
   }
 }
 
-void ByteCodeInterpreter::floatArithmeticOp(FloatObjectPtr a, FloatObjectPtr b, Instruction op) {
+void ByteCodeInterpreter::floatArithmeticOp(double a, double b, Instruction op) {
   switch (op) {
     case ADD:
-      operandStack_->push(std::make_shared<FloatObject>(a->value_ + b->value_));
+      operandStack_->push(Value::makeFloat(a + b));
       break;
     case SUB:
-      operandStack_->push(std::make_shared<FloatObject>(a->value_ - b->value_));
+      operandStack_->push(Value::makeFloat(a - b));
       break;
     case MUL:
-      operandStack_->push(std::make_shared<FloatObject>(a->value_ * b->value_));
+      operandStack_->push(Value::makeFloat(a * b));
       break;
     case DIV:
-      operandStack_->push(std::make_shared<FloatObject>(a->value_ / b->value_));
+      operandStack_->push(Value::makeFloat(a / b));
       break;
     case EQ:
-      {
-        double diff = std::abs(a->value_ - b->value_);
-        operandStack_->push(std::make_shared<BoolObject>(diff <= 1e-10));
-        break;
-      }
+      operandStack_->push(Value::makeBool(std::abs(a - b) <= 1e-10));
+      break;
     case LT:
-      operandStack_->push(std::make_shared<BoolObject>(a->value_ < b->value_));
+      operandStack_->push(Value::makeBool(a < b));
       break;
     case BT:
-      operandStack_->push(std::make_shared<BoolObject>(a->value_ > b->value_));
+      operandStack_->push(Value::makeBool(a > b));
       break;
     case LE:
-      operandStack_->push(std::make_shared<BoolObject>(a->value_ <= b->value_));
+      operandStack_->push(Value::makeBool(a <= b));
       break;
     case BE:
-      operandStack_->push(std::make_shared<BoolObject>(a->value_ >= b->value_));
+      operandStack_->push(Value::makeBool(a >= b));
       break;
     case NEQ:
-      {
-        double diff = std::abs(a->value_ - b->value_);
-        operandStack_->push(std::make_shared<BoolObject>(diff > 1e-10));
-        break;
-      }
+      operandStack_->push(Value::makeBool(std::abs(a - b) > 1e-10));
+      break;
     default:
       //非法操作符，抛出异常
       throw VMException("Invalid operation for float");
   }
 }
 
-void ByteCodeInterpreter::strArithmeticOp(StrObjectPtr a, StrObjectPtr b, Instruction op) {
+void ByteCodeInterpreter::strArithmeticOp(StrObject *a, StrObject *b, Instruction op) {
   switch (op) {
     case ADD:
       operandStack_->push(std::make_shared<StrObject>(a->str_ + b->str_));
       break;
     case EQ:
-      operandStack_->push(std::make_shared<BoolObject>(a->str_ == b->str_));
+      operandStack_->push(Value::makeBool(a->str_ == b->str_));
       break;
     case NEQ:
-      operandStack_->push(std::make_shared<BoolObject>(a->str_ != b->str_));
+      operandStack_->push(Value::makeBool(a->str_ != b->str_));
       break;
     default:
       throw VMException("Invalid operation for string");
   }
 }
 
+void ByteCodeInterpreter::pushFrame(FuncObject *func, unsigned paramsNum) {
+  size_t localSize = func->localVarSize();
+  if (paramsNum > localSize)
+    throw VMException("too many arguments while calling " + func->funcName());
+
+  //栈帧窗口紧跟在函数对象之后，开头是已经压入栈的实参，接着是其余局部变量
+  //一次性预留好局部变量和函数运行时所需的栈空间，之后压栈不再检查容量
+  size_t base = operandStack_->size() - paramsNum;
+  operandStack_->reserve(localSize + func->getCodes()->getMaxStackDepth());
+#ifdef SPARROW_JIT
+  //调用次数达到阈值的函数在建立栈帧之前完成即时编译，这次调用就执行机器码
+  if (Jit::enabled)
+    Jit::countCall(*func->getCodes());
+#endif
+  StackFrame &newStackFrame = callStack_->push();
+  newStackFrame.init(func, base);
+  operandStack_->grow(base + localSize);
+  initCellLocals(func, operandStack_->base() + base);
+}
+
+void ByteCodeInterpreter::pushRegisterFrame(FuncObject *func, size_t base, 
+    unsigned paramsNum) {
+  if (paramsNum > func->localVarSize())
+    throw VMException("too many arguments while calling " + func->funcName());
+
+  //实参之上是调用者已经用完的临时寄存器，释放之后作为新栈帧窗口的一部分
+  //窗口之上再预留两个位置，供借用操作数栈实现的较重指令使用
+  size_t frameSize = func->getRegCodes()->getFrameSize();
+  operandStack_->shrink(base + paramsNum);
+  operandStack_->reserve(frameSize - paramsNum + 2);
+  StackFrame &newStackFrame = callStack_->push();
+  newStackFrame.initRegister(func, base);
+  operandStack_->grow(base + frameSize);
+  initCellLocals(func, operandStack_->base() + base);
+}
+
+void ByteCodeInterpreter::initCellLocals(FuncObject *func, Value *locals) {
+  if (!func->hasCellLocals())
+    return;
+  for (size_t index: func->cellLocals())
+    locals[index] = Value(std::make_shared<Cell>(std::move(locals[index])));
+}
+
+FuncPtr ByteCodeInterpreter::newClosure(StackFrame *frame, Value *locals, 
+    unsigned lambSrcIndex) {
+  LambASTPtr lambAST = g_LambSrcTable->getAST(lambSrcIndex);
+  FuncObject *func = frame->getFunction();
+  std::vector<CellPtr> upvalues;
+  upvalues.reserve(lambAST->upvalueSources().size());
+  for (auto &source: lambAST->upvalueSources()) {
+    if (source.fromLocal)
+      upvalues.push_back(std::static_pointer_cast<Cell>(locals[source.index].object()));
+    else
+      upvalues.push_back(func->upvalue(source.index));
+  }
+  //闭包的外部环境和外层函数相同，不引用外层函数的局部变量
+  return lambAST->makeClosure(func->outerEnv(), std::move(upvalues));
+}
+
+void ByteCodeInterpreter::callNative(NativeFunction *func, unsigned paramsNum) {
+  if (paramsNum != func->paramNum())
+    throw VMException("error function call, not match the number of parameters for " + 
+        func->name());
+
+  //实参按顺序位于函数对象之上，直接把这段操作数栈交给原生函数，不复制、不装箱
+  //函数对象在调用结束前一直留在栈中，保证原生函数存活
+  size_t base = operandStack_->size() - paramsNum;
+  Value result = func->invoke(NativeArgs(operandStack_->base() + base, paramsNum));
+  operandStack_->shrink(base - 1);
+  operandStack_->push(result.isNil() ? Value::makeNone() : std::move(result));
+}
+
+MapEnv *ByteCodeInterpreter::receiverEnv(const Value &receiver) {
+  if (receiver.is(ObjKind::CLASS_INSTANCE))
+    return receiver.objectAs<ClassInstance>()->rawEnvironment()->asMapEnv();
+  else if (receiver.is(ObjKind::ENV))
+    return receiver.objectAs<CommonEnv>()->asMapEnv();
+  else
+    return nullptr;
+}
+
+Value ByteCodeInterpreter::dotAccess(StackFrame *frame, unsigned cacheIndex, 
+    const Value &caller) {
+  DotCache &cache = frame->getDotCache(cacheIndex);
+
+  //缓存命中时直接按槽位读取成员
+  MapEnv *env = receiverEnv(caller);
+  size_t slot;
+  if (env != nullptr) {
+    MapEnv *holder = cache.lookup(env, slot);
+    if (holder != nullptr)
+      return Value(holder->getSlot(slot));
+  }
+
+  std::string member = frame->getNames(cache.nameIndex);
+  ObjectPtr callerObj = caller.toObject();
+  if (callerObj == nullptr)
+    throw VMException("Not found the source object while doing dot access of: " 
+        + member);
+  Value result;
+  if (callerObj->kind_ == ObjKind::CLASS_INSTANCE) {
+    auto instance = std::static_pointer_cast<ClassInstance>(callerObj);
+    result = Value(instance->read(member));
+  }
+  else if (callerObj->kind_ == ObjKind::ENV) {
+    auto callerEnv = std::static_pointer_cast<CommonEnv>(callerObj);
+    result = Value(callerEnv->get(member));
+  }
+  else {
+    throw VMException("UNKNOWN caller type while doing DOT ACCESS: " + member);
+  }
+  if (env != nullptr)
+    cache.update(env, member);
+  return result;
+}
+
+void ByteCodeInterpreter::dotAssign(StackFrame *frame, unsigned cacheIndex, 
+    const Value &caller, Value value) {
+  DotCache &cache = frame->getDotCache(cacheIndex);
+
+  MapEnv *env = receiverEnv(caller);
+  size_t slot;
+  if (env != nullptr) {
+    MapEnv *holder = cache.lookup(env, slot);
+    if (holder != nullptr) {
+      holder->putSlot(slot, value.toObject());
+      return;
+    }
+  }
+
+  std::string member = frame->getNames(cache.nameIndex);
+  ObjectPtr callerObj = caller.toObject();
+  if (callerObj == nullptr)
+    throw VMException("Not found the source object while doing dot assign of: " 
+        + member);
+  if (callerObj->kind_ == ObjKind::CLASS_INSTANCE) {
+    auto instance = std::static_pointer_cast<ClassInstance>(callerObj);
+    instance->write(member, value.toObject());
+  }
+  else if (callerObj->kind_ == ObjKind::ENV) {
+    auto callerEnv = std::static_pointer_cast<CommonEnv>(callerObj);
+    callerEnv->put(member, value.toObject());
+  }
+  else {
+    throw VMException("UNKNOWN caller type while doing DOT ASSIGN: " + member);
+  }
+  if (env != nullptr)
+    cache.update(env, member);
+}
+
+void ByteCodeInterpreter::newInstance() {
+  //类元对象
+  ObjectPtr classInfoObj = operandStack_->getAndPop().toObject();
+  if (classInfoObj->kind_ != ObjKind::CLASS_INFO)
+    throw VMException("Invalid caller for creaing class instance");
+  ClassInfoPtr classInfo = std::dynamic_pointer_cast<ClassInfo>(classInfoObj);
+
+  //对象的本质是一个环境，把编译过的类环境复制给它，并调用初始化函数
+  EnvPtr instanceEnv = std::dynamic_pointer_cast<CommonEnv>(
+                        classInfo->getComliedEnv()->copy());
+  
+  //创建对象，并把对象压入操作数栈
+  //下一轮的栈帧是初始化对象的，结束了以后，这个新创建的对象，才会被当前栈帧所使用
+  InstancePtr newInstance = std::make_shared<ClassInstance>(instanceEnv);
+  operandStack_->push(newInstance);
+  
+  //如果未定义init函数，则抛出异常
+  try {
+    instanceEnv->get("init");
+  } catch (EnvException &e) {
+    throw VMException("class " + classInfo->name() + " not found init function");
+  }
+  ObjectPtr initFuncObj = newInstance->read("init");
+  if (initFuncObj->kind_ != ObjKind::FUNCTION)
+    throw VMException("Invalid init member in class: " + classInfo->name());
+  FuncPtr initFunc = std::dynamic_pointer_cast<FuncObject>(initFuncObj);
+
+  //把初始函数压入栈，下一轮循环会执行CALL指令
+  operandStack_->push(initFunc);
+}
+
+#ifdef SPARROW_JIT
+unsigned ByteCodeInterpreter::runJit(StackFrame *frame, Value *locals, unsigned position) {
+  JitContext context;
+  context.interpreter = this;
+  context.frame = frame;
+  context.locals = locals;
+  context.sp = operandStack_->base() + operandStack_->size();
+  unsigned exit = frame->getJitCode()->run(&context, position);
+  operandStack_->setSize(context.sp - operandStack_->base());
+  return exit;
+}
+
+bool ByteCodeInterpreter::osrAtBackEdge(StackFrame *frame, unsigned branch) {
+  if (!Jit::countBackEdge(*frame->getFunction()->getCodes(), branch))
+    return false;
+  frame->attachJitCode();
+  return true;
+}
+#endif
+
+/**指令分派
+ * 定义了SPARROW_THREADED_DISPATCH时使用GCC的computed goto实现直接线索化分派，
+ * 每条指令执行完后直接跳转到下一条指令的处理代码；否则退化为可移植的switch循环
+ * 两种方式共用同一份指令实现，差别只在下面几个宏
+ */
+#ifdef SPARROW_OPCODE_PROFILE
+#define VM_PROFILE() profiler_.record(*ip)
+#else
+#define VM_PROFILE() ((void)0)
+#endif
+
+//指令实现都以普通的goto回到dispatch，离开作用域时局部变量会被正常析构；
+//computed goto跳出作用域时不会调用析构函数，所以只放在dispatch处，
+//编译器会把这条间接跳转复制到每条指令实现的末尾
+#ifdef SPARROW_THREADED_DISPATCH
+#define VM_CASE(op) L_##op
+#else
+#define VM_CASE(op) case op
+#endif
+#define VM_DISPATCH() goto dispatch
+
+//切换栈帧后重新加载缓存的栈帧、字节码、指令计数器和栈帧窗口
+#define VM_LOAD_FRAME() \
+  do { \
+    frame = &callStack_->top(); \
+    codes = frame->getCodeBase(); \
+    ip = codes + frame->getIp(); \
+    locals = operandStack->base() + frame->getBase(); \
+  } while (0)
+
+//当前栈帧有机器码时从ip处进入机器码，机器码在需要解释执行的指令处返回
+//只放在切换栈帧和调用原生函数之后，其余指令都在机器码中执行
+#ifdef SPARROW_JIT
+#define VM_ENTER_JIT() \
+  do { \
+    if (frame->getJitCode() != nullptr) \
+      ip = codes + runJit(frame, locals, ip - codes); \
+  } while (0)
+#else
+#define VM_ENTER_JIT() ((void)0)
+#endif
+
 void ByteCodeInterpreter::run() {
-  while (!callStack_->empty()) {
-    stackFrame_ = callStack_->top();
+  if (FuncObject::compileTarget == CompileTarget::REGISTER) {
+    runRegister();
+    return;
+  }
 
-    //对于不带return语句的函数，运行到最后一句时函数结束
-    if (stackFrame_->isEnd()) {
-      //MyDebugger::print("finish", __FILE__, __LINE__);
-      callStack_->pop();
-      continue;
-    }
-    unsigned code = stackFrame_->getCode();
-    switch (code) {
-      case ADD:
-      case SUB:
-      case MUL:
-      case DIV:
-      case MOD:
-      case EQ:
-      case LT:
-      case BT:
-      case LE:
-      case BE:
-      case NEQ:
-      {
-        ObjectPtr a = operandStack_->getAndPop();
-        ObjectPtr b = operandStack_->getAndPop();
-        arithmeticTypeCast(a, b, static_cast<Instruction>(code));
-        break;
-      }
-      case SCONST:
-      {
-        unsigned index = stackFrame_->getCode();
-        operandStack_->push(std::make_shared<StrObject>(g_StrSymbols->get(index)));
-        break;
+#ifdef SPARROW_THREADED_DISPATCH
+  //顺序必须和Instruction的定义一致
+  static void *dispatchTable[] = {
+    &&L_ADD, &&L_SUB, &&L_MUL, &&L_DIV, &&L_MOD,
+    &&L_EQ, &&L_LT, &&L_BT, &&L_LE, &&L_BE, &&L_NEQ,
+    &&L_SCONST, &&L_ICONST, &&L_FCONST,
+    &&L_NCONST,
+    &&L_CALL,
+    &&L_TAILCALL,
+    &&L_INVOKE,
+    &&L_RET,
+    &&L_BR, &&L_BRT, &&L_BRF,
+    &&L_GUARD,
+    &&L_AND, &&L_OR,
+    &&L_GLOAD, &&L_GSTORE,
+    &&L_CLOAD, &&L_CSTORE,
+    &&L_LOAD, &&L_STORE,
+    &&L_LOAD_CELL, &&L_STORE_CELL,
+    &&L_ARRAY_GENERATE,
+    &&L_ARRAY_ACCCESS, &&L_ARRAY_ASSIGN,
+    &&L_LAMB,
+    &&L_DOT_ACCESS,
+    &&L_DOT_ASSIGN,
+    &&L_NEW_INSTANCE,
+    &&L_NEG,
+    &&L_POP,
+    &&L_INC_LOCAL, &&L_LOCAL_LT_BRF, &&L_LOCAL_ARRAY_ACCESS,
+    &&L_ADD_INT_INT, &&L_SUB_INT_INT, &&L_MUL_INT_INT, &&L_DIV_INT_INT,
+    &&L_EQ_INT_INT, &&L_LT_INT_INT, &&L_BT_INT_INT, &&L_LE_INT_INT, &&L_BE_INT_INT,
+    &&L_NEQ_INT_INT,
+    &&L_ADD_STR_STR,
+    &&L_ADD_I, &&L_SUB_I, &&L_MUL_I, &&L_DIV_I,
+    &&L_EQ_I, &&L_LT_I, &&L_BT_I, &&L_LE_I, &&L_BE_I, &&L_NEQ_I,
+    &&L_ARRAY_ACCESS_I,
+    &&L_HALT
+  };
+  static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) == HALT + 1,
+      "dispatch table does not match the instruction set");
+#endif
+
+  //当前栈帧、字节码起始地址、指令计数器以及栈帧窗口只在CALL、RET时重新加载
+  //操作数栈只会在CALL时扩容，所以指向栈帧窗口的指针在两次CALL、RET之间都是有效的
+  StackFrame *frame = nullptr;
+  unsigned *codes = nullptr;
+  unsigned *ip = nullptr;
+  Value *locals = nullptr;
+  OperandStack *operandStack = operandStack_.get();
+
+  if (callStack_->empty())
+    return;
+  VM_LOAD_FRAME();
+
+dispatch:
+  VM_PROFILE();
+#ifdef SPARROW_THREADED_DISPATCH
+  goto *dispatchTable[*ip++];
+  {
+#else
+  switch (*ip++) {
+#endif
+    VM_CASE(ADD):
+    VM_CASE(SUB):
+    VM_CASE(MUL):
+    VM_CASE(DIV):
+    VM_CASE(MOD):
+    VM_CASE(EQ):
+    VM_CASE(LT):
+    VM_CASE(BT):
+    VM_CASE(LE):
+    VM_CASE(BE):
+    VM_CASE(NEQ):
+    {
+      Value a = operandStack->getAndPop();
+      Value b = operandStack->getAndPop();
+      Instruction op = static_cast<Instruction>(ip[-1]);
+      //根据这次遇到的操作数类型，把指令原地改写成特化形式
+      if (a.isInt() && b.isInt())
+        ip[-1] = Code::intSpecialized(op);
+      else if (op == ADD && a.is(ObjKind::STRING) && b.is(ObjKind::STRING))
+        ip[-1] = ADD_STR_STR;
+      arithmeticTypeCast(a, b, op);
+      VM_DISPATCH();
+    }
+
+/**特化的整数二元运算
+ * 栈顶的两个操作数都是整数时直接运算，用结果替换这两个操作数；
+ * 否则说明该处的操作数类型发生了变化，把指令改回通用形式后重新执行
+ */
+#define VM_INT_BINARY_OP(op, generic, make, expr) \
+    VM_CASE(op): \
+    { \
+      Value &right = operandStack->at(operandStack->size() - 2); \
+      const Value &left = operandStack->top(); \
+      if (left.isInt() && right.isInt()) { \
+        int a = left.asInt(); \
+        int b = right.asInt(); \
+        operandStack->pop(); \
+        right = Value::make(expr); \
+        VM_DISPATCH(); \
+      } \
+      ip[-1] = generic; \
+      --ip; \
+      VM_DISPATCH(); \
+    }
+
+    VM_INT_BINARY_OP(ADD_INT_INT, ADD, makeInt, a + b)
+    VM_INT_BINARY_OP(SUB_INT_INT, SUB, makeInt, a - b)
+    VM_INT_BINARY_OP(MUL_INT_INT, MUL, makeInt, a * b)
+    VM_INT_BINARY_OP(DIV_INT_INT, DIV, makeInt, a / b)
+    VM_INT_BINARY_OP(EQ_INT_INT, EQ, makeBool, a == b)
+    VM_INT_BINARY_OP(LT_INT_INT, LT, makeBool, a < b)
+    VM_INT_BINARY_OP(BT_INT_INT, BT, makeBool, a > b)
+    VM_INT_BINARY_OP(LE_INT_INT, LE, makeBool, a <= b)
+    VM_INT_BINARY_OP(BE_INT_INT, BE, makeBool, a >= b)
+    VM_INT_BINARY_OP(NEQ_INT_INT, NEQ, makeBool, a != b)
+
+#undef VM_INT_BINARY_OP
+
+/**有类型的整数二元运算
+ * 编译时已经证明两个操作数都是整数，不检查类型，直接用结果替换这两个操作数
+ */
+#define VM_TYPED_INT_BINARY_OP(op, make, expr) \
+    VM_CASE(op): \
+    { \
+      Value &right = operandStack->at(operandStack->size() - 2); \
+      int a = operandStack->top().asInt(); \
+      int b = right.asInt(); \
+      operandStack->pop(); \
+      right = Value::make(expr); \
+      VM_DISPATCH(); \
+    }
+
+    VM_TYPED_INT_BINARY_OP(ADD_I, makeInt, a + b)
+    VM_TYPED_INT_BINARY_OP(SUB_I, makeInt, a - b)
+    VM_TYPED_INT_BINARY_OP(MUL_I, makeInt, a * b)
+    VM_TYPED_INT_BINARY_OP(DIV_I, makeInt, a / b)
+    VM_TYPED_INT_BINARY_OP(EQ_I, makeBool, a == b)
+    VM_TYPED_INT_BINARY_OP(LT_I, makeBool, a < b)
+    VM_TYPED_INT_BINARY_OP(BT_I, makeBool, a > b)
+    VM_TYPED_INT_BINARY_OP(LE_I, makeBool, a <= b)
+    VM_TYPED_INT_BINARY_OP(BE_I, makeBool, a >= b)
+    VM_TYPED_INT_BINARY_OP(NEQ_I, makeBool, a != b)
+
+#undef VM_TYPED_INT_BINARY_OP
+
+    VM_CASE(ADD_STR_STR):
+    {
+      const Value &left = operandStack->top();
+      const Value &right = operandStack->at(operandStack->size() - 2);
+      if (left.is(ObjKind::STRING) && right.is(ObjKind::STRING)) {
+        StrObjectPtr str = std::make_shared<StrObject>(
+            left.objectAs<StrObject>()->str_ + right.objectAs<StrObject>()->str_);
+        operandStack->pop();
+        operandStack->pop();
+        operandStack->push(str);
+        VM_DISPATCH();
       }
-      case ICONST:
-      {
-        unsigned index = stackFrame_->getCode();
-        operandStack_->push(std::make_shared<IntObject>(g_IntSymbols->get(index)));
-        break;
+      ip[-1] = ADD;
+      --ip;
+      VM_DISPATCH();
+    }
+    VM_CASE(SCONST):
+    {
+      unsigned index = *ip++;
+      operandStack->push(g_StrSymbols->getObject(index));
+      VM_DISPATCH();
+    }
+    VM_CASE(ICONST):
+    {
+      unsigned index = *ip++;
+      operandStack->push(Value::makeInt(g_IntSymbols->get(index)));
+      VM_DISPATCH();
+    }
+    VM_CASE(FCONST):
+    {
+      unsigned index = *ip++;
+      operandStack->push(Value::makeFloat(g_FloatSymbols->get(index)));
+      VM_DISPATCH();
+    }
+    VM_CASE(NCONST):
+    {
+      operandStack->push(Value::makeNone());
+      VM_DISPATCH();
+    }
+    VM_CASE(INVOKE):
+    {
+      //通过内联缓存找到方法，替换实参之下的接收者
+      unsigned cacheIndex = *ip++;
+      Value &receiver = operandStack->at(operandStack->size() - *ip - 1);
+      receiver = dotAccess(frame, cacheIndex, receiver);
+    }
+    //接着执行CALL，此时ip正好指向实参个数
+    VM_CASE(CALL):
+    {
+      //实参个数
+      unsigned paramsNum = *ip++;
+      //获得函数对象，它位于实参之下
+      //有可能是普通函数，也有可能是原生函数
+      const Value &funcObj = operandStack->at(operandStack->size() - paramsNum - 1);
+
+      if (funcObj.is(ObjKind::FUNCTION)) {
+        FuncObject *func = funcObj.objectAs<FuncObject>();
+
+        //如果调用函数是没有编译过的，需要运行时编译
+        if (!func->isCompile())
+          func->compile();
+
+        //保存当前的指令计数器，压入新的栈帧后切换过去
+        frame->setIp(ip - codes);
+        pushFrame(func, paramsNum);
+        VM_LOAD_FRAME();
+        VM_ENTER_JIT();
+        VM_DISPATCH();
       }
-      case FCONST:
-      {
-        unsigned index = stackFrame_->getCode();
-        operandStack_->push(std::make_shared<FloatObject>(g_FloatSymbols->get(index)));
-        break;
+      else if (funcObj.is(ObjKind::NATIVE_FUNC)) {
+        callNative(funcObj.objectAs<NativeFunction>(), paramsNum);
+        VM_ENTER_JIT();
+        VM_DISPATCH();
       }
-      case CALL:
-      {
-        //实参个数
-        unsigned paramsNum = stackFrame_->getCode();
-        //获得实参
-        std::vector<ObjectPtr> params;
-        for (size_t i = 0; i < paramsNum; ++i)
-          params.push_back(operandStack_->getAndPop());
-        //获得函数对象
-        //有可能是普通函数，也有可能是原生函数
-        ObjectPtr funcObj = operandStack_->getAndPop();
-
-        if (funcObj->kind_ == ObjKind::FUNCTION) {
-          FuncPtr func = std::dynamic_pointer_cast<FuncObject>(funcObj);
-
-          //如果调用函数是没有编译过的，需要运行时编译
-          if (!func->isCompile())
-            func->compile();
-
-          //新建一个栈帧，并初始化它的形参
-          StackFramePtr newStackFrame = std::make_shared<StackFrame>(func);
-          newStackFrame->initParams(params);
-          //压入调用栈，下一轮循环将执行新的函数
-          callStack_->push(newStackFrame);
-          break;
-        }
-        else if (funcObj->kind_ == ObjKind::NATIVE_FUNC) {
-          NativeFuncPtr func = std::dynamic_pointer_cast<NativeFunction>(funcObj);
-          //需要把参数倒序
-          std::reverse(params.begin(), params.end());
-          ObjectPtr result = func->invoke(params);
-          if (result != nullptr)
-            operandStack_->push(result);
-          break;
-        }
-        else {
-          MyDebugger::print(static_cast<int>(funcObj->kind_), __FILE__, __LINE__);
-          throw VMException("Invalid type for function call");
-        }
+      else {
+        MyDebugger::print(static_cast<int>(funcObj.kind()), __FILE__, __LINE__);
+        throw VMException("Invalid type for function call");
       }
-      case RET:
-      {
+    }
+    VM_CASE(TAILCALL):
+    {
+      unsigned paramsNum = *ip++;
+      size_t funcIndex = operandStack->size() - paramsNum - 1;
+      const Value &funcObj = operandStack->at(funcIndex);
+
+      if (funcObj.is(ObjKind::FUNCTION)) {
+        FuncObject *func = funcObj.objectAs<FuncObject>();
+        if (!func->isCompile())
+          func->compile();
+
+        //函数对象和实参覆盖当前的函数对象和栈帧窗口，复用调用栈中的位置
+        size_t dest = frame->getBase() - 1;
+        Value *values = operandStack->base();
+        for (size_t i = 0; i <= paramsNum; ++i)
+          values[dest + i] = std::move(values[funcIndex + i]);
+        operandStack->shrink(dest + paramsNum + 1);
         callStack_->pop();
-        break;
-      }
-      case BR:
-      {
-        unsigned position = stackFrame_->getCode();
-        stackFrame_->setIp(position);
-        break;
-      }
-      case BRT:
-      {
-        unsigned position = stackFrame_->getCode();
-        ObjectPtr condObj = operandStack_->getAndPop();
-        if (condObj->kind_ != ObjKind::BOOL)
-          throw VMException("Invald type for predicate");
-        BoolObjectPtr cond = std::dynamic_pointer_cast<BoolObject>(condObj);
-        if (cond->b_)
-          stackFrame_->setIp(position);
-        break;
-      }
-      case BRF:
-      {
-        unsigned position = stackFrame_->getCode();
-        ObjectPtr condObj = operandStack_->getAndPop();
-        if (condObj->kind_ != ObjKind::BOOL)
-          throw VMException("Invald type for predicate");
-        BoolObjectPtr cond = std::dynamic_pointer_cast<BoolObject>(condObj);
-        if (!cond->b_)
-          stackFrame_->setIp(position);
-        break;
+        pushFrame(func, paramsNum);
+        VM_LOAD_FRAME();
+        VM_ENTER_JIT();
+        VM_DISPATCH();
       }
-      case AND:
-      {
-        ObjectPtr a = operandStack_->getAndPop();
-        ObjectPtr b = operandStack_->getAndPop();
-        if (a->kind_ != ObjKind::BOOL || b->kind_ != ObjKind::BOOL)
-          throw VMException("Invalid Logic Type for AND");
-        BoolObjectPtr aCond = std::dynamic_pointer_cast<BoolObject>(a);
-        BoolObjectPtr bCond = std::dynamic_pointer_cast<BoolObject>(b);
-        if (aCond->b_ && bCond->b_)
-          operandStack_->push(std::make_shared<BoolObject>(true));
-        else
-          operandStack_->push(std::make_shared<BoolObject>(false));
-        break;
+      else if (funcObj.is(ObjKind::NATIVE_FUNC)) {
+        callNative(funcObj.objectAs<NativeFunction>(), paramsNum);
+        VM_ENTER_JIT();
+        VM_DISPATCH();
       }
-      case OR:
-      {
-        ObjectPtr a = operandStack_->getAndPop();
-        ObjectPtr b = operandStack_->getAndPop();
-        if (a->kind_ != ObjKind::BOOL || b->kind_ != ObjKind::BOOL)
-          throw VMException("Invalid Logic Type for OR");
-        BoolObjectPtr aCond = std::dynamic_pointer_cast<BoolObject>(a);
-        BoolObjectPtr bCond = std::dynamic_pointer_cast<BoolObject>(b);
-        if (aCond->b_ || bCond->b_)
-          operandStack_->push(std::make_shared<BoolObject>(true));
-        else
-          operandStack_->push(std::make_shared<BoolObject>(false));
-        break;
+      else {
+        MyDebugger::print(static_cast<int>(funcObj.kind()), __FILE__, __LINE__);
+        throw VMException("Invalid type for function call");
       }
-      case GLOAD:
-      {
-        unsigned nameIndex = stackFrame_->getCode();
-        ObjectPtr target = stackFrame_->getOuterObj(nameIndex);
-        operandStack_->push(target);
-        break;
-      }
-      case GSTORE:
-      {
-        unsigned nameIndex = stackFrame_->getCode();
-        ObjectPtr target = operandStack_->getAndPop();     
-        stackFrame_->setOuterObj(nameIndex, target);
-        break;
-      }
-      case CLOAD:
-      {
-        //环境并没有直接提供获取lamb变量的接口
-        //此处的处理方法是获取上一层环境（一定是Lamb所在的外部函数局部环境）来获取变量        
-        unsigned outerIndex = stackFrame_->getCode();
-        EnvPtr outerEnv = stackFrame_->getEnv()->getOuterEnv();
-        operandStack_->push(outerEnv->get(outerIndex));
-        break;        
-      }
-      case CSTORE:
-      {
-        ObjectPtr target = operandStack_->getAndPop();
-        unsigned outerIndex = stackFrame_->getCode();
-        EnvPtr outerEnv = stackFrame_->getEnv()->getOuterEnv();
-        outerEnv->put(outerIndex, target);
-        break;
-      }
-      case LOAD:
-      {
-        unsigned index = stackFrame_->getCode();
-        ObjectPtr target = stackFrame_->getLocalObj(index);
-        operandStack_->push(target);
-        break;
-      }
-      case STORE:
-      {
-        unsigned index = stackFrame_->getCode();
-        ObjectPtr target = operandStack_->getAndPop();
-        stackFrame_->setLocalObj(index, target);
-        break;
-      }
-      case ARRAY_GENERATE:
-      {
-        unsigned arraySize = stackFrame_->getCode();
-        ArrayPtr array = std::make_shared<Array>(arraySize);
-        //编译时是顺序编译的，数组后面的元素先出栈
-        for (int i = arraySize - 1; i >= 0; --i)
-          array->set(i, operandStack_->getAndPop());
-        operandStack_->push(array);
-        break;
-      }
-      case ARRAY_ACCCESS:
-      {
-        ObjectPtr indexObj = operandStack_->getAndPop();
-        if (indexObj->kind_ != ObjKind::INT)
-          throw VMException("Invalid index type for array access");
-        IntObjectPtr index = std::dynamic_pointer_cast<IntObject>(indexObj);
-        ObjectPtr arrayObj = operandStack_->getAndPop();
-        if (arrayObj->kind_ != ObjKind::Array)
-          throw VMException("Invalid array type for array access");
-        ArrayPtr array = std::dynamic_pointer_cast<Array>(arrayObj);
-        operandStack_->push(array->get(index->value_));
-        break;
-      }
-      case ARRAY_ASSIGN:
-      {
-        ObjectPtr indexObj = operandStack_->getAndPop();
-        if (indexObj->kind_ != ObjKind::INT)
-          throw VMException("Invalid index type for array assign");
-        IntObjectPtr index = std::dynamic_pointer_cast<IntObject>(indexObj);
-        ObjectPtr arrayObj = operandStack_->getAndPop();
-        if (arrayObj->kind_ != ObjKind::Array)
-          throw VMException("Invalid array type for array assign");
-        ArrayPtr array = std::dynamic_pointer_cast<Array>(arrayObj);
-        array->set(index->value_, operandStack_->getAndPop());
-        break;
-      }
-      case LAMB:
-      {
-        unsigned lambSrcIndex = stackFrame_->getCode();
-        LambASTPtr lambAST = g_LambSrcTable->getAST(lambSrcIndex);
-        FuncPtr lambFunc = lambAST->runtimeCompile(stackFrame_->getEnv());
-        //需要把lamb函数的编译状态设为义编译
-        lambFunc->setCompiled();
-        operandStack_->push(lambFunc);
-        break;
+    }
+    VM_CASE(RET):
+    {
+      //回收栈帧窗口和函数对象，再压入返回值
+      Value result = operandStack->getAndPop();
+      operandStack->shrink(frame->getBase() - 1);
+      operandStack->push(std::move(result));
+      callStack_->pop();
+      if (callStack_->empty())
+        return;
+      VM_LOAD_FRAME();
+      VM_ENTER_JIT();
+      VM_DISPATCH();
+    }
+    VM_CASE(BR):
+    {
+      unsigned position = *ip;
+#ifdef SPARROW_JIT
+      //向回跳转是循环的回边，循环足够热时在循环头转入机器码
+      if (Jit::enabled && codes + position < ip && osrAtBackEdge(frame, ip - 1 - codes)) {
+        ip = codes + position;
+        VM_ENTER_JIT();
+        VM_DISPATCH();
       }
-      case DOT_ACCESS:
-      {
-        ObjectPtr targetObj = operandStack_->getAndPop();
-        if (targetObj->kind_ != ObjKind::STRING)
-          throw VMException("Invalid dot access");
-        StrObjectPtr target = std::dynamic_pointer_cast<StrObject>(targetObj);
-
-        ObjectPtr callerObj = operandStack_->getAndPop();
-        if (callerObj == nullptr)
-          throw VMException("Not found the source object while doing dot access of: " 
-              + target->str_);
-        if (callerObj->kind_ == ObjKind::CLASS_INSTANCE) {
-          auto instance = std::dynamic_pointer_cast<ClassInstance>(callerObj);
-          operandStack_->push(instance->read(target->str_));
-          break;
-        }
-        else if (callerObj->kind_ == ObjKind::ENV) {
-          auto env = std::dynamic_pointer_cast<CommonEnv>(callerObj);
-          operandStack_->push(env->get(target->str_));
-          break;
-        }
-        else {
-          throw VMException("UNKNOWN caller type while doing DOT ACCESS: " + target->str_);
-        }
+#endif
+      ip = codes + position;
+      VM_DISPATCH();
+    }
+    VM_CASE(BRT):
+    {
+      unsigned position = *ip++;
+      Value cond = operandStack->getAndPop();
+      if (!cond.isBool())
+        throw VMException("Invald type for predicate");
+      if (cond.asBool())
+        ip = codes + position;
+      VM_DISPATCH();
+    }
+    VM_CASE(BRF):
+    {
+      unsigned position = *ip++;
+      Value cond = operandStack->getAndPop();
+      if (!cond.isBool())
+        throw VMException("Invald type for predicate");
+      if (!cond.asBool())
+        ip = codes + position;
+      VM_DISPATCH();
+    }
+    VM_CASE(GUARD):
+    {
+      unsigned guardIndex = *ip++;
+      unsigned position = *ip++;
+      if (!frame->getFunction()->inlineGuardHolds(guardIndex))
+        ip = codes + position;
+      VM_DISPATCH();
+    }
+    VM_CASE(AND):
+    {
+      Value a = operandStack->getAndPop();
+      Value b = operandStack->getAndPop();
+      if (!a.isBool() || !b.isBool())
+        throw VMException("Invalid Logic Type for AND");
+      operandStack->push(Value::makeBool(a.asBool() && b.asBool()));
+      VM_DISPATCH();
+    }
+    VM_CASE(OR):
+    {
+      Value a = operandStack->getAndPop();
+      Value b = operandStack->getAndPop();
+      if (!a.isBool() || !b.isBool())
+        throw VMException("Invalid Logic Type for OR");
+      operandStack->push(Value::makeBool(a.asBool() || b.asBool()));
+      VM_DISPATCH();
+    }
+    VM_CASE(GLOAD):
+    {
+      unsigned nameIndex = *ip++;
+      operandStack->push(frame->getOuterObj(nameIndex));
+      VM_DISPATCH();
+    }
+    VM_CASE(GSTORE):
+    {
+      unsigned nameIndex = *ip++;
+      //全局环境中存放的是对象，立即数需要装箱
+      frame->setOuterObj(nameIndex, operandStack->getAndPop().toObject());
+      VM_DISPATCH();
+    }
+    VM_CASE(CLOAD):
+    {
+      unsigned upvalueIndex = *ip++;
+      operandStack->push(frame->getFunction()->upvalue(upvalueIndex)->value_);
+      VM_DISPATCH();
+    }
+    VM_CASE(CSTORE):
+    {
+      unsigned upvalueIndex = *ip++;
+      frame->getFunction()->upvalue(upvalueIndex)->value_ = operandStack->getAndPop();
+      VM_DISPATCH();
+    }
+    VM_CASE(LOAD):
+    {
+      unsigned index = *ip++;
+      operandStack->push(locals[index]);
+      VM_DISPATCH();
+    }
+    VM_CASE(STORE):
+    {
+      unsigned index = *ip++;
+      locals[index] = operandStack->getAndPop();
+      VM_DISPATCH();
+    }
+    VM_CASE(LOAD_CELL):
+    {
+      unsigned index = *ip++;
+      operandStack->push(locals[index].objectAs<Cell>()->value_);
+      VM_DISPATCH();
+    }
+    VM_CASE(STORE_CELL):
+    {
+      unsigned index = *ip++;
+      locals[index].objectAs<Cell>()->value_ = operandStack->getAndPop();
+      VM_DISPATCH();
+    }
+    VM_CASE(ARRAY_GENERATE):
+    {
+      unsigned arraySize = *ip++;
+      ArrayPtr array = std::make_shared<Array>(arraySize);
+      //编译时是顺序编译的，数组后面的元素先出栈
+      for (int i = arraySize - 1; i >= 0; --i)
+        array->set(i, operandStack->getAndPop());
+      operandStack->push(array);
+      VM_DISPATCH();
+    }
+    VM_CASE(ARRAY_ACCCESS):
+    {
+      Value index = operandStack->getAndPop();
+      if (!index.isInt())
+        throw VMException("Invalid index type for array access");
+      Value array = operandStack->getAndPop();
+      if (!array.is(ObjKind::Array))
+        throw VMException("Invalid array type for array access");
+      operandStack->push(array.objectAs<Array>()->get(index.asInt()));
+      VM_DISPATCH();
+    }
+    VM_CASE(ARRAY_ACCESS_I):
+    {
+      int index = operandStack->getAndPop().asInt();
+      Value array = operandStack->getAndPop();
+      if (!array.is(ObjKind::Array))
+        throw VMException("Invalid array type for array access");
+      operandStack->push(array.objectAs<Array>()->get(index));
+      VM_DISPATCH();
+    }
+    VM_CASE(ARRAY_ASSIGN):
+    {
+      Value index = operandStack->getAndPop();
+      if (!index.isInt())
+        throw VMException("Invalid index type for array assign");
+      Value array = operandStack->getAndPop();
+      if (!array.is(ObjKind::Array))
+        throw VMException("Invalid array type for array assign");
+      array.objectAs<Array>()->set(index.asInt(), operandStack->getAndPop());
+      VM_DISPATCH();
+    }
+    VM_CASE(LAMB):
+    {
+      unsigned lambSrcIndex = *ip++;
+      operandStack->push(newClosure(frame, locals, lambSrcIndex));
+      VM_DISPATCH();
+    }
+    VM_CASE(DOT_ACCESS):
+    {
+      unsigned cacheIndex = *ip++;
+      Value caller = operandStack->getAndPop();
+      operandStack->push(dotAccess(frame, cacheIndex, caller));
+      VM_DISPATCH();
+    }
+    VM_CASE(DOT_ASSIGN):
+    {
+      unsigned cacheIndex = *ip++;
+      Value caller = operandStack->getAndPop();
+      Value value = operandStack->getAndPop();
+      dotAssign(frame, cacheIndex, caller, std::move(value));
+      VM_DISPATCH();
+    }
+    VM_CASE(NEW_INSTANCE):
+    {
+      newInstance();
+      VM_ENTER_JIT();
+      VM_DISPATCH();
+    }
+    VM_CASE(NEG):
+    {
+      Value obj = operandStack->getAndPop();
+      if (obj.isInt()) {
+        operandStack->push(Value::makeInt(-obj.asInt()));
+        VM_DISPATCH();
       }
-      case DOT_ASSIGN:
-      {
-        ObjectPtr targetObj = operandStack_->getAndPop();
-        if (targetObj->kind_ != ObjKind::STRING)
-          throw VMException("Invalid dot access");
-        StrObjectPtr target = std::dynamic_pointer_cast<StrObject>(targetObj);
-
-        ObjectPtr callerObj = operandStack_->getAndPop();
-        if (callerObj->kind_ == ObjKind::CLASS_INSTANCE) {
-          auto instance = std::dynamic_pointer_cast<ClassInstance>(callerObj);
-          instance->write(target->str_, operandStack_->getAndPop());
-          break;
-        }
-        else if (callerObj->kind_ == ObjKind::ENV) {
-          auto env = std::dynamic_pointer_cast<CommonEnv>(callerObj);
-          env->put(target->str_, operandStack_->getAndPop());
-          break;
-        }
-        else {
-          throw VMException("UNKNOWN caller type while doing DOT ASSIGN: " + target->str_);
-        }
+      else if (obj.isFloat()) {
+        operandStack->push(Value::makeFloat(-obj.asFloat()));
+        VM_DISPATCH();
       }
-      case RAW_STRING:
-      {
-        unsigned index = stackFrame_->getCode();
-        StrObjectPtr str = std::make_shared<StrObject>(stackFrame_->getNames(index));
-        operandStack_->push(str);
-        break;
+      else {
+        throw VMException("Invalid type for NEG");
       }
-      case NEW_INSTANCE:
-      {
-        //类元对象
-        ObjectPtr classInfoObj = operandStack_->getAndPop();
-        if (classInfoObj->kind_ != ObjKind::CLASS_INFO)
-          throw VMException("Invalid caller for creaing class instance");
-        ClassInfoPtr classInfo = std::dynamic_pointer_cast<ClassInfo>(classInfoObj);
-
-        //对象的本质是一个环境，把编译过的类环境复制给它，并调用初始化函数
-        EnvPtr instanceEnv = std::dynamic_pointer_cast<CommonEnv>(
-                              classInfo->getComliedEnv()->copy());
-        
-        //创建对象，并把对象压入操作数栈
-        //下一轮的栈帧是初始化对象的，结束了以后，这个新创建的对象，才会被当前栈帧所使用
-        InstancePtr newInstance = std::make_shared<ClassInstance>(instanceEnv);
-        operandStack_->push(newInstance);
-        
-        //如果未定义init函数，则抛出异常
-        try {
-          instanceEnv->get("init");
-        } catch (EnvException &e) {
-          throw VMException("class " + classInfo->name() + " not found init function");
-        }
-        ObjectPtr initFuncObj = newInstance->read("init");
-        if (initFuncObj->kind_ != ObjKind::FUNCTION)
-          throw VMException("Invalid init member in class: " + classInfo->name());
-        FuncPtr initFunc = std::dynamic_pointer_cast<FuncObject>(initFuncObj);
-
-        //把初始函数压入栈，下一轮循环会执行CALL指令
-        operandStack_->push(initFunc);
-        break;
+    }
+    VM_CASE(POP):
+    {
+      operandStack->pop();
+      VM_DISPATCH();
+    }
+    VM_CASE(INC_LOCAL):
+    {
+      Value &local = locals[ip[0]];
+      int k = static_cast<int>(ip[1]);
+      ip += 2;
+      if (local.isInt()) {
+        local = Value::makeInt(local.asInt() + k);
       }
-      case NEG:
-      {
-        ObjectPtr obj = operandStack_->getAndPop();
-        if (obj->kind_ == ObjKind::INT) {
-          IntObjectPtr intObj = std::dynamic_pointer_cast<IntObject>(obj);
-          IntObjectPtr negObj = std::make_shared<IntObject>(-intObj->value_);
-          operandStack_->push(negObj);
-          break;
-        }
-        else if (obj->kind_ == ObjKind::FLOAT) {
-          FloatObjectPtr floatObj = std::dynamic_pointer_cast<FloatObject>(obj);
-          FloatObjectPtr negObj = std::make_shared<FloatObject>(-floatObj->value_);
-          operandStack_->push(negObj);
-          break;
-        }
-        else {
-          throw VMException("Invalid type for NEG");
-        }
+      else {
+        arithmeticTypeCast(local, Value::makeInt(k), ADD);
+        local = operandStack->getAndPop();
       }
-      case HALT:
-      {
-        return;
+      VM_DISPATCH();
+    }
+    VM_CASE(LOCAL_LT_BRF):
+    {
+      const Value &a = locals[ip[0]];
+      const Value &b = locals[ip[1]];
+      unsigned position = ip[2];
+      ip += 3;
+      bool less;
+      if (a.isInt() && b.isInt()) {
+        less = a.asInt() < b.asInt();
       }
-      default:
-      {
-        throw VMException("UNKNOWN CODE");
+      else {
+        arithmeticTypeCast(a, b, LT);
+        less = operandStack->getAndPop().asBool();
       }
+      if (!less)
+        ip = codes + position;
+      VM_DISPATCH();
     }
+    VM_CASE(LOCAL_ARRAY_ACCESS):
+    {
+      const Value &array = locals[ip[0]];
+      const Value &index = locals[ip[1]];
+      ip += 2;
+      if (!index.isInt())
+        throw VMException("Invalid index type for array access");
+      if (!array.is(ObjKind::Array))
+        throw VMException("Invalid array type for array access");
+      operandStack->push(array.objectAs<Array>()->get(index.asInt()));
+      VM_DISPATCH();
+    }
+    VM_CASE(HALT):
+    {
+      return;
+    }
+#ifndef SPARROW_THREADED_DISPATCH
+    default:
+    {
+      throw VMException("UNKNOWN CODE");
+    }
+#endif
   }
 }
+
+#undef VM_PROFILE
+#undef VM_CASE
+#undef VM_DISPATCH
+#undef VM_LOAD_FRAME
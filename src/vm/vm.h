@@ -11,9 +11,12 @@
 
 #include <string>
 #include <exception>
-#include <stack>
+#include <vector>
 #include <memory>
 #include "../env.h"
+#ifdef SPARROW_OPCODE_PROFILE
+#include "opcode_profile.h"
+#endif
 
 /*****************************异常************************************/
 class VMException: public std::exception {
@@ -26,62 +29,86 @@ private:
   std::string errMsg_;
 };
 
+class JitCode;
+
 /*****************************栈帧************************************/
 
+//栈帧对象由调用栈统一分配并重复使用，调用函数时不再需要申请内存
 class StackFrame {
 public:
-  StackFrame(FuncPtr funcObj);
+  StackFrame();
 
-  //初始化形参
-  void initParams(const std::vector<ObjectPtr> &arguments);
+  //初始化栈帧
+  //base是栈帧窗口在操作数栈中的起始位置，函数对象位于base - 1，
+  //栈帧存活期间由操作数栈上的这个位置保证函数对象不被释放
+  void init(FuncObject *funcObj, size_t base);
 
-  //获取当前的指令，计数器加一
-  unsigned getCode();
+  //初始化执行寄存器字节码的栈帧
+  void initRegister(FuncObject *funcObj, size_t base);
 
-  //设置计数器
-  void setIp(unsigned ip);
+  //栈帧出栈时释放对运行时环境的引用
+  void release();
+
+  //栈帧窗口的起始位置
+  size_t getBase() const;
 
-  //是否已经结束
-  bool isEnd();
+  //获取字节码的起始地址，解释器据此直接取指
+  //解释器执行时会把部分指令原地改写成特化形式，所以字节码不是只读的
+  unsigned *getCodeBase() const;
 
-  //获取非局部变量
-  ObjectPtr getOuterObj(unsigned nameIndex);
+  //即时编译得到的机器码，函数压栈时还没有编译则为空
+  JitCode *getJitCode() const;
+
+  //函数在栈帧执行期间完成了即时编译，栈帧改为执行新的机器码
+  void attachJitCode();
+
+  //获取计数器
+  unsigned getIp() const;
+
+  //设置计数器
+  void setIp(unsigned ip);
 
-  //获取局部变量
-  ObjectPtr getLocalObj(unsigned index);
+  //获取非局部变量，变量位置由函数对象解析并缓存
+  Value getOuterObj(unsigned nameIndex);
 
   //设置非局部变量
   void setOuterObj(unsigned nameIndex, ObjectPtr obj);
 
-  //设置局部变量
-  void setLocalObj(unsigned index, ObjectPtr obj); 
-
-  //返回运行时的局部环境
-  EnvPtr getEnv() const;
+  //获取正在执行的函数
+  FuncObject *getFunction() const;
 
   //获取名字字符
   std::string getNames(unsigned index);
 
+  //获取域访问点的内联缓存
+  DotCache &getDotCache(unsigned index);
+
 private:
-  //运行时局部环境
+  //函数共享的只用于查找非局部变量的环境，局部变量都在操作数栈上
   EnvPtr env_;
 
   //指令计数器
-  unsigned ip_;
+  unsigned ip_ = 0;
+
+  //正在执行的函数，由操作数栈上base - 1处的函数对象保证存活
+  FuncObject *func_ = nullptr;
 
   //字节码
-  CodePtr codes_;
+  unsigned *codes_ = nullptr;
 
-  //字节码的长度
-  unsigned codeSize_;
+  //字节码对应的机器码
+  JitCode *jitCode_ = nullptr;
 
   //非局部变量的名称
-  std::shared_ptr<std::vector<std::string>> outerNames_;
+  std::vector<std::string> *outerNames_ = nullptr;
+
+  //栈帧窗口的起始位置
+  size_t base_ = 0;
 };
-using StackFramePtr = std::shared_ptr<StackFrame>;
 
 /****************************调用栈*********************************/
 
+//调用栈是一个栈帧池，出栈的栈帧留在池中，下次压栈时重新初始化使用
 class CallStack {
 public:
   CallStack(); 
@@ -89,25 +116,30 @@ public:
   //是否为空
   bool empty() const;
 
-  //压入
-  void push(StackFramePtr stackFrame);
+  //压入一个栈帧并返回，调用者负责初始化
+  //压栈可能使池扩容，之前获取的栈帧引用会失效
+  StackFrame &push();
 
   //返回栈顶元素
-  StackFramePtr top() const;
+  StackFrame &top();
 
   //弹出栈顶元素
   void pop();
 
-  //返回栈顶元素，并弹出
-  StackFramePtr getAndPop();
-
 private:
-  std::stack<StackFramePtr> stack_;
+  std::vector<StackFrame> frames_;
+
+  //当前栈帧的个数
+  size_t depth_ = 0;
 };
 using CallStackPtr = std::shared_ptr<CallStack>;
 
 /************************操作数栈*********************************/
 
+//操作数栈是一段连续的、预先分配好的数组，用下标作为栈顶指针
+//函数的形参和局部变量也存放在操作数栈上，即栈帧窗口
+//Release版本中压栈、出栈不做越界检查，其容量由调用函数前的reserve保证；
+//Debug版本（未定义NDEBUG）会检查越界并抛出异常
 class OperandStack {
 public:
   OperandStack();
@@ -119,49 +151,120 @@ public:
   void clear();
 
   //压入栈
-  void push(ObjectPtr obj);
+  void push(Value value);
 
   //返回栈顶元素
-  ObjectPtr top() const;
+  const Value &top() const;
 
   //弹出栈顶元素
   void pop();
 
   //返回栈顶元素，并弹出
-  ObjectPtr getAndPop();
+  Value getAndPop();
+
+  //栈中元素的个数，即栈顶指针
+  size_t size() const;
+
+  //获取指定位置的元素
+  Value &at(size_t index);
+
+  //栈的起始地址，栈扩容之后失效
+  Value *base();
+
+  //保证栈顶之上至少还有n个空位
+  void reserve(size_t n);
+
+  //栈顶指针上移到指定位置，新增的位置都是空对象
+  void grow(size_t newSize);
+
+  //栈顶指针下移到指定位置，并释放其上的对象
+  void shrink(size_t newSize);
+
+  //直接设置栈顶指针，用于和即时编译的机器码同步栈顶，不初始化或释放任何位置
+  void setSize(size_t newSize);
 
 private:
-  std::stack<ObjectPtr> stack_;
+  std::vector<Value> values_;
+
+  //栈顶指针，指向下一个空位
+  size_t top_ = 0;
 };
 using OperandStackPtr = std::shared_ptr<OperandStack>;
 
 /***********************字节码解释器****************************/
 
 class ByteCodeInterpreter {
+  //即时编译的机器码调用的运行时函数，见jit.cc
+  friend class JitRuntime;
+
 public:
   ByteCodeInterpreter(FuncPtr entry);
 
+  //按编译目标执行栈式字节码或寄存器字节码
   void run();
 
 private:
+  //寄存器字节码的解释循环，见reg_vm.cc
+  void runRegister();
+
   //运算时类型转换
-  void arithmeticTypeCast(ObjectPtr a, ObjectPtr b, Instruction op);
+  void arithmeticTypeCast(const Value &a, const Value &b, Instruction op);
 
   //整型运算操作
-  void intArithmeticOp(IntObjectPtr a, IntObjectPtr b, Instruction op);
+  void intArithmeticOp(int a, int b, Instruction op);
 
   //浮点型运算操作
-  void floatArithmeticOp(FloatObjectPtr a, FloatObjectPtr b, Instruction op);
+  void floatArithmeticOp(double a, double b, Instruction op);
 
   //字符串型运算操作
-  void strArithmeticOp(StrObjectPtr a, StrObjectPtr b, Instruction op);
+  void strArithmeticOp(StrObject *a, StrObject *b, Instruction op);
+
+  //以下是较重的指令的实现，放在分派循环之外，使分派循环保持紧凑
+
+  //为函数建立栈帧并压入调用栈，函数对象和实参已经依次位于操作数栈顶
+  void pushFrame(FuncObject *func, unsigned paramsNum);
+
+  //为执行寄存器字节码的函数建立栈帧，实参从base开始依次位于调用者的寄存器中
+  //操作数栈的栈顶随之移到新栈帧窗口的末尾
+  void pushRegisterFrame(FuncObject *func, size_t base, unsigned paramsNum);
+
+  //把被lamb引用的局部变量装入单元，函数和它创建的闭包通过单元共享这些变量
+  static void initCellLocals(FuncObject *func, Value *locals);
+
+  //创建闭包，从当前栈帧的局部变量和闭包变量中取得它引用的单元
+  static FuncPtr newClosure(StackFrame *frame, Value *locals, unsigned lambSrcIndex);
+
+  //调用原生函数，原生函数和实参已经依次位于操作数栈顶，调用结果压入栈中
+  void callNative(NativeFunction *func, unsigned paramsNum);
+
+  //域访问和域赋值的接收者所在的map环境，接收者不是对象或环境时返回空指针
+  static MapEnv *receiverEnv(const Value &receiver);
+
+  //域访问，返回接收者的成员
+  static Value dotAccess(StackFrame *frame, unsigned cacheIndex, const Value &receiver);
+
+  //域赋值，把值赋给接收者的成员
+  static void dotAssign(StackFrame *frame, unsigned cacheIndex, const Value &receiver,
+      Value value);
+
+  //创建对象，并把对象和它的初始化函数压入栈中
+  void newInstance();
+
+  //从position处进入当前栈帧的机器码，返回之后需要解释执行的指令位置
+  unsigned runJit(StackFrame *frame, Value *locals, unsigned position);
+
+  //解释执行branch处的循环回边，循环足够热时栈帧转入机器码，返回是否可以转入
+  static bool osrAtBackEdge(StackFrame *frame, unsigned branch);
 
 private: 
   CallStackPtr callStack_;
 
   OperandStackPtr operandStack_;
 
-  StackFramePtr stackFrame_;
+#ifdef SPARROW_OPCODE_PROFILE
+  //指令序列统计
+  OpcodeProfiler profiler_;
+#endif
 };
 
 #endif
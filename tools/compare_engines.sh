@@ -0,0 +1,41 @@
+#!/bin/bash
+#不同执行方式的一致性测试脚本
+#用法：./compare_engines.sh <解释器路径>
+#testFiles下的*_vm.spr和bench下的测试程序分别用栈式字节码、开启即时编译的
+#栈式字节码和寄存器字节码运行，以栈式字节码的输出为准比较另外两种方式的输出。
+#栈式字节码运行出错、输出中含有failed或者输出不一致时打印原因并以非零值退出
+
+VM=$(realpath "${1:-../build/vm/main}")
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+status=0
+for file in "$ROOT"/testFiles/*_vm.spr "$ROOT"/bench/*_bench.spr; do
+  name=$(basename "$(dirname "$file")")_$(basename "$file")
+  cd "$(dirname "$file")"
+  for engine in stack jit register; do
+    flag=""
+    [ "$engine" = jit ] && flag="--jit"
+    [ "$engine" = register ] && flag="--register"
+    "$VM" $flag "$(basename "$file")" > "$OUT/$name.$engine" 2>&1
+    echo "exit code $?" >> "$OUT/$name.$engine"
+  done
+
+  #三种方式同样出错时输出也是一致的，所以先单独检查栈式字节码的运行结果
+  if [ "$(tail -n 1 "$OUT/$name.stack")" != "exit code 0" ] ||
+      grep -q failed "$OUT/$name.stack"; then
+    cat "$OUT/$name.stack"
+    echo "$file: stack run failed"
+    status=1
+  fi
+  for engine in jit register; do
+    if ! diff -u "$OUT/$name.stack" "$OUT/$name.$engine"; then
+      echo "$file: $engine differs from stack"
+      status=1
+    fi
+  done
+done
+
+[ $status -eq 0 ] && echo "all outputs match"
+exit $status
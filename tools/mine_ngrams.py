@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+#指令序列挖掘工具
+#汇总以SPARROW_OPCODE_PROFILE选项编译的解释器输出的统计文件，按合并成超级指令后
+#能省去的指令分派次数排序，输出最值得合并的指令序列
+#
+#用法：
+#  cmake -S src -B build_prof -DSPARROW_OPCODE_PROFILE=ON && cmake --build build_prof
+#  SPARROW_OPCODE_PROFILE=ops.prof build_prof/vm/main bench/qsort_bench.spr
+#  SPARROW_OPCODE_PROFILE=ops.prof build_prof/vm/main bench/fib_bench.spr
+#  python3 tools/mine_ngrams.py ops.prof [-n 20] [--min-length 2]
+
+import argparse
+import collections
+import sys
+
+
+def load(paths):
+    counts = collections.Counter()
+    for path in paths:
+        with open(path) as f:
+            for line in f:
+                line = line.strip()
+                if not line:
+                    continue
+                count, sequence = line.split('\t', 1)
+                counts[tuple(sequence.split())] += int(count)
+    return counts
+
+
+def main():
+    parser = argparse.ArgumentParser(description='mine frequent opcode n-grams')
+    parser.add_argument('profiles', nargs='+', help='profile files written by the VM')
+    parser.add_argument('-n', '--top', type=int, default=20, help='number of sequences to show')
+    parser.add_argument('--min-length', type=int, default=2, help='shortest sequence to show')
+    args = parser.parse_args()
+
+    counts = load(args.profiles)
+    if not counts:
+        print('no profile data', file=sys.stderr)
+        return 1
+
+    #合并n条指令可以省去n-1次分派
+    total = sum(c for seq, c in counts.items() if len(seq) == 2)
+    ranked = sorted(((c * (len(seq) - 1), c, seq) for seq, c in counts.items()
+                     if len(seq) >= args.min_length), reverse=True)
+
+    print('%-10s %-12s %-8s %s' % ('saved', 'count', 'share', 'sequence'))
+    for saved, count, seq in ranked[:args.top]:
+        share = 100.0 * count / total if total else 0.0
+        print('%-10d %-12d %-8s %s' % (saved, count, '%.2f%%' % share, ' '.join(seq)))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())